@@ -0,0 +1,95 @@
+#ifndef CAPTURE_SET_H
+#define CAPTURE_SET_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include "kate_regex.hpp"
+
+namespace util {
+
+//The groups of a match that dynamic rules go on to substitute (%0 to %9), copied
+//out of the input so that they do not depend on the line they were matched in.
+//Only the groups asked for are kept (bit n for group n), and their text is
+//stored inline unless it is long. Groups that are not kept are empty.
+class capture_set {
+public:
+    static constexpr size_t max_groups = 10;
+
+private:
+    static constexpr size_t inline_size = 24;
+    
+    //Group n is the text from the end of group n-1 to ends[n]
+    uint32_t ends[max_groups];
+    char local[inline_size];
+    std::string spilled;
+    
+    bool is_spilled() const { return ends[max_groups-1] > inline_size; }
+    
+    template<typename F>
+    void copy_groups(uint16_t groups, F&& group){
+        size_t total = 0;
+        for(size_t n = 0; n < max_groups; ++n){
+            if(groups & (1u << n))
+                total += group(n).size();
+        }
+        
+        char* text = local;
+        if(total > inline_size){
+            spilled.resize(total);
+            text = &spilled[0];
+        }
+        
+        uint32_t end = 0;
+        for(size_t n = 0; n < max_groups; ++n){
+            if(groups & (1u << n)){
+                std::string_view str = group(n);
+                if(!str.empty())
+                    std::memcpy(text + end, str.data(), str.size());
+                end += str.size();
+            }
+            ends[n] = end;
+        }
+    }
+
+public:
+    capture_set() : ends(), local(), spilled() {}
+    
+    void assign(const kate_regex::match_results& match, uint16_t groups){
+        if(groups == 0)
+            clear();
+        else
+            copy_groups(groups, [&](size_t n){ return match.view(n); });
+    }
+    
+    //Captures are only handed on to states that use the same groups or fewer
+    //(see context::collect_groups), so a state that replaces the one they
+    //belong to keeps them as they are
+    void assign(const capture_set& other, uint16_t groups){
+        if(&other == this)
+            return;
+        
+        if(groups == 0)
+            clear();
+        else
+            copy_groups(groups, [&](size_t n){ return other[n]; });
+    }
+    
+    void clear(){ std::fill(ends, ends + max_groups, 0); }
+    
+    std::string_view operator[](size_t n) const {
+        if(n >= max_groups)
+            return std::string_view();
+        
+        size_t begin = (n == 0) ? 0 : ends[n-1];
+        return std::string_view((is_spilled() ? spilled.data() : local) + begin, ends[n] - begin);
+    }
+
+};
+
+};
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef CHAR_SCAN_H
+#define CHAR_SCAN_H
+
+#include <cstddef>
+
+namespace util {
+
+//Vectorized searches over a span of bytes. The kernel is chosen on first use:
+//AVX2 if the processor has it, otherwise SSE2 (or plain scalar code on other
+//architectures). Each returns end if there is no such byte.
+
+//A byte that LaTeX output can not copy as is: a backslash, a brace or a
+//control character (anything below 0x20, including tab and newline)
+inline bool is_latex_special(char ch){
+    unsigned char c = ch;
+    return c < 0x20 || c == '\\' || c == '{' || c == '}';
+}
+
+const char* find_latex_special_wide(const char* begin, const char* end);
+
+//First such byte. Most tokens are short, and not worth calling the kernel for
+inline const char* find_latex_special(const char* begin, const char* end){
+    if(end - begin >= 16)
+        return find_latex_special_wide(begin, end);
+    
+    for(; begin < end; ++begin){
+        if(is_latex_special(*begin))
+            return begin;
+    }
+    return end;
+}
+
+//First newline
+const char* find_newline(const char* begin, const char* end);
+
+//"avx2", "sse2" or "scalar"
+const char* scan_kernel_name();
+
+};
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef CONTENT_HASH_H
+#define CONTENT_HASH_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace util {
+
+//64-bit FNV-1a. Unlike std::hash, the result is the same between runs and
+//builds, so it can be stored in files. Not meant to resist deliberate collisions.
+class content_hash {
+private:
+    uint64_t hash;
+
+public:
+    
+    content_hash() : hash(0xcbf29ce484222325) {}
+    
+    content_hash& add(std::string_view str){
+        for(unsigned char c : str){
+            hash ^= c;
+            hash *= 0x100000001b3;
+        }
+        return *this;
+    }
+    
+    //Strings are length-prefixed, so that ("ab", "c") and ("a", "bc") differ
+    content_hash& add_field(std::string_view str){
+        add(std::to_string(str.size()) + ":");
+        return add(str);
+    }
+    
+    uint64_t value() const { return hash; }
+    
+    std::string hex() const {
+        static constexpr const char* digits = "0123456789abcdef";
+        
+        std::string str(16, '0');
+        for(size_t i = 0; i < 16; ++i)
+            str[i] = digits[(hash >> (60 - 4*i)) & 0xF];
+        return str;
+    }
+
+};
+
+};
+
+#endif
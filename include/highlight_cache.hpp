@@ -0,0 +1,47 @@
+#ifndef HIGHLIGHT_CACHE_H
+#define HIGHLIGHT_CACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+//Highlighted output kept between runs and shared between documents, keyed on
+//a hash of everything the output depends on (see latex_highlight::highlight_key).
+//Each entry is a file in the entries subdirectory, named by its key, and nothing
+//else in there is ever touched: the directory is chosen by the user and may hold
+//their own files (e.g. -C.). Entries are written to a temporary
+//file and renamed into place, so processes sharing the directory never see a
+//partial entry. Reading an entry touches it, and trim removes the least recently
+//used entries until the directory is within its size limit.
+class highlight_cache {
+private:
+    std::string dir;
+    std::string entries_dir;    //<dir>/entries
+    uint64_t max_size;
+    
+    std::atomic<size_t> hits, misses;
+    
+    std::string entry_file(const std::string& key) const;
+
+public:
+    static constexpr uint64_t default_max_size = 64 << 20;
+    
+    explicit highlight_cache(const std::string& dir, uint64_t max_size = default_max_size);
+    
+    //$XDG_CACHE_HOME/katelistings, or ~/.cache/katelistings
+    static std::string default_dir();
+    
+    const std::string& get_dir() const { return dir; }
+    
+    bool contains(const std::string& key) const;
+    bool get(const std::string& key, std::string& text);
+    void put(const std::string& key, const std::string& text);
+    
+    void trim();
+    
+    size_t hit_count() const { return hits; }
+    size_t miss_count() const { return misses; }
+
+};
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef INPUT_BUFFER_H
+#define INPUT_BUFFER_H
+
+#include <istream>
+#include <string>
+#include <string_view>
+
+namespace util {
+
+//The whole of an input to be highlighted, held in memory so that its lines can
+//be handed out as views rather than copies (see line_source). Regular files are
+//mapped; anything else, such as standard input, is read in large blocks.
+class input_buffer {
+private:
+    std::string storage;
+    void* mapping;
+    size_t mapped;
+    std::string_view text;
+    
+    void read(std::istream& in);
+
+public:
+    explicit input_buffer(const std::string& filename);
+    explicit input_buffer(std::istream& in);
+    ~input_buffer();
+    
+    input_buffer(const input_buffer&) = delete;
+    input_buffer& operator=(const input_buffer&) = delete;
+    
+    std::string_view view() const { return text; }
+
+};
+
+};
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef JOB_POOL_H
+#define JOB_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+//Runs tasks on a fixed number of worker threads. Each worker starts with a
+//contiguous share of the tasks, takes them from the front of its own queue and
+//steals from the back of the others' when it runs out, so one long task only
+//holds up the worker running it. Tasks write their messages to a log that is
+//printed in task order, so the output is the same as when running sequentially.
+//A task fails by throwing: the logs before it are still printed, the tasks after
+//it are skipped, and run rethrows once no task is running any more.
+class job_pool {
+public:
+    using task = std::function<void(std::ostream& log)>;
+
+private:
+    struct queue {
+        std::mutex lock;
+        std::deque<size_t> tasks;
+    };
+    
+    size_t n_workers;
+    std::vector<task> tasks;
+    
+    //Filled in by the workers as tasks finish
+    std::vector<std::string> logs;
+    std::vector<std::exception_ptr> errors;
+    std::vector<bool> finished;
+    size_t first_failed;
+    std::mutex finished_lock;
+    std::condition_variable finished_cond;
+    
+    bool next_task(std::vector<queue>& queues, size_t worker, size_t& task_idx);
+    void work(std::vector<queue>& queues, size_t worker);
+
+public:
+    
+    explicit job_pool(size_t workers)
+    : n_workers(workers ? workers : 1), tasks(), logs(), errors(), finished(), first_failed(0) {}
+    
+    void add(task t) { tasks.push_back(std::move(t)); }
+    
+    //Runs all tasks added so far, printing their logs to out as they become available.
+    //Rethrows what the first failed task threw, after printing the logs before it
+    void run(std::ostream& out = std::cout);
+    
+    //The number of workers to use for -j 0
+    static size_t default_workers();
+
+};
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef KATE_REGEX_H
+#define KATE_REGEX_H
+
+#include <bitset>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace util {
+
+//Regular expressions in the dialect used by Kate syntax files (a subset of PCRE).
+//Patterns are compiled to a Thompson NFA and executed by a Pike VM, which tracks
+//captures without backtracking. Only patterns with backreferences fall back to a
+//backtracking matcher, as do the captures of loops whose body can match nothing
+//(see match_at).
+//
+//Supported: literals, ., classes (incl. ranges, negation, \d\w\s\h and [:posix:]),
+//^ $ \b \B \A \z \Z \G, greedy/lazy/possessive quantifiers (possessive treated as greedy),
+//capturing/non-capturing/named groups, lookahead, bounded-length lookbehind,
+//backreferences, inline (?i) flags, \Q...\E, \xHH and an ASCII approximation of \p{..}.
+//Matching is byte-based; subjects are single lines.
+class kate_regex {
+public:
+    
+    class error : public std::runtime_error {
+    public:
+        explicit error(const std::string& msg) : std::runtime_error(msg) {}
+    };
+    
+    class match_results {
+        friend class kate_regex;
+        
+        std::vector<size_t> slots;  //begin and end of each group, npos if unset
+        std::string_view subject;
+    
+    public:
+        match_results() : slots(), subject() {}
+        
+        size_t size() const { return slots.size() / 2; }
+        bool empty() const { return slots.empty(); }
+        
+        //Keeps the storage, so that reused results do not allocate
+        void clear() { slots.clear(); subject = std::string_view(); }
+        
+        size_t position(size_t n = 0) const { return n < size() ? slots[2*n] : std::string::npos; }
+        size_t length(size_t n = 0) const;
+        
+        //The text of group n, or an empty string if it did not participate.
+        //The view is into the subject
+        std::string operator[] (size_t n) const { return std::string(view(n)); }
+        std::string_view view(size_t n) const;
+    };
+
+private:
+    
+    enum opcode : uint8_t {
+        CHAR, ANY, CLASS,
+        SPLIT, JMP, SAVE,
+        ASSERT, LOOK, BACKREF,
+        MATCH
+    };
+    
+    enum assertion : uint8_t {
+        LINE_BEGIN, LINE_END, MATCH_BEGIN, WORD_BOUNDARY, NOT_WORD_BOUNDARY
+    };
+    
+    struct inst {
+        opcode   op;
+        uint8_t  arg;       //character, assertion, or icase flag for BACKREF
+        uint32_t x, y;      //jump targets, slot, class, lookaround or group index
+    };
+    
+    struct lookaround {
+        uint32_t start;
+        bool behind, negate;
+        size_t min_len, max_len;
+    };
+    
+    struct parser;
+    struct executor;
+    
+    std::string pattern;
+    
+    std::vector<inst> code;
+    std::vector< std::bitset<256> > classes;
+    std::vector<lookaround> lookarounds;
+    
+    size_t n_groups;
+    bool backtrack;
+    bool empty_loop_captures;
+    
+    std::bitset<256> first;
+    bool first_known;
+    
+    void compute_first();
+
+public:
+    
+    kate_regex() : pattern(), code(), classes(), lookarounds(),
+                   n_groups(0), backtrack(false), empty_loop_captures(false),
+                   first(), first_known(false) {}
+    
+    //Throws kate_regex::error if the pattern is malformed or unsupported
+    explicit kate_regex(const std::string& pattern, bool icase = false);
+    
+    //Attempts a match starting exactly at pos. The characters before pos are
+    //visible to \b and lookbehind. On success, fills m and returns true.
+    //The results refer to the subject, which must outlive them
+    bool match_at(std::string_view subject, size_t pos, match_results& m) const;
+    
+    //The set of bytes that any non-empty match must start with.
+    //Returns false if no such restriction is known (e.g. the pattern can match empty)
+    bool first_bytes(std::bitset<256>& set) const;
+    
+    //Lists the fields of a compiled pattern for serialization
+    template<typename A>
+    void archive(A& ar) {
+        ar(pattern, code, classes, lookarounds, n_groups, backtrack, empty_loop_captures, first, first_known);
+    }
+    
+    const std::string& str() const { return pattern; }
+    size_t group_count() const { return n_groups > 0 ? n_groups - 1 : 0; }
+};
+
+};
+
+#endif
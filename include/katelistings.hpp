@@ -2,14 +2,21 @@
 #define KATELISTINGS_H
 
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #include "file_utils.hpp"
 
 #include "print_options.hpp"
 #include "language.hpp"
+#include "highlight_cache.hpp"
+
+#define KATELISTINGS_VERSION "0.4.1"
 
 
 struct katelistings_job {
@@ -39,12 +46,77 @@ struct katelistings_job {
     }
 };
 
+//A batch of jobs and the settings they are run with, as given on the command line
+struct katelistings_request {
+    std::list<katelistings_job> jobs;
+    std::string theme_file;     //as returned by get_theme
+    bool ignore_priority;
+    print_options opts;
+    size_t n_workers;           //as given by -j
+    std::string cache_dir;      //empty means no highlight cache
+};
+
+//Defined in main.cpp
+std::string get_theme(const std::string& filename);
+void load_language_map(const dom_element& file, bool ignore_priority,
+    std::unordered_map< std::string, util::cref_ptr<dom_element> >& languages, 
+    std::unordered_map< std::string, std::list<std::string> >& extensions, 
+    std::unordered_map< std::string, std::list<std::string> >& glob_extensions,
+    print_options opts);
+void expand_directories(std::list<katelistings_job>& jobs,
+    const std::unordered_map< std::string, std::list<std::string> >& extensions, 
+    const std::unordered_map< std::string, std::list<std::string> >& glob_extensions);
+
 class latex_highlight {
   
+public:
+    //A job that can not be done. Reported by run_jobs, after the messages of the jobs before it
+    class job_error : public std::runtime_error {
+    public:
+        explicit job_error(const std::string& msg) : std::runtime_error(msg) {}
+    };
+    
 private:
     std::unordered_map<std::string, language::style> default_styles;
     std::unordered_map<std::string, language> languages;    
     
+    //Guards languages when jobs run in parallel. Languages are never modified
+    //once loaded, so they are used without holding it
+    std::mutex languages_lock;
+    
+    std::string theme_file;
+    
+    //Stamps of the files each language depends on (see highlight_key), guarded by languages_lock
+    std::unordered_map<std::string, std::string> lang_stamps;
+    
+    std::unique_ptr<highlight_cache> cache;
+    
+    //IDs of the command files of each language (see commands_id)
+    std::unordered_map<std::string, std::string> command_ids;
+    std::mutex command_ids_lock;
+    
+    //A {katelistings} environment, as found by do_inline_job
+    struct inline_listing {
+        size_t index;               //as in <name>_<index>.lst
+        size_t line;                //of \begin{katelistings}, for error messages
+        std::string lang_name;
+        const language* lang;       //only loaded if needed
+        std::string body;
+        
+        std::string hash;           //see highlight_key
+        bool up_to_date;
+    };
+    
+    //Parsed languages are cached here, next to language_map.xml
+    static constexpr const char* cache_dir = "language_cache/";
+    
+    static std::string cache_file(const std::string& lang_name);
+    static void collect_syntax_files(const std::string& lang_name, 
+        std::unordered_map< std::string, util::cref_ptr<dom_element> >& lang_map,
+        std::vector< std::string >& files);
+    static bool is_dependency(const std::string& lang_name,
+        std::unordered_map< std::string, util::cref_ptr<dom_element> >& lang_map);
+    
     bool load_language(const std::string& lang_name, const std::string& out_dir,
         std::unordered_map< std::string, util::cref_ptr<dom_element> >& lang_map,
         std::unordered_set< std::string >& loaded,
@@ -53,13 +125,28 @@ private:
     void load_language(const std::string& lang_name, const std::string& out_dir,
         std::unordered_map< std::string, util::cref_ptr<dom_element> >& lang_map,
         print_options opts);
-    bool need_new_commands(const std::string& lang_name, const std::string& out_dir);
-    void parse_language(const std::string& filename,
+    const language& get_language(const std::string& lang_name, const std::string& out_dir,
+        std::unordered_map< std::string, util::cref_ptr<dom_element> >& lang_map,
+        print_options opts);
+    std::string commands_id(const std::string& lang_name,
+        std::unordered_map< std::string, util::cref_ptr<dom_element> >& lang_map);
+    bool need_new_commands(const std::string& lang_name, const std::string& out_dir,
+        std::unordered_map< std::string, util::cref_ptr<dom_element> >& lang_map);
+    
+    std::string highlight_key(const std::string& lang_name, std::string_view input,
+        std::unordered_map< std::string, util::cref_ptr<dom_element> >& lang_map,
+        print_options opts);
+    void highlight_cached(const std::string& lang_name, const std::string& out_dir,
+        std::string_view input, const std::string& key, std::ostream& out,
+        std::unordered_map< std::string, util::cref_ptr<dom_element> >& lang_map,
+        print_options opts);
+    void parse_language(const std::string& filename, bool all_contexts,
         print_options opts);
     
 public:    
     void parse_default_styles(const std::string& filename, 
         print_options opts);
+    void use_cache(const std::string& dir);
     
     static std::string infer_language(const std::string& file, 
         std::unordered_map< std::string, std::list<std::string> >& extensions, 
@@ -69,12 +156,32 @@ public:
         std::unordered_map< std::string, util::cref_ptr<dom_element> >& lang_map,  
         std::unordered_map< std::string, std::list<std::string> >& extensions, 
         std::unordered_map< std::string, std::list<std::string> >& glob_extensions,
-        print_options opts);
+        print_options opts, std::ostream& log = std::cout, size_t n_workers = 1);
     void do_inline_job(std::istream& in, 
         const std::string& filename, const std::string& output_dir, 
         std::unordered_map< std::string, util::cref_ptr<dom_element> >& lang_map,
-        print_options opts );
-    void process_inline_listing(util::file_parser& parser, std::ostream& out, size_t leading_space);
+        print_options opts, std::ostream& log = std::cout, size_t n_workers = 1);
+    size_t process_inline_listing(util::file_parser& parser, std::string& body, size_t leading_space);
+    
+    //Loads the language of a job up front, so that it is not loaded by a worker
+    void prepare_job(const katelistings_job& job, 
+        std::unordered_map< std::string, util::cref_ptr<dom_element> >& lang_map,  
+        std::unordered_map< std::string, std::list<std::string> >& extensions, 
+        std::unordered_map< std::string, std::list<std::string> >& glob_extensions,
+        print_options opts);
+    
+    //Runs the jobs in order, or on n_workers threads (see job_pool.hpp)
+    void run_jobs(const std::list<katelistings_job>& jobs, 
+        std::unordered_map< std::string, util::cref_ptr<dom_element> >& lang_map,  
+        std::unordered_map< std::string, std::list<std::string> >& extensions, 
+        std::unordered_map< std::string, std::list<std::string> >& glob_extensions,
+        print_options opts, size_t n_workers);
+    
+    //For the server, which loads what its workers have used (see server.cpp)
+    void preload_language(const std::string& lang_name,
+        std::unordered_map< std::string, util::cref_ptr<dom_element> >& lang_map,
+        print_options opts);
+    std::vector<std::string> loaded_languages() const;
     
 };
 
@@ -3,6 +3,7 @@
 
 #include <cctype>
 #include <string>
+#include <string_view>
 
 namespace util {
 
@@ -14,6 +15,11 @@ std::string& convert_uppercase(std::string& str);
 
 bool word_char(const std::string& str, size_t pos);
 
+//For views of the input, which are not followed by a null character
+inline bool word_char(std::string_view str, size_t pos){
+    return pos < str.length() && (std::isalnum(static_cast<unsigned char>(str[pos])) || str[pos] == '_');
+}
+
 };
 
 #endif
@@ -1,69 +1,148 @@
 #ifndef KEYWORD_SET_H
 #define KEYWORD_SET_H
 
-#include <algorithm>
-#include <map>
-#include <unordered_set>
+#include <array>
+#include <bitset>
+#include <cctype>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
 
 #include "katelistings_util.hpp"
 
 namespace util {
 
+//A set of keywords stored as a byte trie, so that the longest keyword at a
+//position is found in a single pass over the input without allocating.
+//Children are kept as sorted sibling lists, except at the root where a
+//table indexed by the first byte is used.
 class keyword_set {
 private:
-    using internal_set = std::unordered_set<std::string>;
+    static constexpr uint32_t none = 0;
     
-    size_t max_len;
-    std::map<size_t, internal_set, std::greater<size_t>> set;
+    struct node {
+        unsigned char label;
+        bool terminal;
+        uint32_t child;     //First child, or none
+        uint32_t sibling;   //Next sibling with a greater label, or none
+    };
     
-public:
+    //Node 0 is the root, so none can double as a null index
+    std::vector<node> nodes;
+    std::array<uint32_t, 256> root;
     
-    keyword_set() : max_len(0), set() {}
-    keyword_set( std::initializer_list<std::string> init ) : max_len(0), set() {
-        size_t len;
-        for(auto key : init){
-            len = key.length();
-            if(max_len < len)
-                max_len = len;
-            
-            set[len].insert(key);
+    size_t n_keys;
+    
+    //Finds or creates the child of parent with the given label
+    uint32_t get_child(uint32_t parent, unsigned char label){
+        if(parent == 0){
+            if(root[label] == none){
+                root[label] = nodes.size();
+                nodes.push_back({label, false, none, none});
+            }
+            return root[label];
         }
+        
+        uint32_t* link = &nodes[parent].child;
+        while(*link != none && nodes[*link].label < label)
+            link = &nodes[*link].sibling;
+        
+        if(*link != none && nodes[*link].label == label)
+            return *link;
+        
+        uint32_t idx = nodes.size();
+        uint32_t next = *link;
+        *link = idx;    //Before push_back, which may move the nodes
+        nodes.push_back({label, false, none, next});
+        return idx;
     }
+    
+    uint32_t find_child(uint32_t parent, unsigned char label) const {
+        if(parent == 0)
+            return root[label];
         
-    std::pair<internal_set::const_iterator, bool> insert(const std::string& key){
-        size_t len = key.length();
-        if(len > max_len)
-            max_len = len;
-        return set[len].insert(key);
+        for(uint32_t idx = nodes[parent].child; idx != none; idx = nodes[idx].sibling){
+            if(nodes[idx].label >= label)
+                return nodes[idx].label == label ? idx : none;
+        }
+        return none;
     }
-    std::pair<internal_set::const_iterator, bool> insert(std::string&& key){
-        size_t len = key.length();
-        if(len > max_len)
-            max_len = len;
-        return set[len].insert(key);
+
+public:
+    
+    keyword_set() : nodes({{0, false, none, none}}), n_keys(0) {
+        root.fill(none);
+    }
+    keyword_set( std::initializer_list<std::string> init ) : keyword_set() {
+        for(const auto& key : init)
+            insert(key);
     }
     
-    size_t match(const std::string& str, size_t pos = 0, bool whole_word = true) const {
-        if(whole_word && util::word_char(str, pos-1))
-            std::string::npos;
+    //Returns false if the keyword was already present
+    bool insert(const std::string& key){
+        if(key.empty())
+            return false;
         
-        size_t max = std::min(max_len, str.length() - pos);
+        uint32_t idx = 0;
+        for(char c : key)
+            idx = get_child(idx, static_cast<unsigned char>(c));
         
-        for(auto it = set.lower_bound(max); it != set.end(); ++it){
-            const auto& [len, sub_map] = *it;
-            
-            if(whole_word && util::word_char(str, pos+len))
+        if(nodes[idx].terminal)
+            return false;
+        
+        nodes[idx].terminal = true;
+        ++n_keys;
+        return true;
+    }
+    
+    //Adds the bytes that keywords can start with to set, in both cases if ins is set
+    void first_bytes(std::bitset<256>& set, bool ins = false) const {
+        for(int c = 0; c < 256; ++c){
+            if(root[c] == none)
                 continue;
             
-            auto match = sub_map.find(str.substr(pos, len));
+            set.set(c);
+            if(ins)
+                set.set(static_cast<unsigned char>(std::toupper(c)));
+        }
+    }
+    
+    //Lists the fields for serialization
+    template<typename A>
+    void archive(A& ar) {
+        ar(nodes, root, n_keys);
+    }
+    
+    size_t size() const { return n_keys; }
+    bool empty() const { return n_keys == 0; }
+    
+    //Returns the length of the longest keyword at pos, or npos if there is none.
+    //If ins is set, the input is lowercased during the walk, so the keywords
+    //must have been inserted in lowercase.
+    size_t match(std::string_view str, size_t pos = 0, bool ins = false, bool whole_word = true) const {
+        if(whole_word && util::word_char(str, pos-1))
+            return std::string::npos;
+        
+        size_t best = std::string::npos;
+        uint32_t idx = 0;
+        
+        for(size_t i = pos; i < str.length(); ++i){
+            unsigned char c = str[i];
+            if(ins)
+                c = std::tolower(c);
+            
+            idx = find_child(idx, c);
+            if(idx == none)
+                break;
             
-            if(match != sub_map.end())
-                return len;
+            if(nodes[idx].terminal && !(whole_word && util::word_char(str, i+1)))
+                best = i+1 - pos;
         }
         
-        return std::string::npos;
-    }    
-    
+        return best;
+    }
+
 };
 
 };
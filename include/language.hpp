@@ -1,31 +1,44 @@
 #ifndef LANGUAGE_H
 #define LANGUAGE_H
 
+#include <array>
+#include <bitset>
+#include <deque>
 #include <iostream>
-#include <stack>
 #include <string>
+#include <string_view>
 #include <list>
 #include <unordered_map>
 #include <utility>
+#include <variant>
+#include <vector>
 #include <memory>
-#include <regex>
+#include <mutex>
 
 #include "dom.hpp"
 #include "keyword_set.hpp"
+#include "string_pool.hpp"
+#include "kate_regex.hpp"
+#include "capture_set.hpp"
+#include "small_stack.hpp"
+#include "input_buffer.hpp"
+#include "line_source.hpp"
+#include "output_buffer.hpp"
 #include "ref_ptr.hpp"
 
 #include "print_options.hpp"
 
 #include "unistd.h"
-std::string get_ID();
 
-#define RULE_CTOR_ARGS const dom_element& defn, const language& lang
+#define RULE_CTOR_ARGS const dom_element& defn, language& lang
 #define RULE_CTOR_VALS defn, lang
-#define RULE_MATCH_ARGS const std::string& buf, size_t pos, const std::smatch& regex_match, std::smatch& new_match
-#define RULE_MATCH_VALS buf, pos, regex_match, new_match
+#define RULE_MATCH_ARGS std::string_view buf, size_t pos, const util::capture_set& captures, match_results& new_match
+#define RULE_MATCH_VALS buf, pos, captures, new_match
 
 using namespace DOM;
 
+struct rule_bench;
+
 class language{
     
     std::string name;
@@ -41,12 +54,33 @@ public:
         
         bool italic, bold, underline, strikethrough;
         
+        //The LaTeX around text in this style: either the formatting itself, or
+        //the command that generate_commands defines for it. Named is the
+        //formatting with the colours that generate_commands defines (kl<RRGGBB>).
+        //Wrapped is the formatting that has no declarative form (background,
+        //underline and strikethrough), for DECLARATIVE output
+        struct latex_sequence {
+            std::string open;
+            std::string close;
+        };
+        latex_sequence raw, named, command, wrapped;
+        
+        //Once the colours and flags are set. The command is named after the
+        //language that the style belongs to
+        void set_latex(const std::string& lang_name);
+        const latex_sequence& latex(bool use_commands) const { return use_commands ? command : raw; }
+        
         static std::string format_colour(const std::string& col, const dom_element& defn);
     };
         
 private:
 
     class context;
+    class program;
+    class cache_writer;
+    class cache_reader;
+    
+    using match_results = util::kate_regex::match_results;
     
     struct context_switch {
         size_t pops;
@@ -55,18 +89,28 @@ private:
         context_switch() : pops(0), target(nullptr) {}
     };
     
+    //Each context on the stack keeps the groups of the match that pushed it which
+    //its dynamic rules use (see context::collect_groups)
     class context_stack {
-        std::stack< std::pair<util::cref_ptr<context>, const std::smatch> > stack;
+        struct frame {
+            const context* con = nullptr;
+            util::capture_set captures;
+        };
+        util::small_stack<frame, 16> stack;
         
     public:
         
-        const context& curr_context() const { return *(stack.top().first); }
-        const std::smatch& curr_match() const { return stack.top().second; }
+        const context& curr_context() const { return *(stack.top().con); }
+        const util::capture_set& curr_captures() const { return stack.top().captures; }
         
-        void switch_context(const context_switch& con_sw, const std::smatch& new_match = std::smatch());
+        //Switches to the context of a rule, which takes its captures from the match
+        void switch_context(const context_switch& con_sw, const match_results& new_match);
+        //Switches at line ends and fallthrough, which hand on the current captures
+        void switch_context(const context_switch& con_sw);
         
-        explicit context_stack(const util::cref_ptr<context>& def) : stack( {{def, std::smatch()}} ) 
-        {}
+        explicit context_stack(const util::cref_ptr<context>& def) : stack() {
+            stack.push().con = &*def;
+        }
     };  //context_stack
     
     class context{
@@ -80,6 +124,9 @@ private:
         
         bool fallthrough;
         
+        //The groups of its captures that the context keeps (bit n for %n)
+        uint16_t groups;
+        
     public:
         
         class rule {
@@ -93,31 +140,51 @@ private:
             size_t column;
             
             rule() 
-            : attribute(nullptr), context(), 
+            : attribute(nullptr), context(), kernel_flags(0),
               dynamic(false), lookahead(false), first_non_space(false),
               column(std::string::npos) 
             {}
             
-            virtual size_t match_impl(RULE_MATCH_ARGS) const = 0;
-            
             void parse_common(RULE_CTOR_ARGS, bool allow_dynamic);
-            void clone_common(rule* clone) const;
             
             static bool check_dynamic(const std::string& str, const dom_element& defn);
-            static std::string get_dynamic(const std::string& str, const std::smatch& match);
+            static std::string get_dynamic(std::string_view str, const util::capture_set& captures);
+            
+            //Lists the fields for the language cache, see language_cache.cpp
+            template<typename A>
+            void archive_common(A& ar) {
+                ar(attribute, context, kernel_flags, dynamic, lookahead, first_non_space, column);
+            }
 
             
         public:
             
+            //The capture groups (bit n for %n) that a dynamic string refers to
+            static uint16_t dynamic_groups(std::string_view str);
+            
             util::cref_ptr<style> attribute;
             context_switch context;
             
-            size_t match(RULE_MATCH_ARGS, bool leading_space) const;
+            //The flags that select a specialized matching kernel, see match_kernel in rule.cpp
+            enum kernel_flag : uint8_t {
+                KERNEL_CONSTRAINED  = 0b001,    //first_non_space, column or lookahead
+                KERNEL_DYNAMIC      = 0b010,
+                KERNEL_INSENSITIVE  = 0b100
+            };
+            uint8_t kernel_flags;
+            
+            //Rule types whose match_impl branches on dynamic or ins override this,
+            //and provide match_flags<DYN, INS> with those branches resolved at compile time
+            static constexpr bool has_match_flags = false;
             
-            virtual std::string name() const = 0;
+            //The checks around match_impl that are common to all rules, see CTOR_AND_IMPL
+            bool check_position(std::string_view buf, size_t pos, bool leading_space) const;
+            size_t check_lookahead(size_t match_len) const { 
+                return (!lookahead || match_len == std::string::npos) ? match_len : 0; 
+            }
             
-            virtual std::unique_ptr<rule> init(RULE_CTOR_ARGS) = 0;
-            virtual std::unique_ptr<rule> clone() const  = 0;
+            //Rules are not polymorphic: each rule type defines init, match, first_bytes,
+            //archive and name (see rules.hpp), and they are stored by value in a rule_variant
         
         };  //rule
         
@@ -125,79 +192,192 @@ private:
 #include "rules.hpp"
 
     private:
-        std::list< std::unique_ptr<rule> > rules;
+        //A rule of the context. The rule itself stays in the language that defines
+        //it (see language::rules), so included rules are shared rather than copied.
+        //The attribute is that of the rule, unless includeAttrib redirected it
+        struct rule_ref {
+            util::cref_ptr<rule_variant> rule;
+            util::cref_ptr<style> attribute;
+            
+            template<typename A>
+            void archive(A& ar) { ar(rule, attribute); }
+        };
+        std::vector<rule_ref> rules;
+        
+        void add_rule(const rule_variant& var){ rules.push_back({ var, get_rule(var).attribute }); }
+        
+        struct dispatch_entry {
+            uint32_t rule;
+            uint32_t kernel;    //See kernel_id
+        };
+        
+        //The rules that can match at each byte, in their original order.
+        //The candidates for byte c are rules[dispatch_rules[dispatch_index[c] .. dispatch_index[c+1]].rule]
+        std::vector<dispatch_entry> dispatch_rules;
+        std::array<size_t, 257> dispatch_index;
+        
+        void build_dispatch();
+        
+        //The groups that the dynamic rules of the context substitute
+        uint16_t dynamic_groups() const;
+        
+        //Switch-based dispatch on the type of a stored rule
+        static const rule& get_rule(const rule_variant& var);
+        static bool first_bytes(const rule_variant& var, std::bitset<256>& set);
+        
+        //Identifies the matching kernel of a rule by its type and kernel flags
+        static constexpr uint32_t kernel_id(size_t type, uint8_t flags) { return (type << 3) | flags; }
+        static uint32_t kernel_id(const rule_variant& var) { return kernel_id(var.index(), get_rule(var).kernel_flags); }
+        
+        //Matching with the flags of the rule resolved at compile time (see rule.cpp)
+        template<typename R, bool CONSTRAINED, bool DYN, bool INS>
+        static size_t match_kernel(const rule_variant& var, RULE_MATCH_ARGS, bool leading_space);
+        static size_t match_rule(uint32_t kernel, const rule_variant& var, RULE_MATCH_ARGS, bool leading_space);
+        
+        //Matching that tests the flags at runtime, for kernels without a specialization
+        static size_t match_rule(const rule_variant& var, RULE_MATCH_ARGS, bool leading_space);
 
-        void include_rules(const dom_element& defn, const language& lang,
+        void include_rules(const dom_element& defn, language& lang,
                            const std::unordered_map<std::string, language>& languages,
                            print_options opts);
         
         
-        std::pair< size_t, util::cref_ptr<rule> > 
-        apply_rules(const std::string& buf, size_t pos, bool leading_space, context_stack& stack,
-                    std::smatch& new_match, const std::smatch& old_match = std::smatch()) const;
+        std::pair< size_t, const rule_ref* > 
+        apply_rules(std::string_view buf, size_t pos, bool leading_space, context_stack& stack,
+                    match_results& new_match, const util::capture_set& old_captures = util::capture_set()) const;
+        
+        friend class program;
+        friend class cache_writer;
+        friend class cache_reader;
+        friend struct ::rule_bench;
         
     public:
         context(const std::string n = "") 
         : name(n), attribute(nullptr), 
-          end_context(), empty_context(), fall_context(), fallthrough(false), 
-          rules() {};
-        explicit context(dom_element::const_query& empty_lines);        
+          end_context(), empty_context(), fall_context(), fallthrough(false), groups(0),
+          rules(), dispatch_rules(), dispatch_index() {};
+        context(const dom_element::const_query& empty_lines, language& lang);
         
-        void parse(const dom_element& defn, const language& lang,
+        void parse(const dom_element& defn, language& lang,
                    const std::unordered_map<std::string, language>& languages,
                    print_options opts);
         
-        bool empty_line(const std::string& buf, context_stack& stack, const context& empty_lines) const;
+        bool empty_line(std::string_view buf, context_stack& stack, const context& empty_lines) const;
         void end_of_line(context_stack& stack) const;
         
         util::cref_ptr<style> get_attribute() const { return attribute; }
         const std::string&     get_name() const { return name; }
+        uint16_t               get_groups() const { return groups; }
+        
+        //Once all contexts of a language are parsed
+        static void collect_groups(std::unordered_map<std::string, context>& contexts);
         
         
         std::pair< size_t, util::cref_ptr<style> > 
-        apply_rules(const std::string& buf, size_t pos, bool leading_space, context_stack& stack) const;
+        apply_rules(std::string_view buf, size_t pos, bool leading_space, context_stack& stack) const;
         
     };  //context   
     
+//The compiled form of a language
+#include "program.hpp"
+
+//Writes the highlighted text
+#include "latex_writer.hpp"
+    
     friend class context;
+    friend struct ::rule_bench;     //Microbenchmark of the rule kernels, see rule_bench.cpp
     
     std::unordered_map<std::string, util::keyword_set> keyword_lists;
     std::unordered_map<std::string, context> contexts;
     std::unordered_map<std::string, style> styles;
     
+    //Out-of-line payloads of the rules, also referred to by rules included into other languages
+    util::string_pool strings;
+    std::deque<context::reg_expr::compiled> regexes;
+    
+    //The rules defined in this language, which contexts here and in other languages refer to
+    std::deque<context::rule_variant> rules;
+    
     bool case_sensitive;
     context empty_lines;
     util::cref_ptr<context> default_context;
     
+    //While the contexts are parsed: where each one is defined, and whether it
+    //is parsed yet (see parse_contexts). Contexts that are switched to but not
+    //parsed yet wait in unparsed
+    struct context_def {
+        util::cref_ptr<dom_element> defn;
+        bool parsing, parsed;
+    };
+    std::unordered_map<std::string, context_def> context_defs;
+    std::deque<std::string> unparsed;
+    
+    program prog;
+    
     void parse_keywords(const dom_element& list, print_options opts);
     void parse_styles(const dom_element& list, 
                       const std::unordered_map<std::string, style>& deflt_styles, 
                       print_options opts);
     void parse_contexts(const dom_element& list,
                         const std::unordered_map<std::string, language>& languages,
-                        print_options opts);
+                        bool all_contexts, print_options opts);
+    void parse_context(context_def& def, const std::string& con_name,
+                       const std::unordered_map<std::string, language>& languages,
+                       print_options opts);
+    util::cref_ptr<context> refer_context(const std::string& con_name);
+    
+    //For loading from the cache
+    language() : name(), case_sensitive(true), empty_lines("<empty line>"), default_context(nullptr) {}
     
-    void name_command(std::ostream& out, const std::string& sty_name) const;
-    static void name_escape(std::ostream& out, const std::string& name);
+    void write_commands(std::ostream& file, const dom_element& deps, const std::string& id) const;
+    void name_command(util::output_buffer& out, const std::string& sty_name) const;
+    static void name_escape(util::output_buffer& out, const std::string& name);
+    
+    //The object-graph interpreter, kept as the reference for program::run
+    void interpret(util::line_source& in, std::ostream& out, print_options opts) const;
     
     util::cref_ptr<style> get_style     (const std::string& defn, const dom_element& src) const;
-    context_switch  parse_context_switch(const std::string& defn, const dom_element& src) const;    
+    context_switch  parse_context_switch(const std::string& defn, const dom_element& src);
     
 public:
-    void generate_commands(const dom_element& deps, const std::string& out_dir) const;
+    //The file is identified by id, see latex_highlight::commands_id
+    void generate_commands(const dom_element& deps, const std::string& out_dir, const std::string& id) const;
+    static std::string commands_file(const std::string& out_dir, const std::string& lang_name);
 
+    //Only the contexts that can be reached from the default context are parsed,
+    //unless all_contexts is set (for languages that others include rules from)
     language(const dom_element& defn, 
              const std::unordered_map<std::string, style>& deflt_styles,
              const std::unordered_map<std::string, language>& languages,
-             print_options opts);
+             bool all_contexts, print_options opts);
     
     void highlight(std::istream& in, std::ostream& out, print_options opts) const;
+    void highlight(std::string_view text, std::ostream& out, print_options opts) const;
+    void highlight(util::line_source& in, std::ostream& out, print_options opts) const;
+    
+    //The files and settings that a cached language depends on
+    struct cache_key {
+        std::vector<std::string> files;     //The syntax file and those of all its dependencies
+        std::string theme;
+        bool all_contexts = false;          //See the constructor
+        
+        //Changes whenever the files or the build of katelistings do
+        std::string stamp() const;
+    };
+    
+    //Binary cache of the fully parsed language, see language_cache.cpp.
+    //Languages that this one refers to must be present in languages when loading
+    void save_cache(const std::string& cache_file, const cache_key& key,
+                    const std::unordered_map<std::string, language>& languages) const;
+    static bool load_cache(const std::string& cache_file, const cache_key& key,
+                           const std::unordered_map<std::string, style>& deflt_styles,
+                           std::unordered_map<std::string, language>& languages,
+                           print_options opts);
     
     const std::string& get_name() const { return name; }
     
-    size_t latex_format(std::ostream& out, const style& attr, bool use_commands = false) const;
-    static bool latex_escape(std::ostream& out, char ch);
-    static bool latex_escape(std::ostream& out, const std::string& str, size_t pos, size_t len);
+    static bool latex_escape(util::output_buffer& out, char ch);
+    static bool latex_escape(util::output_buffer& out, std::string_view str, size_t pos, size_t len);
     
 };  //language
 
@@ -0,0 +1,74 @@
+#ifndef LATEX_WRITER_H
+#define LATEX_WRITER_H
+
+//The output stage of highlighting. Text is written in runs: a run is opened
+//with the formatting of its style (see style::set_latex) and stays open
+//while the following text has the same formatting, so that consecutive tokens
+//in the same style share one group. Runs end at line ends.
+//
+//With BARE_NORMAL, text formatted like dsNormal gets no group at all, and takes
+//the colour of the surrounding document. With COMPACT, each format is written
+//as a short macro, which the listing defines first (see generate_commands).
+//
+//With DECLARATIVE, the colour, series and shape are not groups but declarations
+//(\\color, \\bfseries, ...), written only where they differ from those before.
+//Only the rest of the formatting (see style::wrapped) is a group around the run.
+//At line ends, the declarations are reset to those of dsNormal, and spaces
+//are left in whatever was declared before them.
+//
+//This is included inside class language, after program (see language.hpp)
+
+class latex_writer {
+private:
+    //The state that DECLARATIVE output has declared. An empty colour is
+    //that of the surrounding document
+    struct declaration {
+        std::string_view colour;
+        bool bold, italic;
+    };
+    
+    util::output_buffer out;
+    bool use_commands;
+    bool declarative;
+    
+    //What has been declared, and what to reset to at line ends
+    declaration state;
+    declaration line_start;
+    
+    //The macros of COMPACT output, or nullptr
+    const std::unordered_map<const style*, style::latex_sequence>* compact;
+    
+    //The dsNormal style, or nullptr unless BARE_NORMAL is given
+    const style* normal;
+    
+    //The style of the open run, or nullptr if there is none.
+    //Close is what ends the run, or nullptr if it is bare
+    const style* open;
+    const std::string* close;
+    
+    const style::latex_sequence& latex(const style& st) const;
+    void declare(const declaration& decl);
+    bool continues_run(const style& st) const;
+    bool keeps_run(const style& st, std::string_view text) const;
+    void open_run(const style& st);
+    void close_run();
+
+public:
+    latex_writer(const language& lang, std::ostream& out, print_options opts);
+    ~latex_writer() { close_run(); }
+    
+    latex_writer(const latex_writer&) = delete;
+    latex_writer& operator=(const latex_writer&) = delete;
+    
+    //Both return whether any of the text is visible, see language::latex_escape
+    bool write(const style& st, char ch);
+    bool write(const style& st, std::string_view str, size_t pos, size_t len);
+    
+    void end_line();
+    
+    //Writes out what has been buffered, without ending the open run
+    void flush() { out.flush(); }
+
+};  //latex_writer
+
+#endif
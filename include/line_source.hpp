@@ -0,0 +1,36 @@
+#ifndef LINE_SOURCE_H
+#define LINE_SOURCE_H
+
+#include <string_view>
+
+#include "char_scan.hpp"
+
+namespace util {
+
+//Input to be highlighted, one line at a time. The lines are views into text in
+//memory (see input_buffer), split out with the vectorized newline search, so
+//they stay valid as long as the text does. They are the same lines as those of
+//std::getline, and a final line without a newline is still a line.
+class line_source {
+private:
+    const char* pos;
+    const char* end;
+
+public:
+    explicit line_source(std::string_view text) : pos(text.data()), end(text.data() + text.size()) {}
+    
+    bool next(std::string_view& line){
+        if(pos == end)
+            return false;
+        
+        const char* nl = find_newline(pos, end);
+        line = std::string_view(pos, nl - pos);
+        pos = (nl == end) ? end : nl + 1;
+        return true;
+    }
+
+};
+
+};
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef OUTPUT_BUFFER_H
+#define OUTPUT_BUFFER_H
+
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+namespace util {
+
+//Collects output in a large buffer that is written to the stream in whole
+//blocks, instead of going through the stream for every token. Flushed when
+//full and on destruction; the stream itself is never flushed.
+class output_buffer {
+private:
+    std::ostream& out;
+    std::unique_ptr<char[]> buf;
+    size_t used;
+
+public:
+    static constexpr size_t capacity = 1 << 16;
+    
+    explicit output_buffer(std::ostream& o) : out(o), buf(new char[capacity]), used(0) {}
+    ~output_buffer() { flush(); }
+    
+    output_buffer(const output_buffer&) = delete;
+    output_buffer& operator=(const output_buffer&) = delete;
+    
+    void flush(){
+        if(used > 0)
+            out.write(buf.get(), used);
+        used = 0;
+    }
+    
+    void write(const char* data, size_t len){
+        if(len > capacity - used){
+            flush();
+            
+            //Too large to be worth copying
+            if(len >= capacity){
+                out.write(data, len);
+                return;
+            }
+        }
+        std::memcpy(buf.get() + used, data, len);
+        used += len;
+    }
+    
+    void put(char ch){
+        if(used == capacity)
+            flush();
+        buf[used++] = ch;
+    }
+    
+    //Writes n copies of ch
+    void fill(char ch, size_t n){
+        while(n > 0){
+            if(used == capacity)
+                flush();
+            
+            size_t len = std::min(n, capacity - used);
+            std::memset(buf.get() + used, ch, len);
+            used += len;
+            n -= len;
+        }
+    }
+    
+    output_buffer& operator<<(char ch)                  { put(ch); return *this; }
+    output_buffer& operator<<(std::string_view str)     { write(str.data(), str.size()); return *this; }
+    output_buffer& operator<<(const std::string& str)   { write(str.data(), str.size()); return *this; }
+    output_buffer& operator<<(const char* str)          { write(str, std::strlen(str)); return *this; }
+
+};
+
+};
+
+#endif
@@ -12,7 +12,11 @@ enum print_options {
     DEBUG        = 0b01111,
     VERBOSITY    = 0b00111,
     ECHO_INPUT   = 0b01000,
-    USE_COMMANDS = 0b10000
+    USE_COMMANDS = 0b10000,
+    REFERENCE    = 0b100000,
+    BARE_NORMAL  = 0b1000000,
+    COMPACT      = 0b10010000,    //Implies USE_COMMANDS
+    DECLARATIVE  = 0b100000000
 };
 
 #endif
@@ -0,0 +1,85 @@
+#ifndef PROGRAM_H
+#define PROGRAM_H
+
+//A language lowered to a flat state machine. Contexts become states, rules become
+//instructions that name the matching kernel and the context switch to make, and all
+//references between them are indices. Contexts of other languages reached through
+//IncludeRules or context switches are compiled into the same program.
+//
+//This is included inside class language, after context (see language.hpp)
+
+class program {
+public:
+    static constexpr uint32_t none = UINT32_MAX;
+    
+    //Pop pops states, then push target unless it is none
+    struct jump {
+        uint32_t pops;
+        uint32_t target;
+    };
+    
+    //Attempt to match rules[rule] with the kernel op (see context::kernel_id)
+    struct inst {
+        uint32_t op;
+        uint32_t rule;
+        uint32_t style;     //none means the style of the state switched to
+        jump next;
+    };
+    
+    struct state {
+        uint32_t style;
+        jump end, empty, fall;
+        bool fallthrough;
+        uint16_t groups;    //The capture groups to keep, see context::collect_groups
+        
+        //The instructions to run for byte c are code[buckets[first_bucket + c]]
+        uint32_t first_bucket;
+    };
+    
+    struct bucket {
+        uint32_t begin, end;
+    };
+
+private:
+    std::vector<state> states;
+    std::vector<inst> code;
+    std::vector<bucket> buckets;
+    
+    std::vector<context::rule_variant> rules;
+    std::vector< util::cref_ptr<style> > styles;
+    
+    //For COMPACT output: one style of each distinct format, in the order of
+    //their macros, and the macro of every style (see index_formats)
+    std::vector< util::cref_ptr<style> > formats;
+    std::unordered_map<const style*, style::latex_sequence> compact;
+    
+    uint32_t start;
+    
+    struct compiler;
+    friend class cache_writer;
+    friend class cache_reader;
+
+public:
+    
+    program() : states(), code(), buckets(), rules(), styles(), formats(), compact(), start(none) {}
+    
+    void compile(const language& lang);
+    
+    //Also done after loading from the cache, since it refers to styles by address
+    void index_formats();
+    
+    //\klA, \klB, ..., \klZ, \klAA, \klAB, ...
+    static std::string compact_name(size_t idx);
+    
+    const std::vector< util::cref_ptr<style> >& get_formats() const { return formats; }
+    const std::unordered_map<const style*, style::latex_sequence>& get_compact() const { return compact; }
+    
+    size_t state_count() const { return states.size(); }
+    size_t code_size() const { return code.size(); }
+    
+    //Highlights in the same way as language::interpret, which is the reference
+    void run(const language& lang, util::line_source& in, std::ostream& out, print_options opts) const;
+
+};  //program
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef RULE_TYPES_H
+#define RULE_TYPES_H
+
+//Must be in the same order as the alternatives of rule_variant in rules.hpp
+enum rule_type {
+    any_char, 
+    detect_char, detect_2_chars, detect_spaces, detect_identifier,
+    rfloat, rint,
+    hlc_oct, hlc_hex, hlc_string_char, hlc_char,
+    string_detect, word_detect, range_detect,
+    keyword, reg_expr,
+    line_continue,
+    INCLUDE_RULES
+};
+
+//Expands RULE_CASE for every rule type
+#define ALL_RULE_CASES              \
+    RULE_CASE(any_char)             \
+    RULE_CASE(detect_char)          \
+    RULE_CASE(detect_2_chars)       \
+    RULE_CASE(detect_spaces)        \
+    RULE_CASE(detect_identifier)    \
+    RULE_CASE(rfloat)               \
+    RULE_CASE(rint)                 \
+    RULE_CASE(hlc_oct)              \
+    RULE_CASE(hlc_hex)              \
+    RULE_CASE(hlc_string_char)      \
+    RULE_CASE(hlc_char)             \
+    RULE_CASE(string_detect)        \
+    RULE_CASE(word_detect)          \
+    RULE_CASE(range_detect)         \
+    RULE_CASE(keyword)              \
+    RULE_CASE(reg_expr)             \
+    RULE_CASE(line_continue)
+
+#endif
@@ -4,18 +4,41 @@
 #define RULE context::rule
 
 #define CTOR_AND_IMPL(NN) \
-    virtual std::unique_ptr<RULE> init( RULE_CTOR_ARGS );         \
-    virtual std::unique_ptr<RULE> clone() const;                  \
-    virtual size_t match_impl( RULE_MATCH_ARGS ) const;           \
-    virtual std::string name() const { return #NN "[" + INFO + "]"; }
+    void init( RULE_CTOR_ARGS );                                                \
+    size_t match_impl( RULE_MATCH_ARGS ) const;                                 \
+    size_t match( RULE_MATCH_ARGS, bool leading_space ) const {                 \
+        if(!check_position(buf, pos, leading_space))                            \
+            return std::string::npos;                                           \
+        return check_lookahead(match_impl(RULE_MATCH_VALS));                    \
+    }                                                                           \
+    std::string name() const { return #NN "[" + INFO + "]"; }
+
+//For rules that can only start matching on certain bytes
+#define FIRST_BYTES_IMPL \
+    bool first_bytes(std::bitset<256>& set) const;
+
+//Lists the fields of a rule type for the language cache, see language_cache.cpp
+#define ARCHIVE_IMPL(...) \
+    template<typename A>                                                        \
+    void archive(A& ar) { archive_common(ar); ar(__VA_ARGS__); }
+
+//For rules whose matching depends on dynamic or ins. match_impl then only
+//selects the right match_flags, which the kernels call directly
+#define MATCH_FLAGS_IMPL \
+    static constexpr bool has_match_flags = true;                               \
+    template<bool DYN, bool INS>                                                \
+    size_t match_flags( RULE_MATCH_ARGS ) const;
 
     
 struct detect_char : public RULE {
-    std::string chr;
+    std::string_view chr;
     
-#define INFO chr
+#define INFO std::string(chr)
     
     CTOR_AND_IMPL(detect_char)
+    ARCHIVE_IMPL(chr)
+    FIRST_BYTES_IMPL
+    MATCH_FLAGS_IMPL
 };
 
 struct detect_2_chars : public RULE {
@@ -25,41 +48,75 @@ struct detect_2_chars : public RULE {
 #define INFO std::string(1,chr0) + std::string(1,chr1)
     
     CTOR_AND_IMPL(detect_2_chars)
+    ARCHIVE_IMPL(chr0, chr1)
+    FIRST_BYTES_IMPL
 };
 
 struct any_char : public RULE {
-    std::string str;
+    std::string_view str;
     
 #undef INFO
-#define INFO str
+#define INFO std::string(str)
     
     CTOR_AND_IMPL(any_char)
+    ARCHIVE_IMPL(str)
+    FIRST_BYTES_IMPL
 };
 
 struct string_detect : public RULE {
-    std::string str;
+    std::string_view str;
     bool ins;
     
     CTOR_AND_IMPL(string_detect)
+    ARCHIVE_IMPL(str, ins)
+    FIRST_BYTES_IMPL
+    MATCH_FLAGS_IMPL
 };
 
 struct word_detect : public RULE {
-    std::string str;
+    std::string_view str;
     bool ins;
     
     CTOR_AND_IMPL(word_detect)
+    ARCHIVE_IMPL(str, ins)
+    FIRST_BYTES_IMPL
+    MATCH_FLAGS_IMPL
 };
 
 struct reg_expr : public RULE {
-    std::string str;
+    std::string_view str;
     bool ins;
     
+    //The compiled pattern is kept in the language, since it is large
+    struct compiled {
+        util::kate_regex regex;
+        bool valid;
+        
+        //Compiled dynamic patterns, keyed on the pattern after substitution.
+        //Malformed patterns are cached as nullptr so that they are reported once.
+        //Shared between threads, and entries outlive a flush while still in use
+        mutable std::unordered_map< std::string, std::shared_ptr<const util::kate_regex> > dynamic_cache;
+        mutable std::mutex dynamic_lock;
+        
+        compiled() : regex(), valid(false), dynamic_cache(), dynamic_lock() {}
+    };
+    util::cref_ptr<compiled> pattern;
+    
+    static constexpr size_t max_dynamic_cache = 64;
+    
     CTOR_AND_IMPL(reg_expr)
+    ARCHIVE_IMPL(str, ins, pattern)
+    FIRST_BYTES_IMPL
+    MATCH_FLAGS_IMPL
+    
+    reg_expr() : RULE(), str(), ins(false), pattern(nullptr) {}
     
     //Special constructor for standalone regex
-    reg_expr(const std::string& regexp = "") 
-    : RULE(), str(regexp), ins(false)
-    {}
+    reg_expr(const std::string& regexp, language& lang);
+    
+private:
+    static bool compile(const std::string& pattern, bool ins, util::kate_regex& regex);
+    std::shared_ptr<const util::kate_regex> get_dynamic_regex(const std::string& pat) const;
 };
 
 struct keyword : public RULE {
@@ -72,6 +129,9 @@ struct keyword : public RULE {
 #define INFO list_name
     
     CTOR_AND_IMPL(keyword)
+    ARCHIVE_IMPL(list_name, keywords, ins)
+    FIRST_BYTES_IMPL
+    MATCH_FLAGS_IMPL
 };
 
 #undef INFO
@@ -79,21 +139,33 @@ struct keyword : public RULE {
 
 struct rint : public RULE {
     CTOR_AND_IMPL(rint)
+    ARCHIVE_IMPL()
+    FIRST_BYTES_IMPL
 };
 struct rfloat : public RULE {
     CTOR_AND_IMPL(rfloat)
+    ARCHIVE_IMPL()
+    FIRST_BYTES_IMPL
 };
 struct hlc_oct : public RULE {
     CTOR_AND_IMPL(hlc_oct)
+    ARCHIVE_IMPL()
+    FIRST_BYTES_IMPL
 };
 struct hlc_hex : public RULE {
     CTOR_AND_IMPL(hlc_hex)
+    ARCHIVE_IMPL()
+    FIRST_BYTES_IMPL
 };
 struct hlc_string_char : public RULE {
     CTOR_AND_IMPL(hlc_string_char)
+    ARCHIVE_IMPL()
+    FIRST_BYTES_IMPL
 };
 struct hlc_char : public RULE {
-   CTOR_AND_IMPL(hlc_char)
+    CTOR_AND_IMPL(hlc_char)
+    ARCHIVE_IMPL()
+    FIRST_BYTES_IMPL
 };
 
 struct range_detect : public RULE {
@@ -102,6 +174,8 @@ struct range_detect : public RULE {
 #define INFO std::string(1,chr0) + "..." + std::string(1,chr1)
     
     CTOR_AND_IMPL(range_detect)
+    ARCHIVE_IMPL(chr0, chr1)
+    FIRST_BYTES_IMPL
 };
 
 struct line_continue : public RULE {
@@ -111,6 +185,8 @@ struct line_continue : public RULE {
 #define INFO std::string(1,chr)
     
     CTOR_AND_IMPL(line_continue)
+    ARCHIVE_IMPL(chr)
+    FIRST_BYTES_IMPL
 };
 
 #undef INFO
@@ -118,14 +194,33 @@ struct line_continue : public RULE {
 
 struct detect_spaces : public RULE {
     CTOR_AND_IMPL(detect_spaces)
+    ARCHIVE_IMPL()
+    FIRST_BYTES_IMPL
 };
 struct detect_identifier : public RULE {
     CTOR_AND_IMPL(detect_identifier)
+    ARCHIVE_IMPL()
+    FIRST_BYTES_IMPL
 };
 
 #undef INFO
 
+//All rule types, stored by value.
+//The alternatives must be in the same order as rule_type in rule_types.hpp
+using rule_variant = std::variant<
+    any_char, 
+    detect_char, detect_2_chars, detect_spaces, detect_identifier,
+    rfloat, rint,
+    hlc_oct, hlc_hex, hlc_string_char, hlc_char,
+    string_detect, word_detect, range_detect,
+    keyword, reg_expr,
+    line_continue
+>;
+
 #undef CTOR_AND_IMPL
+#undef FIRST_BYTES_IMPL
+#undef MATCH_FLAGS_IMPL
+#undef ARCHIVE_IMPL
 #undef RULE
 
 #endif
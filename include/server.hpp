@@ -0,0 +1,24 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "katelistings.hpp"
+
+//A resident katelistings that keeps themes and languages loaded between runs.
+//It listens on a Unix domain socket next to language_map.xml, and runs each
+//request in a forked worker that writes directly to the standard streams of
+//the client, so a failing job can not take the server down. Requests are run
+//concurrently, and only accepted from the user that runs the server.
+namespace katelistings_server {
+    
+    constexpr const char* socket_path = "katelistings.sock";
+    
+    //Serves requests until interrupted. Logs the latency of each request
+    int serve(print_options opts);
+    
+    //Runs the request on a server if one is running, setting status to its
+    //exit status. Returns false if no server could be reached
+    bool request(const katelistings_request& req, int& status);
+
+};
+
+#endif
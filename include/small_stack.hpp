@@ -0,0 +1,44 @@
+#ifndef SMALL_STACK_H
+#define SMALL_STACK_H
+
+#include <array>
+#include <cstddef>
+#include <deque>
+
+namespace util {
+
+//A stack whose first N slots are stored inline, and only deeper ones on the heap.
+//Popped slots are not destroyed but kept for the next push, so that what they own
+//is reused. References to slots stay valid while pushing.
+template<typename T, size_t N>
+class small_stack {
+private:
+    std::array<T, N> local;
+    std::deque<T> spilled;
+    size_t depth;
+
+public:
+    small_stack() : local(), spilled(), depth(0) {}
+    
+    size_t size() const { return depth; }
+    
+    T& operator[](size_t i)             { return (i < N) ? local[i] : spilled[i - N]; }
+    const T& operator[](size_t i) const { return (i < N) ? local[i] : spilled[i - N]; }
+    
+    T& top()             { return (*this)[depth - 1]; }
+    const T& top() const { return (*this)[depth - 1]; }
+    
+    //The new top holds whatever was last popped from its slot
+    T& push(){
+        if(depth >= N && depth - N == spilled.size())
+            spilled.emplace_back();
+        return (*this)[depth++];
+    }
+    
+    void pop(size_t n = 1){ depth -= n; }
+
+};
+
+};
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef STRING_POOL_H
+#define STRING_POOL_H
+
+#include <string>
+#include <string_view>
+#include <unordered_set>
+
+namespace util {
+
+//Interned strings. The views returned by intern stay valid for the lifetime
+//of the pool (also if it is moved), and equal strings share storage.
+class string_pool {
+private:
+    std::unordered_set<std::string> strings;
+
+public:
+    
+    string_pool() : strings() {}
+    
+    std::string_view intern(const std::string& str){
+        return *strings.insert(str).first;
+    }
+    
+    size_t size() const { return strings.size(); }
+
+};
+
+};
+
+
+#endif
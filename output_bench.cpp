@@ -0,0 +1,180 @@
+#include <cctype>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <getopt.h>
+
+#include "char_scan.hpp"
+#include "language.hpp"
+#include "output_buffer.hpp"
+
+//Measures how fast highlighted output is written, comparing the way it used
+//to be done (escaping byte by byte into the stream, a temporary string for the
+//closing braces and std::endl at every line end) against the output buffer
+//with table-driven escaping. Each line of the sample is split into words and
+//the runs between them, and every token is written the way a matched rule is.
+//With -l, each line is a single token instead, as in long comments and strings.
+//
+//Usage: output_bench [-l] [-o sink] [-r repetitions] sample...
+//The output goes to /dev/null unless -o is given. Both writers must produce
+//the same bytes, which is checked before timing.
+
+using bench_clock = std::chrono::steady_clock;
+
+static constexpr const char* open_style = "\\textcolor[HTML]{1F1C1B}{\\textbf{";
+static constexpr size_t open_braces = 2;
+
+//Tokens are (position, length) within their line
+struct sample_line {
+    std::string text;
+    std::vector<std::pair<size_t, size_t>> tokens;
+};
+
+static bool legacy_escape(std::ostream& out, char ch){
+    switch(ch){
+        case '\\':  out << "\\textbackslash{}";  return true;
+        case '{':   out << "\\{";           return true;
+        case '}':   out << "\\}";           return true;
+        case 0:
+        case '\f':
+        case '\v':
+        case '\r':                          return false;
+        case '\t':
+        case '\n':
+        case ' ':   out << ch;              return false;
+        default:    out << ch;              return true;
+    }
+}
+
+static size_t write_legacy(std::ostream& out, const std::vector<sample_line>& lines){
+    size_t visible = 0;
+    for(const sample_line& line : lines){
+        for(const auto& [pos, len] : line.tokens){
+            out << open_style;
+            
+            bool only_space = true;
+            for(size_t i = pos; i < pos+len; ++i)
+                only_space = !legacy_escape(out, line.text[i]) && only_space;
+            visible += !only_space;
+            
+            out << std::string(open_braces, '}');
+        }
+        out << std::endl;
+    }
+    return visible;
+}
+
+static size_t write_buffered(std::ostream& out, const std::vector<sample_line>& lines){
+    util::output_buffer obuf(out);
+    
+    size_t visible = 0;
+    for(const sample_line& line : lines){
+        for(const auto& [pos, len] : line.tokens){
+            obuf << open_style;
+            visible += language::latex_escape(obuf, line.text, pos, len);
+            obuf.fill('}', open_braces);
+        }
+        obuf.put('\n');
+    }
+    return visible;
+}
+
+static void read_lines(const std::string& path, bool whole_lines, std::vector<sample_line>& lines){
+    std::ifstream in(path);
+    if(!in){
+        std::cerr << "ERROR: unable to open \"" << path << "\"\n";
+        exit(EXIT_FAILURE);
+    }
+    
+    std::string text;
+    while(std::getline(in, text)){
+        sample_line line;
+        line.text = text;
+        
+        if(whole_lines && !text.empty())
+            line.tokens.emplace_back(0, text.length());
+        
+        for(size_t pos = 0; !whole_lines && pos < text.length(); ){
+            bool word = std::isalnum(static_cast<unsigned char>(text[pos]));
+            size_t end = pos + 1;
+            while(end < text.length() && bool(std::isalnum(static_cast<unsigned char>(text[end]))) == word)
+                ++end;
+            
+            line.tokens.emplace_back(pos, end - pos);
+            pos = end;
+        }
+        lines.push_back(line);
+    }
+}
+
+int main(int argc, char** argv){
+    std::string sink = "/dev/null";
+    size_t reps = 20;
+    bool whole_lines = false;
+    
+    int c;
+    while((c = getopt(argc, argv, "lo:r:h")) != -1){
+        switch(c){
+            case 'l':
+                whole_lines = true;
+                break;
+            case 'o':
+                sink = optarg;
+                break;
+            case 'r':
+                reps = std::stoul(optarg);
+                break;
+            default:
+                std::cerr << "Usage: " << argv[0] << " [-l] [-o sink] [-r repetitions] sample...\n";
+                return (c == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    
+    if(optind == argc){
+        std::cerr << "ERROR: no samples given\n";
+        return EXIT_FAILURE;
+    }
+    
+    std::vector<sample_line> lines;
+    for(int i = optind; i < argc; ++i)
+        read_lines(argv[i], whole_lines, lines);
+    
+    std::ostringstream legacy_str, buffered_str;
+    size_t legacy_visible = write_legacy(legacy_str, lines);
+    size_t buffered_visible = write_buffered(buffered_str, lines);
+    
+    if(legacy_str.str() != buffered_str.str() || legacy_visible != buffered_visible){
+        std::cerr << "ERROR: the writers give different output\n";
+        return EXIT_FAILURE;
+    }
+    
+    std::ofstream out(sink);
+    if(!out){
+        std::cerr << "ERROR: unable to open \"" << sink << "\"\n";
+        return EXIT_FAILURE;
+    }
+    
+    double legacy_time = 0, buffered_time = 0;
+    for(size_t r = 0; r < reps; ++r){
+        auto start = bench_clock::now();
+        write_legacy(out, lines);
+        out.flush();
+        legacy_time += std::chrono::duration<double>(bench_clock::now() - start).count();
+        
+        start = bench_clock::now();
+        write_buffered(out, lines);
+        out.flush();
+        buffered_time += std::chrono::duration<double>(bench_clock::now() - start).count();
+    }
+    
+    double mb = reps * legacy_str.str().size() / 1e6;
+    std::cout << mb << " MB written by each writer, " << util::scan_kernel_name() << " scanning\n"
+              << "Per-byte stream output: " << legacy_time   << " s (" << mb / legacy_time   << " MB/s)\n"
+              << "Buffered output:        " << buffered_time << " s (" << mb / buffered_time << " MB/s)\n";
+    
+    return EXIT_SUCCESS;
+}
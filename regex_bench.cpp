@@ -0,0 +1,210 @@
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <regex>
+#include <string>
+#include <vector>
+
+#include <getopt.h>
+
+#include "dom.hpp"
+#include "kate_regex.hpp"
+
+using namespace DOM;
+
+//Compares the in-tree regex engine against std::regex on every RegExpr rule
+//in the given syntax files. Each pattern is matched at every position of every
+//sample line, the way the highlighter would try it.
+//
+//Usage: regex_bench [-i sample] [-r repetitions] [-v] syntax-file...
+//The syntax files themselves are used as sample text unless -i is given.
+
+using bench_clock = std::chrono::steady_clock;
+
+struct pattern_data {
+    std::string str;
+    std::string source;
+    bool ins;
+};
+
+struct totals {
+    size_t patterns = 0;
+    size_t kate_failed = 0;
+    size_t std_failed = 0;
+    size_t compared = 0;
+    size_t mismatches = 0;
+    
+    double kate_compile = 0;
+    double std_compile = 0;
+    double kate_match = 0;
+    double std_match = 0;
+};
+
+static double seconds_since(bench_clock::time_point start){
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+static void read_lines(const std::string& path, std::vector<std::string>& lines){
+    std::ifstream in(path);
+    if(!in){
+        std::cerr << "ERROR: unable to open \"" << path << "\"\n";
+        exit(EXIT_FAILURE);
+    }
+    
+    std::string line;
+    while(std::getline(in, line))
+        lines.push_back(line);
+}
+
+static void collect_patterns(const std::string& path, std::vector<pattern_data>& patterns){
+    dom_element lang_file;
+    lang_file.parse_xml(path);
+    
+    const dom_element& lang = lang_file.unique_element("language").or_error();
+    
+    for(const auto& context : lang.unique_element("highlighting")
+                                  .unique_element("contexts").or_error()
+                                  .all_elements("context")
+       ){
+        for(const auto& rule : context.all_elements("RegExpr")){
+            //Dynamic patterns need captures from a previous match, skip them
+            if(rule.attribute("dynamic").or_default("false").bool_val())
+                continue;
+            
+            patterns.push_back({
+                rule.attribute("String").or_error(),
+                path,
+                rule.attribute("insensitive").or_default("false").bool_val()
+            });
+        }
+    }
+}
+
+int main(int argc, char** argv){
+    std::vector<std::string> sample_paths;
+    size_t reps = 1;
+    bool verbose = false;
+    
+    int c;
+    while((c = getopt(argc, argv, "i:r:vh")) != -1){
+        switch(c){
+            case 'i':
+                sample_paths.push_back(optarg);
+                break;
+            case 'r':
+                reps = std::stoul(optarg);
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            default:
+                std::cerr << "Usage: " << argv[0] << " [-i sample] [-r repetitions] [-v] syntax-file...\n";
+                return (c == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    
+    std::vector<pattern_data> patterns;
+    std::vector<std::string> lines;
+    
+    for(int i = optind; i < argc; ++i){
+        collect_patterns(argv[i], patterns);
+        if(sample_paths.empty())
+            read_lines(argv[i], lines);
+    }
+    for(const std::string& path : sample_paths)
+        read_lines(path, lines);
+    
+    if(patterns.empty()){
+        std::cerr << "ERROR: no RegExpr rules found\n";
+        return EXIT_FAILURE;
+    }
+    
+    std::cout << "Benchmarking " << patterns.size() << " patterns on " << lines.size() << " lines\n";
+    
+    totals tot;
+    util::kate_regex::match_results kate_match;
+    std::smatch std_match;
+    
+    for(const pattern_data& pat : patterns){
+        ++tot.patterns;
+        
+        util::kate_regex kate_re;
+        std::regex std_re;
+        bool kate_ok = true, std_ok = true;
+        
+        auto start = bench_clock::now();
+        try{
+            kate_re = util::kate_regex(pat.str, pat.ins);
+        } catch(const util::kate_regex::error& err){
+            kate_ok = false;
+            ++tot.kate_failed;
+            if(verbose)
+                std::cout << "kate_regex rejected \"" << pat.str << "\" (" << pat.source << "): " << err.what() << "\n";
+        }
+        tot.kate_compile += seconds_since(start);
+        
+        start = bench_clock::now();
+        try{
+            std_re = std::regex(pat.str, pat.ins ? (std::regex::ECMAScript | std::regex::icase)
+                                                 : std::regex::ECMAScript);
+        } catch(const std::regex_error&){
+            std_ok = false;
+            ++tot.std_failed;
+        }
+        tot.std_compile += seconds_since(start);
+        
+        //Only time patterns that both engines accept, so that the totals are comparable
+        if(!kate_ok || !std_ok)
+            continue;
+        ++tot.compared;
+        
+        //Matches at each position, collected so that the two engines can be compared
+        std::vector<size_t> kate_lengths, std_lengths;
+        
+        start = bench_clock::now();
+        for(size_t r = 0; r < reps; ++r){
+            kate_lengths.clear();
+            for(const std::string& line : lines){
+                for(size_t pos = 0; pos < line.length(); ++pos){
+                    kate_lengths.push_back( kate_re.match_at(line, pos, kate_match)
+                                            ? kate_match.length() : std::string::npos );
+                }
+            }
+        }
+        tot.kate_match += seconds_since(start);
+        
+        start = bench_clock::now();
+        for(size_t r = 0; r < reps; ++r){
+            std_lengths.clear();
+            for(const std::string& line : lines){
+                for(size_t pos = 0; pos < line.length(); ++pos){
+                    auto flags = std::regex_constants::match_continuous;
+                    if(pos > 0)
+                        flags |= std::regex_constants::match_prev_avail;
+                    
+                    std_lengths.push_back( std::regex_search(line.begin() + pos, line.end(), std_match, std_re, flags)
+                                           ? std_match.length() : std::string::npos );
+                }
+            }
+        }
+        tot.std_match += seconds_since(start);
+        
+        if(kate_lengths != std_lengths){
+            ++tot.mismatches;
+            if(verbose)
+                std::cout << "Results differ for \"" << pat.str << "\" (" << pat.source << ")\n";
+        }
+    }
+    
+    std::cout << "\n"
+              << "                    kate_regex   std::regex\n"
+              << "Rejected patterns:  " << tot.kate_failed << "\t\t" << tot.std_failed << "\n"
+              << "Compile time (s):   " << tot.kate_compile << "\t" << tot.std_compile << "\n"
+              << "Match time (s):     " << tot.kate_match << "\t" << tot.std_match << "\n"
+              << "\n"
+              << "Patterns accepted by both (and timed): " << tot.compared
+              << ", of which " << tot.mismatches << " gave different results\n"
+              << "(ECMAScript differs from the PCRE dialect of Kate, so some differences are expected)\n";
+    
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,124 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "kate_regex.hpp"
+
+//Checks the in-tree regex engine against results taken from PCRE (pcre2test),
+//which is what Kate itself uses. Each case is matched at a single position.
+//
+//Usage: regex_check
+//Prints the cases that fail, and exits with failure if there are any.
+
+struct regex_case {
+    const char* pattern;
+    bool ins;
+    const char* subject;
+    size_t pos;
+    
+    long length;                        //-1 if there must be no match
+    std::vector<const char*> groups;    //Groups 1 and up, nullptr if unset
+};
+
+static const std::vector<regex_case> cases = {
+    //Literals, classes and assertions
+    { "abc",                false, "xabcx",         1,  3,  {} },
+    { "a.c",                false, "a-c",           0,  3,  {} },
+    { "[a-c]+",             false, "abcd",          0,  3,  {} },
+    { "[^a-c]+",            false, "xyza",          0,  3,  {} },
+    { "[[:digit:]]+",       false, "123a",          0,  3,  {} },
+    { "\\d+\\s\\w+",        false, "12 ab_3-",      0,  7,  {} },
+    { "\\bfoo\\b",          false, "foo bar",       0,  3,  {} },
+    { "\\bfoo",             false, "xfoo",          1,  -1, {} },
+    { "^$",                 false, "",              0,  0,  {} },
+    { "\\Qa.b\\E",          false, "a.b",           0,  3,  {} },
+    { "\\Qa.b\\E",          false, "axb",           0,  -1, {} },
+    { "\\x41+",             false, "AAB",           0,  2,  {} },
+    { "(?i)ABC",            false, "abc",           0,  3,  {} },
+    { "abc",                true,  "ABC",           0,  3,  {} },
+    { "a(?i)b|c",           false, "C",             0,  1,  {} },
+    
+    //Quantifiers and alternation, in PCRE priority order
+    { "a|ab",               false, "ab",            0,  1,  {} },
+    { "a+",                 false, "aaa",           0,  3,  {} },
+    { "a+?",                false, "aaa",           0,  1,  {} },
+    { "a{2,3}",             false, "aaaa",          0,  3,  {} },
+    { "a{2,3}?",            false, "aaaa",          0,  2,  {} },
+    { "a{2,}",              false, "a",             0,  -1, {} },
+    { "(a+)+b",             false, "aaaaaaaaaaaaaaaaaaaaaaaaac", 0, -1, {} },
+    
+    //Captures
+    { "(a|b)*c",            false, "abac",          0,  4,  { "a" } },
+    { "(a)|b",              false, "b",             0,  1,  { nullptr } },
+    { "(?:(a)|b)+",         false, "ab",            0,  2,  { "a" } },
+    { "(a*)*b",             false, "aaab",          0,  4,  { "" } },
+    { "(a*)+b",             false, "aaab",          0,  4,  { "" } },
+    { "(a|)*b",             false, "aab",           0,  3,  { "" } },
+    { "(a*)*",              false, "b",             0,  0,  { "" } },
+    { "(a?)+?b",            false, "ab",            0,  2,  { "a" } },
+    { "(?<name>a)(b)",      false, "ab",            0,  2,  { "a", "b" } },
+    { "(?P<name>a)(b)",     false, "ab",            0,  2,  { "a", "b" } },
+    
+    //Lookaround
+    { "a(?=b)",             false, "ab",            0,  1,  {} },
+    { "a(?=b)",             false, "ac",            0,  -1, {} },
+    { "a(?!b)",             false, "ac",            0,  1,  {} },
+    { "(?=(a))a(b)",        false, "ab",            0,  2,  { "a", "b" } },
+    { "(?=(a+))a",          false, "aaa",           0,  1,  { "aaa" } },
+    { "(?=a(?=(b)))ab",     false, "ab",            0,  2,  { "b" } },
+    { "(?!(a))b",           false, "b",             0,  1,  { nullptr } },
+    { "(?<=(a))b",          false, "ab",            1,  1,  { "a" } },
+    { "(?<!a)b",            false, "ab",            1,  -1, {} },
+    
+    //Backreferences
+    { "(a)\\1",             false, "aa",            0,  2,  { "a" } },
+    { "(a)\\1",             true,  "aA",            0,  2,  { "a" } },
+    { "(\\w+)\\s+\\1",      false, "the the",       0,  7,  { "the" } },
+    { "(?<x>ab)\\k<x>",     false, "abab",          0,  4,  { "ab" } },
+    { "(?P<x>ab)(?P=x)",    false, "abab",          0,  4,  { "ab" } },
+    { "(?P<x>ab)(?P=x)",    false, "abac",          0,  -1, {} },
+    { "(?=(a))\\1b",        false, "ab",            0,  2,  { "a" } },
+    { "(a*)*b\\1",          false, "aab",           0,  3,  { "" } },
+};
+
+static std::string show(const char* str){
+    return str ? "\"" + std::string(str) + "\"" : "unset";
+}
+
+int main(){
+    size_t failed = 0;
+    util::kate_regex::match_results m;
+    
+    for(const regex_case& c : cases){
+        std::string problem;
+        
+        try{
+            util::kate_regex re(c.pattern, c.ins);
+            
+            bool matched = re.match_at(c.subject, c.pos, m);
+            long length = matched ? static_cast<long>(m.length()) : -1;
+            
+            if(length != c.length)
+                problem = "length " + std::to_string(length) + ", expected " + std::to_string(c.length);
+            
+            for(size_t i = 0; matched && problem.empty() && i < c.groups.size(); ++i){
+                std::string text = m[i+1];
+                const char* group = (m.position(i+1) == std::string::npos) ? nullptr : text.c_str();
+                
+                if((group == nullptr) != (c.groups[i] == nullptr) || (group && text != c.groups[i]))
+                    problem = "group " + std::to_string(i+1) + " is " + show(group) + ", expected " + show(c.groups[i]);
+            }
+        } catch(const util::kate_regex::error& err){
+            problem = err.what();
+        }
+        
+        if(!problem.empty()){
+            ++failed;
+            std::cout << "FAILED: \"" << c.pattern << "\" on \"" << c.subject << "\" at " << c.pos
+                      << ": " << problem << "\n";
+        }
+    }
+    
+    std::cout << cases.size() - failed << " of " << cases.size() << " cases passed\n";
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
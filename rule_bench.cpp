@@ -0,0 +1,216 @@
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <getopt.h>
+
+#include "dom.hpp"
+#include "language.hpp"
+
+using namespace DOM;
+
+//Measures the cost of a single rule attempt, comparing the generic matcher
+//(which tests first_non_space, column, lookahead, dynamic and ins at runtime)
+//against the kernels specialized on those flags. Every rule of every context
+//is tried at every position of every sample line, regardless of dispatch.
+//
+//Usage: rule_bench [-i sample] [-r repetitions] syntax-file...
+//Syntax files that others include rules from must be given first.
+//The syntax files themselves are used as sample text unless -i is given.
+
+using bench_clock = std::chrono::steady_clock;
+
+struct rule_bench {
+    using context = language::context;
+    using match_results = language::match_results;
+    
+    std::vector<std::string> lines;
+    size_t reps = 1;
+    
+    size_t attempts = 0;
+    size_t mismatches = 0;
+    
+    double generic_time = 0;
+    double kernel_time = 0;
+    
+    //Number of rules using each combination of kernel flags
+    size_t flag_counts[8] = {};
+    
+    static double seconds_since(bench_clock::time_point start){
+        return std::chrono::duration<double>(bench_clock::now() - start).count();
+    }
+    
+    //Runs every rule of the context over the sample, once per repetition.
+    //The match lengths are summed so that the work can not be optimized away
+    template<bool KERNEL>
+    size_t run(const context& con, std::vector<uint32_t>& kernels){
+        util::capture_set captures;
+        match_results new_match;
+        size_t sum = 0;
+        
+        for(size_t r = 0; r < reps; ++r){
+            for(const std::string& line : lines){
+                bool leading_space = true;
+                
+                for(size_t pos = 0; pos < line.length(); ++pos){
+                    for(size_t i = 0; i < con.rules.size(); ++i){
+                        size_t len;
+                        if constexpr(KERNEL)
+                            len = context::match_rule(kernels[i], *con.rules[i].rule, line, pos,
+                                                      captures, new_match, leading_space);
+                        else
+                            len = context::match_rule(*con.rules[i].rule, line, pos,
+                                                      captures, new_match, leading_space);
+                        sum += len + 1;
+                    }
+                    
+                    leading_space = leading_space && std::isspace(line[pos]);
+                }
+            }
+        }
+        
+        return sum;
+    }
+    
+    void bench_context(const context& con){
+        std::vector<uint32_t> kernels;
+        for(const auto& ref : con.rules){
+            kernels.push_back(context::kernel_id(*ref.rule));
+            ++flag_counts[context::get_rule(*ref.rule).kernel_flags];
+        }
+        
+        auto start = bench_clock::now();
+        size_t generic_sum = run<false>(con, kernels);
+        generic_time += seconds_since(start);
+        
+        start = bench_clock::now();
+        size_t kernel_sum = run<true>(con, kernels);
+        kernel_time += seconds_since(start);
+        
+        if(generic_sum != kernel_sum){
+            ++mismatches;
+            std::cout << "Results differ in context \"" << con.get_name() << "\"\n";
+        }
+        
+        for(const std::string& line : lines)
+            attempts += reps * line.length() * con.rules.size();
+    }
+    
+    void bench_language(const language& lang){
+        for(const auto& [name, con] : lang.contexts)
+            bench_context(con);
+    }
+};
+
+static void read_lines(const std::string& path, std::vector<std::string>& lines){
+    std::ifstream in(path);
+    if(!in){
+        std::cerr << "ERROR: unable to open \"" << path << "\"\n";
+        exit(EXIT_FAILURE);
+    }
+    
+    std::string line;
+    while(std::getline(in, line))
+        lines.push_back(line);
+}
+
+//The benchmark does not print anything, so every default style can be plain black
+static void add_default_styles(const dom_element& defn,
+                               std::unordered_map<std::string, language::style>& default_styles){
+    
+    for(const auto& item : defn.unique_element("highlighting")
+                               .unique_element("itemDatas").or_error()
+                               .all_elements("itemData")
+       ){
+        language::style ds;
+        
+        ds.name = item.attribute("defStyleNum").or_error();
+        ds.deflt_style = nullptr;
+        ds.colour = "000000";
+        ds.bg_colour = "FFFFFF";
+        ds.italic = ds.bold = ds.underline = ds.strikethrough = false;
+        
+        default_styles.emplace(ds.name, ds);
+    }
+}
+
+int main(int argc, char** argv){
+    std::vector<std::string> sample_paths;
+    rule_bench bench;
+    
+    int c;
+    while((c = getopt(argc, argv, "i:r:h")) != -1){
+        switch(c){
+            case 'i':
+                sample_paths.push_back(optarg);
+                break;
+            case 'r':
+                bench.reps = std::stoul(optarg);
+                break;
+            default:
+                std::cerr << "Usage: " << argv[0] << " [-i sample] [-r repetitions] syntax-file...\n";
+                return (c == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    
+    if(optind == argc){
+        std::cerr << "ERROR: no syntax files given\n";
+        return EXIT_FAILURE;
+    }
+    
+    std::unordered_map<std::string, language::style> default_styles;
+    std::unordered_map<std::string, language> languages;
+    std::vector<std::string> names;
+    
+    for(int i = optind; i < argc; ++i){
+        dom_element file;
+        file.parse_xml(argv[i]);
+        
+        const dom_element& defn = file.unique_element("language").or_error();
+        add_default_styles(defn, default_styles);
+        
+        std::string name = defn.attribute("name").or_error();
+        languages.insert( std::make_pair(name, language(defn, default_styles, languages, true, QUIET)) );
+        names.push_back(name);
+        
+        if(sample_paths.empty())
+            read_lines(argv[i], bench.lines);
+    }
+    for(const std::string& path : sample_paths)
+        read_lines(path, bench.lines);
+    
+    for(const std::string& name : names)
+        bench.bench_language(languages.at(name));
+    
+    if(bench.attempts == 0){
+        std::cerr << "ERROR: nothing to match\n";
+        return EXIT_FAILURE;
+    }
+    
+    std::cout << "Rules by kernel flags (constrained/dynamic/insensitive):\n";
+    for(size_t f = 0; f < 8; ++f){
+        if(bench.flag_counts[f] == 0)
+            continue;
+        
+        std::cout << "    " << ((f & 0b001) ? 'C' : '-')
+                            << ((f & 0b010) ? 'D' : '-')
+                            << ((f & 0b100) ? 'I' : '-')
+                  << "  " << bench.flag_counts[f] << "\n";
+    }
+    
+    double ns = 1e9 / bench.attempts;
+    std::cout << "\n"
+              << bench.attempts << " attempts\n"
+              << "Generic matcher:     " << bench.generic_time << " s (" << bench.generic_time * ns << " ns/attempt)\n"
+              << "Specialized kernels: " << bench.kernel_time  << " s (" << bench.kernel_time  * ns << " ns/attempt)\n";
+    
+    if(bench.mismatches > 0){
+        std::cout << bench.mismatches << " contexts gave different results\n";
+        return EXIT_FAILURE;
+    }
+    
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,29 @@
+# Writes a header defining KATELISTINGS_BUILD_ID, a hash of the sources that
+# katelistings is built from. It identifies the build to the language cache,
+# the highlight cache and a running server, so that they never mix the output of
+# different builds. The header is only rewritten when the hash changes.
+#
+# Usage: cmake -DSOURCE_DIR=<repository> -DOUTPUT=<header> -P build_id.cmake
+
+file(GLOB_RECURSE SOURCES RELATIVE ${SOURCE_DIR}
+    ${SOURCE_DIR}/src/*.cpp ${SOURCE_DIR}/include/*.hpp
+    ${SOURCE_DIR}/lib/util/*.cpp ${SOURCE_DIR}/lib/util/*.hpp)
+list(SORT SOURCES)
+
+set(DIGEST "")
+foreach(SOURCE ${SOURCES})
+    file(SHA256 ${SOURCE_DIR}/${SOURCE} HASH)
+    string(APPEND DIGEST "${SOURCE} ${HASH}\n")
+endforeach()
+
+string(SHA256 BUILD_ID "${DIGEST}")
+string(SUBSTRING ${BUILD_ID} 0 16 BUILD_ID)
+
+set(CONTENT "#define KATELISTINGS_BUILD_ID \"${BUILD_ID}\"\n")
+set(OLD_CONTENT "")
+if(EXISTS ${OUTPUT})
+    file(READ ${OUTPUT} OLD_CONTENT)
+endif()
+if(NOT OLD_CONTENT STREQUAL CONTENT)
+    file(WRITE ${OUTPUT} "${CONTENT}")
+endif()
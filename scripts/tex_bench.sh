@@ -0,0 +1,51 @@
+#!/bin/bash
+
+# Time pdflatex on a listing written in each output mode of katelistings
+# Usage: scripts/tex_bench.sh <source file> [runs]
+# (Run from the katelistings directory, like katelistings itself)
+
+src=$1
+runs=${2:-3}
+if [ -z "$src" ]; then
+    echo "Usage: $0 <source file> [runs]"
+    exit 1
+fi
+if ! command -v pdflatex > /dev/null; then
+    echo "pdflatex not found"
+    exit 1
+fi
+
+sty_dir=$(cd "$(dirname "$0")/.." && pwd)
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+TIMEFORMAT=%R
+for mode in "" "-b" "-c" "-k" "-k -b" "-x" "-x -b"
+do
+    rm -f "$dir"/*
+    katelistings -q $mode -i "$src" -o "$dir/listing.lst" || exit 1
+    
+    # Commands and compact macros are defined in <language>.lst.sty
+    {
+        echo "\\documentclass{article}"
+        echo "\\usepackage{katelistings}"
+        for sty in "$dir"/*.lst.sty
+        do
+            [ -e "$sty" ] && echo "\\usepackage{$(basename "$sty" .sty)}"
+        done
+        echo "\\begin{document}"
+        echo "\\small\\input{listing.lst}"
+        echo "\\end{document}"
+    } > "$dir/bench.tex"
+    
+    best=""
+    for (( i = 0; i < runs; ++i ))
+    do
+        t=$( { time (cd "$dir" && TEXINPUTS="$sty_dir:" pdflatex -interaction=batchmode bench.tex > /dev/null 2>&1) ; } 2>&1 )
+        if [ -z "$best" ] || (( $(echo "$t < $best" | bc) )); then
+            best=$t
+        fi
+    done
+    
+    printf "%-8s %10s bytes %8s s\n" "${mode:-default}" "$(stat -c %s "$dir/listing.lst")" "$best"
+done
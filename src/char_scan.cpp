@@ -0,0 +1,150 @@
+#include "char_scan.hpp"
+
+#include <cstdlib>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+namespace {
+    enum byte_class { LATEX_SPECIAL, NEWLINE };
+    
+    using scan_fn = const char* (*)(const char*, const char*);
+    
+    template<byte_class CLASS>
+    inline bool is_member(unsigned char c){
+        if constexpr(CLASS == NEWLINE)
+            return c == '\n';
+        else
+            return util::is_latex_special(c);
+    }
+    
+    template<byte_class CLASS>
+    const char* scan_scalar(const char* p, const char* end){
+        for(; p < end; ++p){
+            if(is_member<CLASS>(*p))
+                return p;
+        }
+        return end;
+    }
+
+#ifdef SCAN_X86
+    //Bytes are unsigned here, so control characters are found as those
+    //left unchanged by min(c, 0x1F)
+    
+    template<byte_class CLASS>
+    __attribute__((target("sse2")))
+    inline __m128i members_sse2(__m128i c){
+        if constexpr(CLASS == NEWLINE)
+            return _mm_cmpeq_epi8(c, _mm_set1_epi8('\n'));
+        else{
+            __m128i ctrl = _mm_cmpeq_epi8(_mm_min_epu8(c, _mm_set1_epi8(0x1F)), c);
+            __m128i bsl  = _mm_cmpeq_epi8(c, _mm_set1_epi8('\\'));
+            __m128i lbr  = _mm_cmpeq_epi8(c, _mm_set1_epi8('{'));
+            __m128i rbr  = _mm_cmpeq_epi8(c, _mm_set1_epi8('}'));
+            return _mm_or_si128(_mm_or_si128(ctrl, bsl), _mm_or_si128(lbr, rbr));
+        }
+    }
+    
+    //Spans of at least a vector end with a block that overlaps the one before,
+    //instead of a scalar tail. The overlapping bytes are tested twice, but
+    //none of them are members
+    template<byte_class CLASS>
+    __attribute__((target("sse2")))
+    const char* scan_sse2(const char* p, const char* end){
+        if(end - p < 16)
+            return scan_scalar<CLASS>(p, end);
+        
+        const char* last = end - 16;
+        for(;; p += 16){
+            if(p > last)
+                p = last;
+            
+            __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            int mask = _mm_movemask_epi8(members_sse2<CLASS>(c));
+            if(mask)
+                return p + __builtin_ctz(mask);
+            if(p == last)
+                return end;
+        }
+    }
+    
+    template<byte_class CLASS>
+    __attribute__((target("avx2")))
+    inline __m256i members_avx2(__m256i c){
+        if constexpr(CLASS == NEWLINE)
+            return _mm256_cmpeq_epi8(c, _mm256_set1_epi8('\n'));
+        else{
+            __m256i ctrl = _mm256_cmpeq_epi8(_mm256_min_epu8(c, _mm256_set1_epi8(0x1F)), c);
+            __m256i bsl  = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('\\'));
+            __m256i lbr  = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('{'));
+            __m256i rbr  = _mm256_cmpeq_epi8(c, _mm256_set1_epi8('}'));
+            return _mm256_or_si256(_mm256_or_si256(ctrl, bsl), _mm256_or_si256(lbr, rbr));
+        }
+    }
+    
+    //Shorter spans are left to SSE2 before any 256-bit register is used, since
+    //going on to SSE code with the upper halves in use is very slow
+    template<byte_class CLASS>
+    __attribute__((target("avx2")))
+    const char* scan_avx2(const char* p, const char* end){
+        if(end - p < 32)
+            return scan_sse2<CLASS>(p, end);
+        
+        const char* last = end - 32;
+        for(;; p += 32){
+            if(p > last)
+                p = last;
+            
+            __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+            unsigned mask = _mm256_movemask_epi8(members_avx2<CLASS>(c));
+            if(mask)
+                return p + __builtin_ctz(mask);
+            if(p == last)
+                return end;
+        }
+    }
+#endif
+    
+    struct scan_kernels {
+        const char* name;
+        scan_fn latex_special;
+        scan_fn newline;
+    };
+    
+    //KATELISTINGS_SCAN=scalar or sse2 forces a slower kernel, for testing and benchmarking
+    scan_kernels select_kernels(){
+        const char* force = std::getenv("KATELISTINGS_SCAN");
+        std::string_view forced = force ? force : "";
+
+#ifdef SCAN_X86
+        __builtin_cpu_init();
+        if((forced.empty() || forced == "avx2") && __builtin_cpu_supports("avx2"))
+            return {"avx2", scan_avx2<LATEX_SPECIAL>, scan_avx2<NEWLINE>};
+        if(forced != "scalar" && __builtin_cpu_supports("sse2"))
+            return {"sse2", scan_sse2<LATEX_SPECIAL>, scan_sse2<NEWLINE>};
+#endif
+        
+        return {"scalar", scan_scalar<LATEX_SPECIAL>, scan_scalar<NEWLINE>};
+    }
+    
+    //Selected on first use, so that it is ready during static initialization
+    const scan_kernels& kernels(){
+        static const scan_kernels k = select_kernels();
+        return k;
+    }
+};
+
+const char* util::find_latex_special_wide(const char* begin, const char* end){
+    return kernels().latex_special(begin, end);
+}
+
+const char* util::find_newline(const char* begin, const char* end){
+    return kernels().newline(begin, end);
+}
+
+const char* util::scan_kernel_name(){
+    return kernels().name;
+}
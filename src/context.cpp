@@ -1,18 +1,8 @@
 #include "language.hpp"
+#include "rule_types.hpp"
 
 #define CONTEXT language::context
 
-enum rule_type {
-    any_char, 
-    detect_char, detect_2_chars, detect_spaces, detect_identifier,
-    rfloat, rint,
-    hlc_oct, hlc_hex, hlc_string_char, hlc_char,
-    string_detect, word_detect, range_detect,
-    keyword, reg_expr,
-    line_continue,
-    INCLUDE_RULES
-};
-
 static const std::unordered_map<std::string, rule_type> rule_map(
     {
         {"AnyChar",             rule_type::any_char            },
@@ -36,7 +26,7 @@ static const std::unordered_map<std::string, rule_type> rule_map(
     });
     
 
-void CONTEXT::parse(const dom_element& defn, const language& lang,
+void CONTEXT::parse(const dom_element& defn, language& lang,
                     const std::unordered_map<std::string, language>& languages,
                     print_options opts)
 {    
@@ -57,7 +47,12 @@ void CONTEXT::parse(const dom_element& defn, const language& lang,
     
 #define RULE_CASE(NN)                                                   \
         case rule_type::NN:                                             \
-        rules.push_back( (new NN)->init(rule, lang) );                  \
+        static_assert(std::is_same_v<                                   \
+            std::variant_alternative_t<rule_type::NN, rule_variant>, NN \
+        >);                                                             \
+        std::get<NN>( lang.rules.emplace_back(std::in_place_type<NN>) ) \
+            .init(rule, lang);                                          \
+        add_rule(lang.rules.back());                                    \
         break;                                                          \
         
     for(const dom_element& rule : defn.all_elements()){
@@ -68,23 +63,7 @@ void CONTEXT::parse(const dom_element& defn, const language& lang,
             rule.error("Unknown rule type: \"" + rule.get_name() + "\"");
     
         switch(match->second){
-            RULE_CASE(any_char)
-            RULE_CASE(detect_char) 
-            RULE_CASE(detect_2_chars) 
-            RULE_CASE(detect_spaces) 
-            RULE_CASE(detect_identifier)
-            RULE_CASE(rfloat)
-            RULE_CASE(hlc_oct) 
-            RULE_CASE(hlc_hex) 
-            RULE_CASE(hlc_string_char) 
-            RULE_CASE(hlc_char)
-            RULE_CASE(rint)
-            RULE_CASE(keyword)
-            RULE_CASE(line_continue)
-            RULE_CASE(string_detect)
-            RULE_CASE(word_detect)
-            RULE_CASE(reg_expr)
-            RULE_CASE(range_detect)
+            ALL_RULE_CASES
             
             case INCLUDE_RULES:
                 include_rules(rule, lang, languages, opts);
@@ -94,16 +73,113 @@ void CONTEXT::parse(const dom_element& defn, const language& lang,
     
     }
 #undef RULE_CASE  
+    
+    build_dispatch();
 }
 
-CONTEXT::context(dom_element::const_query& empty_lines) : context("<empty line>") {
+CONTEXT::context(const dom_element::const_query& empty_lines, language& lang) : context("<empty line>") {
     for(const dom_element& empty_line : empty_lines.all_elements("emptyLine")){
 //         std::cout << "Adding empty-line rule \"" << empty_line.attribute("regexpr").or_error().val() << "\"\n";
-        rules.push_back(std::make_unique<reg_expr>(empty_line.attribute("String").or_error()));
+        add_rule( lang.rules.emplace_back(reg_expr(empty_line.attribute("String").or_error(), lang)) );
+    }
+    
+    build_dispatch();
+}
+
+//The groups that dynamic rules refer to are known from their definitions
+uint16_t CONTEXT::dynamic_groups() const {
+    uint16_t used = 0;
+    for(const rule_ref& ref : rules){
+        const rule_variant& var = *ref.rule;
+        if(!(get_rule(var).kernel_flags & rule::KERNEL_DYNAMIC))
+            continue;
+        
+        if(auto r = std::get_if<detect_char>(&var))
+            used |= rule::dynamic_groups(r->chr);
+        else if(auto r = std::get_if<string_detect>(&var))
+            used |= rule::dynamic_groups(r->str);
+        else if(auto r = std::get_if<reg_expr>(&var))
+            used |= rule::dynamic_groups(r->str);
     }
+    return used;
 }
 
-void CONTEXT::include_rules(const dom_element& defn, const language& lang,
+//Line ends, empty lines and fallthrough hand the captures of a context on to the
+//context they switch to, so it also keeps the groups that that context uses.
+//Contexts of other languages are already done, since languages are loaded after
+//their dependencies
+void CONTEXT::collect_groups(std::unordered_map<std::string, context>& contexts){
+    for(auto& [name, con] : contexts)
+        con.groups = con.dynamic_groups();
+    
+    for(bool changed = true; changed;){
+        changed = false;
+        for(auto& [name, con] : contexts){
+            uint16_t groups = con.groups;
+            for(const context_switch* con_sw : {&con.end_context, &con.empty_context, &con.fall_context}){
+                if(con_sw->target)
+                    groups |= con_sw->target->groups;
+            }
+            
+            if(groups != con.groups){
+                con.groups = groups;
+                changed = true;
+            }
+        }
+    }
+}
+
+//Sorts the rules into buckets by the bytes they can start with.
+//Rules whose first bytes are unknown go into every bucket.
+//Each entry also records the matching kernel for the type and flags of the rule.
+void CONTEXT::build_dispatch(){
+    std::vector< std::bitset<256> > first;
+    first.reserve(rules.size());
+    
+    for(const rule_ref& ref : rules){
+        std::bitset<256> set;
+        if(!first_bytes(*ref.rule, set))
+            set.set();
+        first.push_back(set);
+    }
+    
+    dispatch_rules.clear();
+    for(size_t c = 0; c < 256; ++c){
+        dispatch_index[c] = dispatch_rules.size();
+        
+        for(size_t i = 0; i < rules.size(); ++i){
+            if(first[i].test(c))
+                dispatch_rules.push_back({ static_cast<uint32_t>(i), kernel_id(*rules[i].rule) });
+        }
+    }
+    dispatch_index[256] = dispatch_rules.size();
+}
+
+#define RULE_CASE(NN)                                                   \
+        case rule_type::NN:                                             \
+        return *std::get_if<NN>(&var);
+
+const CONTEXT::rule& CONTEXT::get_rule(const rule_variant& var){
+    switch(var.index()){
+        ALL_RULE_CASES
+        default: throw std::bad_variant_access();
+    }
+}
+#undef RULE_CASE
+
+#define RULE_CASE(NN)                                                   \
+        case rule_type::NN:                                             \
+        return std::get_if<NN>(&var)->first_bytes(set);
+
+bool CONTEXT::first_bytes(const rule_variant& var, std::bitset<256>& set){
+    switch(var.index()){
+        ALL_RULE_CASES
+        default: return false;
+    }
+}
+#undef RULE_CASE
+
+void CONTEXT::include_rules(const dom_element& defn, language& lang,
                    const std::unordered_map<std::string, language>& languages,
                    print_options opts){
         
@@ -130,6 +206,11 @@ void CONTEXT::include_rules(const dom_element& defn, const language& lang,
     std::string con_name = spec.substr(0, sep);
     if(con_name.empty())
         src_con = src_lang->default_context;
+    //Contexts of this language are parsed on demand, and their rules are needed now
+    else if(src_lang == lang && lang.context_defs.find(con_name) != lang.context_defs.end()){
+        lang.parse_context(lang.context_defs.at(con_name), con_name, languages, opts);
+        src_con = lang.contexts.at(con_name);
+    }
     else{
         auto con_iter = src_lang->contexts.find(con_name);
         if(con_iter == src_lang->contexts.end())
@@ -143,24 +224,24 @@ void CONTEXT::include_rules(const dom_element& defn, const language& lang,
                                << "\" in language \"" << src_lang->name << "\"\n";;
             
     
-    for(const std::unique_ptr<rule>& rule_ptr : src_con->rules){
-        auto new_rule = rule_ptr->clone();
+    //The rules are shared with the source context, which already refers to the
+    //rules that it included in turn
+    for(const rule_ref& src_ref : src_con->rules){
+        rule_ref& new_ref = rules.emplace_back(src_ref);
         
         //Redirects attributes to use the destination language 
         //(otherwise they remain pointing to the source language)
         if(incl_attr && src_lang != lang){
-            std::string attr = new_rule->attribute ? new_rule->attribute->name : src_con->attribute->name;
+            std::string attr = src_ref.attribute ? src_ref.attribute->name : src_con->attribute->name;
             
-            new_rule->attribute = lang.get_style(attr, defn);
+            new_ref.attribute = lang.get_style(attr, defn);
         }
-    
-        rules.push_back( std::move(new_rule) );
     }
 }
 
-bool CONTEXT::empty_line(const std::string& buf, context_stack& stack, const context& empty_lines) const {
+bool CONTEXT::empty_line(std::string_view buf, context_stack& stack, const context& empty_lines) const {
    
-    std::smatch match;
+    match_results match;
     if(!buf.empty()){
         auto[match_len, rule_ptr] = empty_lines.apply_rules(buf, 0, true, stack, match);
         
@@ -168,43 +249,55 @@ bool CONTEXT::empty_line(const std::string& buf, context_stack& stack, const con
             return false;
     }
     
-    stack.switch_context(empty_context, stack.curr_match());
+    stack.switch_context(empty_context);
     return true;
     
 }
 void CONTEXT::end_of_line(context_stack& stack) const {
-    stack.switch_context(end_context, stack.curr_match());
+    stack.switch_context(end_context);
 }
 
 std::pair< size_t, util::cref_ptr<language::style> > 
-CONTEXT::apply_rules(const std::string& buf, size_t pos, bool leading_space, context_stack& stack) const {
+CONTEXT::apply_rules(std::string_view buf, size_t pos, bool leading_space, context_stack& stack) const {
     
-    std::smatch match;
-    auto[match_len, rule] = apply_rules(buf, pos, leading_space, stack, match, stack.curr_match());
+    match_results match;
+    auto[match_len, ref] = apply_rules(buf, pos, leading_space, stack, match, stack.curr_captures());
     
     if(match_len == std::string::npos)
         return std::make_pair( match_len, nullptr );
     
-    stack.switch_context( rule->context, match );
-    return std::make_pair( match_len, rule->attribute );
+    stack.switch_context( get_rule(*ref->rule).context, match );
+    return std::make_pair( match_len, ref->attribute );
 }
 
 
-std::pair< size_t, util::cref_ptr<CONTEXT::rule> > 
-CONTEXT::apply_rules(const std::string& buf, size_t pos, bool leading_space, context_stack& stack,
-                     std::smatch& new_match, const std::smatch& old_match) const 
+std::pair< size_t, const CONTEXT::rule_ref* > 
+CONTEXT::apply_rules(std::string_view buf, size_t pos, bool leading_space, context_stack& stack,
+                     match_results& new_match, const util::capture_set& old_captures) const 
 {
-    for(const std::unique_ptr<rule>& rule : rules){
-        size_t match_len = rule->match(buf, pos, old_match, new_match, leading_space);
+    //Only try the rules that can start with this byte, or those for '\0' at the end
+    unsigned char c = (pos < buf.length()) ? buf[pos] : '\0';
+    for(size_t i = dispatch_index[c]; i < dispatch_index[c+1]; ++i){
+        const dispatch_entry& entry = dispatch_rules[i];
+        const rule_ref& ref = rules[entry.rule];
+        size_t match_len = match_rule(entry.kernel, *ref.rule, buf, pos, old_captures, new_match, leading_space);
         
         if(match_len != std::string::npos){
-            return std::make_pair( match_len, util::cref_ptr<CONTEXT::rule>(*rule) );
+            return std::make_pair( match_len, &ref );
         }
     }
     
     if(fallthrough){
-        stack.switch_context(fall_context, stack.curr_match());
-        return stack.curr_context().apply_rules(buf, pos, leading_space, stack, new_match, old_match);
+        //The rules of the next context see the same captures, which
+        //the switch overwrites if it pops the context they belong to
+        if(fall_context.pops > 0){
+            util::capture_set kept = old_captures;
+            stack.switch_context(fall_context);
+            return stack.curr_context().apply_rules(buf, pos, leading_space, stack, new_match, kept);
+        }
+        
+        stack.switch_context(fall_context);
+        return stack.curr_context().apply_rules(buf, pos, leading_space, stack, new_match, old_captures);
     }
     
     return std::make_pair( std::string::npos, nullptr );
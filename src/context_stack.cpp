@@ -1,23 +1,36 @@
 #include "language.hpp"
 
 void language::context_stack::switch_context(const language::context_switch& con_sw, 
-                                             const std::smatch& new_match)
+                                             const match_results& new_match)
 {
     
 //     std::cout << "Switching contexts\n";
     
     //Pop as ordered, but do not pot default context
-    for(size_t i = 0; i < con_sw.pops; i++){
-        if(stack.size() == 1)
-            break;
-        
-        stack.pop();
-    }
+    size_t pops = std::min<size_t>(con_sw.pops, stack.size() - 1);
+    stack.pop(pops);
     
-    //Push new context if ordered
-    if(con_sw.target)
-        stack.push( std::make_pair( con_sw.target, new_match ) );   
+    //Push new context if ordered, keeping only the groups it refers to
+    if(con_sw.target){
+        frame& f = stack.push();
+        f.con = &*con_sw.target;
+        f.captures.assign(new_match, con_sw.target->get_groups());
+    }
     
 //     if(con_sw.pops > 0 || con_sw.target != nullptr)
 //         std::cout << "\tSwitched to context \"" << curr_context().get_name() << "\"\n";
 }
+
+//Switches without a match (line ends, for instance) hand on the captures of the
+//context that switches. Popped frames keep their captures until they are reused
+void language::context_stack::switch_context(const language::context_switch& con_sw){
+    size_t from = stack.size() - 1;
+    size_t pops = std::min<size_t>(con_sw.pops, from);
+    stack.pop(pops);
+    
+    if(con_sw.target){
+        frame& f = stack.push();
+        f.con = &*con_sw.target;
+        f.captures.assign(stack[from].captures, con_sw.target->get_groups());
+    }
+}
@@ -0,0 +1,163 @@
+#include "highlight_cache.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ENTRY_EXT ".lst"
+#define TMP_EXT   ".tmp"
+
+//Keys are 16 hex digits (see content_hash::hex)
+static constexpr size_t key_length = 16;
+
+//Temporary files older than this were left by a process that died while writing
+static constexpr time_t stale_tmp_age = 60*60;
+
+highlight_cache::highlight_cache(const std::string& d, uint64_t max)
+: dir(d), entries_dir(), max_size(max), hits(0), misses(0)
+{
+    if(!dir.empty() && dir.back() == '/')
+        dir.pop_back();
+    entries_dir = dir + "/entries";
+    
+    //Also creates missing parents, since ~/.cache may not exist yet
+    for(size_t i = entries_dir.find('/', 1); i != std::string::npos; i = entries_dir.find('/', i+1))
+        mkdir(entries_dir.substr(0, i).c_str(), 0777);
+    mkdir(entries_dir.c_str(), 0777);
+}
+
+//Only files named like this are treated as entries, or as their temporary files
+static bool starts_with_key(const std::string& name){
+    return name.length() > key_length
+        && std::all_of(name.begin(), name.begin() + key_length,
+                       [](char c){ return std::isdigit(c) || (c >= 'a' && c <= 'f'); });
+}
+
+//<key>.lst
+static bool is_entry(const std::string& name){
+    return starts_with_key(name) && name.compare(key_length, std::string::npos, ENTRY_EXT) == 0;
+}
+
+//<key>.<pid>.<counter>.tmp, see put
+static bool is_tmp(const std::string& name){
+    const std::string ext = TMP_EXT;
+    return starts_with_key(name) && name[key_length] == '.' && name.length() > key_length + ext.length()
+        && name.compare(name.length() - ext.length(), ext.length(), ext) == 0;
+}
+
+std::string highlight_cache::default_dir(){
+    const char* xdg = std::getenv("XDG_CACHE_HOME");
+    if(xdg && *xdg)
+        return std::string(xdg) + "/katelistings";
+    
+    const char* home = std::getenv("HOME");
+    return std::string(home ? home : ".") + "/.cache/katelistings";
+}
+
+std::string highlight_cache::entry_file(const std::string& key) const {
+    return entries_dir + "/" + key + ENTRY_EXT;
+}
+
+bool highlight_cache::contains(const std::string& key) const {
+    return access(entry_file(key).c_str(), R_OK) == 0;
+}
+
+bool highlight_cache::get(const std::string& key, std::string& text){
+    std::string file = entry_file(key);
+    
+    std::ifstream in(file, std::ios::binary);
+    if(!in.good()){
+        ++misses;
+        return false;
+    }
+    
+    text.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    if(in.bad()){
+        ++misses;
+        return false;
+    }
+    
+    //The modification time orders entries for eviction, since atime is often disabled
+    utimensat(AT_FDCWD, file.c_str(), nullptr, 0);
+    
+    ++hits;
+    return true;
+}
+
+void highlight_cache::put(const std::string& key, const std::string& text){
+    static std::atomic<size_t> tmp_counter(0);
+    
+    std::string tmp_file = entries_dir + "/" + key + "." + std::to_string(getpid())
+                         + "." + std::to_string(tmp_counter++) + TMP_EXT;
+    {
+        std::ofstream out(tmp_file, std::ios::binary);
+        out << text;
+        out.close();
+        
+        //A failed write only means that the entry is not cached
+        if(!out.good()){
+            std::remove(tmp_file.c_str());
+            return;
+        }
+    }
+    
+    if(std::rename(tmp_file.c_str(), entry_file(key).c_str()) != 0)
+        std::remove(tmp_file.c_str());
+}
+
+void highlight_cache::trim(){
+    struct entry {
+        std::string file;
+        time_t mtime;
+        uint64_t size;
+    };
+    std::vector<entry> entries;
+    uint64_t total = 0;
+    
+    DIR* dp = opendir(entries_dir.c_str());
+    if(!dp)
+        return;
+    
+    time_t now = std::time(nullptr);
+    while(dirent* ent = readdir(dp)){
+        std::string name = ent->d_name;
+        std::string file = entries_dir + "/" + name;
+        
+        struct stat st;
+        if(stat(file.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+        
+        if(is_entry(name)){
+            entries.push_back({file, st.st_mtime, static_cast<uint64_t>(st.st_size)});
+            total += st.st_size;
+        }
+        else if(is_tmp(name) && now - st.st_mtime > stale_tmp_age)
+            std::remove(file.c_str());
+    }
+    closedir(dp);
+    
+    if(total <= max_size)
+        return;
+    
+    std::sort(entries.begin(), entries.end(),
+              [](const entry& a, const entry& b){ return a.mtime < b.mtime; });
+    
+    //Another process may remove the same entries, which is harmless
+    for(const entry& e : entries){
+        if(total <= max_size)
+            break;
+        
+        std::remove(e.file.c_str());
+        total -= e.size;
+    }
+}
@@ -0,0 +1,58 @@
+#include "input_buffer.hpp"
+
+#include <fstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//Large enough that a pipe is read in few calls
+static constexpr size_t block_size = 1 << 16;
+
+util::input_buffer::input_buffer(const std::string& filename)
+: storage(), mapping(nullptr), mapped(0), text()
+{
+    //Empty files can not be mapped, nor can pipes and devices, so those are read
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd >= 0){
+        struct stat info;
+        if(fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0){
+            void* addr = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(addr != MAP_FAILED){
+                madvise(addr, info.st_size, MADV_SEQUENTIAL);
+                mapping = addr;
+                mapped = info.st_size;
+                text = std::string_view(static_cast<const char*>(mapping), mapped);
+            }
+        }
+        close(fd);
+    }
+    
+    if(!mapping){
+        std::ifstream in(filename, std::ios::binary);
+        read(in);
+    }
+}
+
+util::input_buffer::input_buffer(std::istream& in)
+: storage(), mapping(nullptr), mapped(0), text()
+{
+    read(in);
+}
+
+util::input_buffer::~input_buffer(){
+    if(mapping)
+        munmap(mapping, mapped);
+}
+
+void util::input_buffer::read(std::istream& in){
+    while(in){
+        size_t size = storage.size();
+        storage.resize(size + block_size);
+        in.read(&storage[size], block_size);
+        storage.resize(size + in.gcount());
+    }
+    
+    text = storage;
+}
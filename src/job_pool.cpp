@@ -0,0 +1,106 @@
+#include "job_pool.hpp"
+
+#include <algorithm>
+#include <sstream>
+#include <thread>
+
+size_t job_pool::default_workers(){
+    size_t n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+}
+
+//Own tasks are taken from the front, stolen ones from the back, which keeps
+//the two apart for as long as possible
+bool job_pool::next_task(std::vector<queue>& queues, size_t worker, size_t& task_idx){
+    for(size_t i = 0; i < queues.size(); ++i){
+        queue& q = queues[(worker + i) % queues.size()];
+        std::lock_guard<std::mutex> guard(q.lock);
+        
+        if(q.tasks.empty())
+            continue;
+        
+        if(i == 0){
+            task_idx = q.tasks.front();
+            q.tasks.pop_front();
+        }
+        else{
+            task_idx = q.tasks.back();
+            q.tasks.pop_back();
+        }
+        return true;
+    }
+    
+    //No tasks are added while running, so there is nothing left to wait for
+    return false;
+}
+
+//Tasks after one that has failed are only marked as finished, since they would
+//not have run sequentially either
+void job_pool::work(std::vector<queue>& queues, size_t worker){
+    size_t task_idx;
+    while(next_task(queues, worker, task_idx)){
+        bool skip;
+        {
+            std::lock_guard<std::mutex> guard(finished_lock);
+            skip = task_idx > first_failed;
+        }
+        
+        std::ostringstream log;
+        std::exception_ptr error;
+        if(!skip){
+            try{
+                tasks[task_idx](log);
+            } catch(...){
+                error = std::current_exception();
+            }
+        }
+        
+        std::lock_guard<std::mutex> guard(finished_lock);
+        logs[task_idx] = log.str();
+        errors[task_idx] = error;
+        if(error)
+            first_failed = std::min(first_failed, task_idx);
+        finished[task_idx] = true;
+        finished_cond.notify_one();
+    }
+}
+
+void job_pool::run(std::ostream& out){
+    size_t n_threads = std::min(n_workers, tasks.size());
+    
+    logs.assign(tasks.size(), "");
+    errors.assign(tasks.size(), nullptr);
+    finished.assign(tasks.size(), false);
+    first_failed = tasks.size();
+    
+    std::vector<queue> queues(n_threads);
+    for(size_t i = 0; i < tasks.size(); ++i)
+        queues[i * n_threads / tasks.size()].tasks.push_back(i);
+    
+    std::vector<std::thread> threads;
+    for(size_t w = 0; w < n_threads; ++w)
+        threads.emplace_back(&job_pool::work, this, std::ref(queues), w);
+    
+    //Logs are printed in order, each as soon as it and all before it are done
+    std::exception_ptr error;
+    for(size_t i = 0; i < tasks.size() && !error; ++i){
+        std::string log;
+        {
+            std::unique_lock<std::mutex> guard(finished_lock);
+            finished_cond.wait(guard, [&]{ return finished[i]; });
+            log.swap(logs[i]);
+            error = errors[i];
+        }
+        
+        out << log;
+        out.flush();
+    }
+    
+    for(std::thread& th : threads)
+        th.join();
+    
+    tasks.clear();
+    
+    if(error)
+        std::rethrow_exception(error);
+}
@@ -0,0 +1,1280 @@
+#include "kate_regex.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <deque>
+#include <limits>
+#include <unordered_map>
+
+#define NPOS std::string::npos
+
+namespace util {
+
+using regex = kate_regex;
+
+//Limits that keep pathological patterns from blowing up
+static constexpr size_t max_repeat       = 1000;
+static constexpr size_t max_program_size = 100000;
+static constexpr size_t max_backtrack    = 1000000;
+static constexpr size_t max_depth        = 10000;
+static constexpr size_t max_nesting      = 32;
+
+static bool is_word(std::string_view str, size_t pos){
+    return pos < str.length() && (std::isalnum(static_cast<unsigned char>(str[pos])) || str[pos] == '_');
+}
+
+size_t regex::match_results::length(size_t n) const {
+    if(n >= size() || slots[2*n] == NPOS || slots[2*n+1] == NPOS)
+        return 0;
+    return slots[2*n+1] - slots[2*n];
+}
+
+std::string_view regex::match_results::view(size_t n) const {
+    if(n >= size() || slots[2*n] == NPOS || slots[2*n+1] > subject.length())
+        return std::string_view();
+    return subject.substr(slots[2*n], slots[2*n+1] - slots[2*n]);
+}
+
+
+//// Parsing ////
+
+struct regex::parser {
+    
+    struct node {
+        enum kind_t {
+            EMPTY, SET, ANY, CONCAT, ALTERNATE, REPEAT, GROUP, ASSERT, LOOK, BACKREF
+        } kind;
+        
+        std::vector<size_t> children;
+        
+        int    literal;     //SET: the single byte matched, or -1
+        size_t index;       //SET: class, GROUP: capture (NPOS if none), BACKREF: group
+        size_t min, max;    //REPEAT
+        bool   greedy;      //REPEAT
+        uint8_t assert_kind;
+        bool   behind, negate, icase;
+        
+        explicit node(kind_t k)
+        : kind(k), children(), literal(-1), index(NPOS), min(0), max(0), greedy(true),
+          assert_kind(0), behind(false), negate(false), icase(false)
+        {}
+    };
+    
+    regex& re;
+    const std::string& pat;
+    size_t pos;
+    bool icase;
+    size_t depth;
+    
+    std::vector<node> nodes;
+    std::unordered_map<std::string, size_t> group_names;
+    std::vector< std::pair<size_t, size_t> > pending_looks;    //(LOOK instruction, node)
+    
+    parser(regex& re, bool icase)
+    : re(re), pat(re.pattern), pos(0), icase(icase), depth(0),
+      nodes(), group_names(), pending_looks()
+    {}
+    
+    [[noreturn]] void error(const std::string& msg) const {
+        throw regex::error(msg + " at position " + std::to_string(pos) + " in \"" + pat + "\"");
+    }
+    
+    bool at_end() const { return pos >= pat.length(); }
+    char peek() const { return at_end() ? 0 : pat[pos]; }
+    
+    size_t add(node&& n){
+        nodes.push_back(std::move(n));
+        return nodes.size() - 1;
+    }
+    
+    static std::bitset<256> fold_case(std::bitset<256> set){
+        for(int c = 'a'; c <= 'z'; ++c){
+            if(set.test(c) || set.test(std::toupper(c))){
+                set.set(c);
+                set.set(std::toupper(c));
+            }
+        }
+        return set;
+    }
+    
+    size_t add_set(const std::bitset<256>& set, bool fold = true){
+        node n(node::SET);
+        n.index = re.classes.size();
+        re.classes.push_back(icase && fold ? fold_case(set) : set);
+        return add(std::move(n));
+    }
+    
+    size_t add_literal(unsigned char ch){
+        if(icase && std::isalpha(ch)){
+            std::bitset<256> s;
+            s.set(ch);
+            return add_set(s);
+        }
+        
+        node n(node::SET);
+        n.literal = ch;
+        return add(std::move(n));
+    }
+    
+    size_t add_assert(assertion kind){
+        node n(node::ASSERT);
+        n.assert_kind = kind;
+        return add(std::move(n));
+    }
+    
+    static std::bitset<256> predicate_set(int (*pred)(int)){
+        std::bitset<256> s;
+        for(int c = 0; c < 128; ++c){
+            if(pred(c))
+                s.set(c);
+        }
+        return s;
+    }
+    static int is_word_int(int c)  { return std::isalnum(c) || c == '_'; }
+    static int is_hspace(int c)    { return c == ' ' || c == '\t'; }
+    
+    //Sets for \d \w \s \h and their negations; returns false if ch is not a class escape
+    static bool escape_set(char ch, std::bitset<256>& set){
+        switch(ch){
+            case 'd': set = predicate_set(isdigit);  return true;
+            case 'w': set = predicate_set(is_word_int); return true;
+            case 's': set = predicate_set(isspace);  return true;
+            case 'h': set = predicate_set(is_hspace); return true;
+            case 'D': set = ~predicate_set(isdigit);  return true;
+            case 'W': set = ~predicate_set(is_word_int); return true;
+            case 'S': set = ~predicate_set(isspace);  return true;
+            case 'H': set = ~predicate_set(is_hspace); return true;
+            default:                                 return false;
+        }
+    }
+    
+    //ASCII approximation of Unicode properties: non-ASCII bytes are taken to be letters
+    std::bitset<256> property_set(){
+        std::string prop;
+        if(peek() == '{'){
+            size_t close = pat.find('}', pos);
+            if(close == NPOS)
+                error("Unterminated \\p{...}");
+            prop = pat.substr(pos+1, close - pos - 1);
+            pos = close + 1;
+        }
+        else if(!at_end())
+            prop = std::string(1, pat[pos++]);
+        
+        bool neg = !prop.empty() && prop[0] == '^';
+        if(neg)
+            prop = prop.substr(1);
+        
+        std::bitset<256> set;
+        if(prop.empty())
+            error("Empty Unicode property");
+        else if(prop[0] == 'L')
+            set = predicate_set(isalpha);
+        else if(prop[0] == 'N')
+            set = predicate_set(isdigit);
+        else if(prop[0] == 'P')
+            set = predicate_set(ispunct);
+        else if(prop[0] == 'Z')
+            set = predicate_set(isspace);
+        else
+            set = predicate_set(isgraph);
+        
+        if(prop[0] == 'L' || prop[0] == 'N' || prop[0] == 'P' || prop[0] == 'S' || prop[0] == 'M'){
+            for(int c = 128; c < 256; ++c)
+                set.set(c);
+        }
+        
+        return neg ? ~set : set;
+    }
+    
+    unsigned char parse_hex(){
+        size_t len = 0, end;
+        if(peek() == '{'){
+            end = pat.find('}', pos);
+            if(end == NPOS)
+                error("Unterminated \\x{...}");
+            ++pos;
+            len = end - pos;
+        }
+        else{
+            end = NPOS;
+            while(len < 2 && pos+len < pat.length() && std::isxdigit(pat[pos+len]))
+                ++len;
+        }
+        
+        unsigned long val = len > 0 ? std::stoul(pat.substr(pos, len), nullptr, 16) : 0;
+        pos += len + (end == NPOS ? 0 : 1);
+        
+        if(val > 0xFF)
+            error("Character code beyond 0xFF is not supported");
+        return static_cast<unsigned char>(val);
+    }
+    
+    //Escaped characters that stand for a single literal byte
+    bool escape_char(char ch, unsigned char& out){
+        switch(ch){
+            case 'n':   out = '\n';     return true;
+            case 't':   out = '\t';     return true;
+            case 'r':   out = '\r';     return true;
+            case 'f':   out = '\f';     return true;
+            case 'v':   out = '\v';     return true;
+            case 'a':   out = '\a';     return true;
+            case 'e':   out = 0x1B;     return true;
+            case '0':   out = 0;        return true;
+            case 'x':   out = parse_hex(); return true;
+            default:
+                if(std::isalnum(ch))
+                    return false;
+                out = ch;
+                return true;
+        }
+    }
+    
+    size_t parse_escape(){
+        if(at_end())
+            error("Trailing backslash");
+        
+        char ch = pat[pos++];
+        
+        std::bitset<256> set;
+        unsigned char lit;
+        
+        if(escape_set(ch, set))
+            return add_set(set);
+        if(escape_char(ch, lit))
+            return add_literal(lit);
+        
+        switch(ch){
+            case 'b':   return add_assert(WORD_BOUNDARY);
+            case 'B':   return add_assert(NOT_WORD_BOUNDARY);
+            case 'A':   return add_assert(LINE_BEGIN);
+            case 'z':
+            case 'Z':   return add_assert(LINE_END);
+            case 'G':   return add_assert(MATCH_BEGIN);
+            
+            case 'p':   return add_set(property_set());
+            case 'P':   return add_set(~property_set());
+            
+            case 'k':{
+                char close = peek() == '<' ? '>' : peek() == '{' ? '}' : peek() == '\'' ? '\'' : 0;
+                size_t end = close ? pat.find(close, pos+1) : NPOS;
+                if(end == NPOS)
+                    error("Malformed named backreference");
+                
+                auto it = group_names.find(pat.substr(pos+1, end - pos - 1));
+                if(it == group_names.end())
+                    error("Reference to undefined group");
+                pos = end + 1;
+                
+                node n(node::BACKREF);
+                n.index = it->second;
+                n.icase = icase;
+                return add(std::move(n));
+            }
+        }
+        
+        if(std::isdigit(ch)){
+            size_t group = ch - '0';
+            while(std::isdigit(peek()) && 10*group + (peek() - '0') < re.n_groups)
+                group = 10*group + (pat[pos++] - '0');
+            
+            node n(node::BACKREF);
+            n.index = group;
+            n.icase = icase;
+            return add(std::move(n));
+        }
+        
+        //Unknown letter escapes are taken literally, as Kate is lenient about them
+        return add_literal(ch);
+    }
+    
+    size_t parse_class(){
+        bool neg = false;
+        if(peek() == '^'){
+            neg = true;
+            ++pos;
+        }
+        
+        std::bitset<256> set;
+        bool first_char = true;
+        
+        for(;;){
+            if(at_end())
+                error("Unterminated character class");
+            
+            char ch = pat[pos];
+            if(ch == ']' && !first_char){
+                ++pos;
+                break;
+            }
+            first_char = false;
+            
+            //POSIX classes, e.g. [:alpha:]
+            if(ch == '[' && pos+1 < pat.length() && pat[pos+1] == ':'){
+                size_t end = pat.find(":]", pos+2);
+                if(end != NPOS){
+                    static const std::unordered_map<std::string, int(*)(int)> posix({
+                        {"alpha", isalpha}, {"digit", isdigit}, {"alnum", isalnum},
+                        {"space", isspace}, {"upper", isupper}, {"lower", islower},
+                        {"punct", ispunct}, {"xdigit", isxdigit}, {"word", is_word_int},
+                        {"blank", is_hspace}, {"cntrl", iscntrl}, {"graph", isgraph},
+                        {"print", isprint}
+                    });
+                    
+                    auto it = posix.find(pat.substr(pos+2, end - pos - 2));
+                    if(it == posix.end())
+                        error("Unknown POSIX class");
+                    
+                    set |= predicate_set(it->second);
+                    pos = end + 2;
+                    continue;
+                }
+            }
+            
+            //Single character, or start of range
+            unsigned char lo;
+            ++pos;
+            if(ch == '\\'){
+                if(at_end())
+                    error("Trailing backslash");
+                char esc = pat[pos++];
+                
+                std::bitset<256> sub;
+                if(escape_set(esc, sub)){
+                    set |= sub;
+                    continue;
+                }
+                if(esc == 'p' || esc == 'P'){
+                    sub = property_set();
+                    set |= (esc == 'p') ? sub : ~sub;
+                    continue;
+                }
+                if(esc == 'b')
+                    lo = '\b';
+                else if(!escape_char(esc, lo))
+                    lo = esc;
+            }
+            else
+                lo = ch;
+            
+            unsigned char hi = lo;
+            if(peek() == '-' && pos+1 < pat.length() && pat[pos+1] != ']'){
+                ++pos;
+                char ch_hi = pat[pos++];
+                if(ch_hi == '\\'){
+                    if(at_end())
+                        error("Trailing backslash");
+                    char esc = pat[pos++];
+                    if(!escape_char(esc, hi))
+                        hi = esc;
+                }
+                else
+                    hi = ch_hi;
+                
+                if(hi < lo)
+                    error("Reversed range in character class");
+            }
+            
+            for(int c = lo; c <= hi; ++c)
+                set.set(c);
+        }
+        
+        //Fold before negating so that [^a] does not match 'A'
+        if(neg)
+            return add_set(~(icase ? fold_case(set) : set), false);
+        return add_set(set);
+    }
+    
+    //Parses flags such as "i" or "-i" up to (but not including) ':' or ')'
+    void parse_flags(){
+        bool on = true;
+        for(; !at_end() && peek() != ':' && peek() != ')'; ++pos){
+            switch(peek()){
+                case '-':   on = false;     break;
+                case 'i':   icase = on;     break;
+                case 'm':
+                case 's':
+                case 'x':
+                case 'u':
+                case 'U':                   break;  //No effect on single-line, byte-based matching
+                default:    error("Unknown inline flag");
+            }
+        }
+    }
+    
+    size_t parse_group(){
+        bool saved_icase = icase;
+        
+        if(++depth > max_nesting)
+            error("Groups nested too deeply");
+        
+        node n(node::GROUP);
+        
+        if(peek() == '?'){
+            ++pos;
+            char ch = peek();
+            
+            if(ch == ':' || ch == '>'){
+                ++pos;
+            }
+            else if(ch == '=' || ch == '!'){
+                ++pos;
+                n.kind = node::LOOK;
+                n.negate = (ch == '!');
+            }
+            else if(ch == '<' && pos+1 < pat.length() && (pat[pos+1] == '=' || pat[pos+1] == '!')){
+                n.kind = node::LOOK;
+                n.behind = true;
+                n.negate = (pat[pos+1] == '!');
+                pos += 2;
+            }
+            else if(ch == 'P' && pos+1 < pat.length() && pat[pos+1] == '='){
+                //Named backreference: (?P=name)
+                size_t end = pat.find(')', pos+2);
+                if(end == NPOS)
+                    error("Malformed named backreference");
+                
+                auto it = group_names.find(pat.substr(pos+2, end - pos - 2));
+                if(it == group_names.end())
+                    error("Reference to undefined group");
+                pos = end + 1;
+                --depth;
+                
+                node ref(node::BACKREF);
+                ref.index = it->second;
+                ref.icase = icase;
+                return add(std::move(ref));
+            }
+            else if(ch == '<' || ch == 'P' || ch == '\''){
+                //Named group: (?<name>...), (?P<name>...) or (?'name'...)
+                if(ch == 'P')
+                    ++pos;
+                char close = (peek() == '\'') ? '\'' : '>';
+                size_t end = pat.find(close, pos+1);
+                if(end == NPOS)
+                    error("Malformed group name");
+                
+                n.index = re.n_groups++;
+                group_names[pat.substr(pos+1, end - pos - 1)] = n.index;
+                pos = end + 1;
+            }
+            else if(ch == '#'){
+                size_t end = pat.find(')', pos);
+                if(end == NPOS)
+                    error("Unterminated comment");
+                pos = end + 1;
+                --depth;
+                return add(node(node::EMPTY));
+            }
+            else{
+                parse_flags();
+                if(peek() == ')'){
+                    //(?i) applies to the rest of the enclosing group
+                    ++pos;
+                    --depth;
+                    return add(node(node::EMPTY));
+                }
+                ++pos;
+            }
+        }
+        else
+            n.index = re.n_groups++;
+        
+        n.children.push_back(parse_alternation());
+        
+        if(peek() != ')')
+            error("Missing ')'");
+        ++pos;
+        
+        icase = saved_icase;
+        --depth;
+        return add(std::move(n));
+    }
+    
+    size_t parse_atom(){
+        char ch = pat[pos++];
+        switch(ch){
+            case '(':   return parse_group();
+            case '[':   return parse_class();
+            case '\\':  return parse_escape();
+            case '.':   return add(node(node::ANY));
+            case '^':   return add_assert(LINE_BEGIN);
+            case '$':   return add_assert(LINE_END);
+            case '*':
+            case '+':
+            case '?':   --pos; error("Nothing to repeat");
+            default:    return add_literal(ch);
+        }
+    }
+    
+    //Parses {n}, {n,} or {n,m} if present; otherwise leaves pos untouched
+    bool parse_braces(size_t& min, size_t& max){
+        size_t p = pos + 1;
+        auto number = [&](size_t& val){
+            size_t start = p;
+            while(p < pat.length() && std::isdigit(pat[p]))
+                ++p;
+            if(p == start)
+                return false;
+            val = std::stoul(pat.substr(start, p - start));
+            return true;
+        };
+        
+        if(!number(min))
+            return false;
+        
+        if(p < pat.length() && pat[p] == ','){
+            ++p;
+            if(!number(max))
+                max = NPOS;
+        }
+        else
+            max = min;
+        
+        if(p >= pat.length() || pat[p] != '}')
+            return false;
+        
+        if(max < min)
+            error("Quantifier range out of order");
+        if(min > max_repeat || (max != NPOS && max > max_repeat))
+            error("Quantifier too large");
+        
+        pos = p + 1;
+        return true;
+    }
+    
+    size_t parse_quantifier(size_t atom){
+        size_t min, max;
+        switch(peek()){
+            case '*':   min = 0; max = NPOS; ++pos;  break;
+            case '+':   min = 1; max = NPOS; ++pos;  break;
+            case '?':   min = 0; max = 1;    ++pos;  break;
+            case '{':
+                if(!parse_braces(min, max))
+                    return atom;
+                break;
+            default:    return atom;
+        }
+        
+        node n(node::REPEAT);
+        n.min = min;
+        n.max = max;
+        n.children.push_back(atom);
+        
+        if(peek() == '?'){
+            n.greedy = false;
+            ++pos;
+        }
+        else if(peek() == '+')
+            ++pos;  //Possessive, treated as greedy
+        
+        if(peek() == '*' || peek() == '+' || peek() == '?')
+            error("Nested quantifier");
+        
+        return add(std::move(n));
+    }
+    
+    //\Q...\E: all but the last character go straight into the sequence,
+    //since a following quantifier only applies to the last one
+    size_t parse_quoted(std::vector<size_t>& seq){
+        pos += 2;
+        size_t end = pat.find("\\E", pos);
+        std::string quoted = pat.substr(pos, end == NPOS ? NPOS : end - pos);
+        pos = (end == NPOS) ? pat.length() : end + 2;
+        
+        if(quoted.empty())
+            return add(node(node::EMPTY));
+        
+        for(size_t i = 0; i+1 < quoted.length(); ++i)
+            seq.push_back(add_literal(quoted[i]));
+        return add_literal(quoted.back());
+    }
+    
+    size_t parse_sequence(){
+        node cat(node::CONCAT);
+        
+        while(!at_end() && peek() != '|' && peek() != ')'){
+            size_t atom = (pat.compare(pos, 2, "\\Q") == 0) ? parse_quoted(cat.children) : parse_atom();
+            cat.children.push_back(parse_quantifier(atom));
+        }
+        
+        if(cat.children.size() == 1)
+            return cat.children.front();
+        return add(std::move(cat));
+    }
+    
+    size_t parse_alternation(){
+        size_t first = parse_sequence();
+        if(peek() != '|')
+            return first;
+        
+        node alt(node::ALTERNATE);
+        alt.children.push_back(first);
+        while(peek() == '|'){
+            ++pos;
+            alt.children.push_back(parse_sequence());
+        }
+        return add(std::move(alt));
+    }
+    
+    //Minimum and maximum length of a match (max is NPOS if unbounded)
+    std::pair<size_t, size_t> width(size_t idx) const {
+        const node& n = nodes[idx];
+        
+        switch(n.kind){
+            case node::SET:
+            case node::ANY:
+                return {1, 1};
+            
+            case node::CONCAT:{
+                size_t min = 0, max = 0;
+                for(size_t child : n.children){
+                    auto [cmin, cmax] = width(child);
+                    min += cmin;
+                    max = (max == NPOS || cmax == NPOS) ? NPOS : max + cmax;
+                }
+                return {min, max};
+            }
+            
+            case node::ALTERNATE:{
+                size_t min = NPOS, max = 0;
+                for(size_t child : n.children){
+                    auto [cmin, cmax] = width(child);
+                    min = std::min(min, cmin);
+                    max = (max == NPOS || cmax == NPOS) ? NPOS : std::max(max, cmax);
+                }
+                return {min, max};
+            }
+            
+            case node::REPEAT:{
+                auto [cmin, cmax] = width(n.children.front());
+                size_t max = (n.max == NPOS && cmax > 0) || cmax == NPOS ? NPOS : cmax * n.max;
+                return {cmin * n.min, max};
+            }
+            
+            case node::GROUP:
+                return width(n.children.front());
+            
+            case node::BACKREF:
+                return {0, NPOS};
+            
+            default:
+                return {0, 0};
+        }
+    }
+    
+    
+    //Whether a capturing group is nested in the node
+    bool has_capture(size_t idx) const {
+        const node& n = nodes[idx];
+        if(n.kind == node::GROUP && n.index != NPOS)
+            return true;
+        return std::any_of(n.children.begin(), n.children.end(),
+                           [this](size_t child){ return has_capture(child); });
+    }
+    
+    
+    //// Code generation ////
+    
+    size_t emit(opcode op, uint8_t arg = 0, uint32_t x = 0, uint32_t y = 0){
+        if(re.code.size() >= max_program_size)
+            error("Pattern too large");
+        
+        re.code.push_back({op, arg, x, y});
+        return re.code.size() - 1;
+    }
+    
+    uint32_t here() const { return static_cast<uint32_t>(re.code.size()); }
+    
+    void generate(size_t idx){
+        const node& n = nodes[idx];
+        
+        switch(n.kind){
+            case node::EMPTY:
+                break;
+            
+            case node::SET:
+                if(n.literal >= 0)
+                    emit(CHAR, static_cast<uint8_t>(n.literal));
+                else
+                    emit(CLASS, 0, n.index);
+                break;
+            
+            case node::ANY:
+                emit(ANY);
+                break;
+            
+            case node::CONCAT:
+                for(size_t child : n.children)
+                    generate(child);
+                break;
+            
+            case node::ALTERNATE:{
+                std::vector<size_t> jumps;
+                for(size_t i = 0; i < n.children.size(); ++i){
+                    size_t split = NPOS;
+                    if(i+1 < n.children.size())
+                        split = emit(SPLIT, 0, here()+1);
+                    
+                    generate(n.children[i]);
+                    
+                    if(i+1 < n.children.size()){
+                        jumps.push_back(emit(JMP));
+                        re.code[split].y = here();
+                    }
+                }
+                for(size_t jump : jumps)
+                    re.code[jump].x = here();
+                break;
+            }
+            
+            case node::REPEAT:
+                generate_repeat(n);
+                break;
+            
+            case node::GROUP:
+                if(n.index != NPOS)
+                    emit(SAVE, 0, 2*n.index);
+                generate(n.children.front());
+                if(n.index != NPOS)
+                    emit(SAVE, 0, 2*n.index + 1);
+                break;
+            
+            case node::ASSERT:
+                emit(ASSERT, n.assert_kind);
+                break;
+            
+            case node::LOOK:{
+                lookaround look;
+                look.start  = 0;    //Set once the main program is done
+                look.behind = n.behind;
+                look.negate = n.negate;
+                
+                auto [min, max] = width(n.children.front());
+                if(n.behind && max == NPOS)
+                    error("Lookbehind must have bounded length");
+                look.min_len = min;
+                look.max_len = max;
+                
+                pending_looks.push_back({re.lookarounds.size(), idx});
+                emit(LOOK, 0, re.lookarounds.size());
+                re.lookarounds.push_back(look);
+                break;
+            }
+            
+            case node::BACKREF:
+                if(n.index >= re.n_groups)
+                    error("Reference to undefined group");
+                emit(BACKREF, n.icase, n.index);
+                re.backtrack = true;
+                break;
+        }
+    }
+    
+    void generate_repeat(const node& n){
+        size_t child = n.children.front();
+        bool can_be_empty = width(child).first == 0;
+        
+        //x{min} followed by either x* or (x(x(...)?)?)?
+        for(size_t i = 0; i < n.min; ++i){
+            if(i+1 == n.min && n.max == NPOS && !can_be_empty){
+                //x+ : loop back onto the last mandatory copy
+                uint32_t start = here();
+                generate(child);
+                if(n.greedy)
+                    emit(SPLIT, 0, start, here()+1);
+                else
+                    emit(SPLIT, 0, here()+1, start);
+                return;
+            }
+            generate(child);
+        }
+        
+        if(n.max == NPOS){
+            //The head split and the loop-back jump are flagged, so that an iteration
+            //that matched nothing leaves the loop instead of repeating (as in PCRE).
+            //The Pike VM does not keep the captures of such an iteration, see match_at
+            if(can_be_empty && has_capture(child))
+                re.empty_loop_captures = true;
+            
+            uint32_t loop = here();
+            size_t split = emit(SPLIT, 1);
+            generate(child);
+            size_t jump = emit(JMP, 1, loop);
+            re.code[jump].y = here();
+            
+            if(n.greedy){
+                re.code[split].x = loop+1;
+                re.code[split].y = here();
+            }
+            else{
+                re.code[split].x = here();
+                re.code[split].y = loop+1;
+            }
+            return;
+        }
+        
+        std::vector<size_t> splits;
+        for(size_t i = n.min; i < n.max; ++i){
+            splits.push_back(emit(SPLIT));
+            re.code[splits.back()].x = here();
+            generate(child);
+        }
+        for(size_t split : splits){
+            if(n.greedy)
+                re.code[split].y = here();
+            else{
+                re.code[split].y = re.code[split].x;
+                re.code[split].x = here();
+            }
+        }
+    }
+    
+    void compile(){
+        re.n_groups = 1;
+        size_t root = parse_alternation();
+        if(!at_end())
+            error("Unmatched ')'");
+        
+        emit(SAVE, 0, 0);
+        generate(root);
+        emit(SAVE, 0, 1);
+        emit(MATCH);
+        
+        //Lookaround bodies are separate programs after the main one.
+        //Generating them may add further lookarounds, hence the index loop
+        for(size_t i = 0; i < pending_looks.size(); ++i){
+            auto [look, idx] = pending_looks[i];
+            re.lookarounds[look].start = here();
+            generate(nodes[idx].children.front());
+            emit(MATCH);
+        }
+    }
+};
+
+
+//// Execution ////
+
+struct regex::executor {
+    
+    //Per-thread scratch space, one level per nested lookaround
+    struct scratch {
+        std::vector<uint32_t> curr_pc, next_pc;
+        std::vector<size_t>   curr_caps, next_caps;
+        std::vector<size_t>   work;
+        std::vector<size_t>   found;    //Captures of the last lookaround run at this level
+        std::vector<uint32_t> marks;
+        uint32_t generation;
+        
+        scratch() : generation(0) {}
+    };
+    
+    const regex& re;
+    std::string_view subj;
+    size_t start;           //Where the whole match attempt began (for \G)
+    size_t n_slots;
+    size_t steps;
+    size_t depth;
+    std::vector<size_t> loop_pos;   //Backtracker: start of the current iteration of each loop
+    
+    //A deque, so that growing it for a nested lookaround keeps outer levels in place
+    static std::deque<scratch>& scratch_stack(){
+        thread_local std::deque<scratch> stack;
+        return stack;
+    }
+    
+    executor(const regex& re, std::string_view subj, size_t start)
+    : re(re), subj(subj), start(start), n_slots(2*re.n_groups), steps(0), depth(0),
+      loop_pos(re.backtrack || re.empty_loop_captures ? re.code.size() : 0, NPOS) {}
+    
+    bool check_assert(uint8_t kind, size_t pos) const {
+        switch(kind){
+            case LINE_BEGIN:        return pos == 0;
+            case LINE_END:          return pos == subj.length();
+            case MATCH_BEGIN:       return pos == start;
+            case WORD_BOUNDARY:     return is_word(subj, pos-1) != is_word(subj, pos);
+            case NOT_WORD_BOUNDARY: return is_word(subj, pos-1) == is_word(subj, pos);
+            default:                return false;
+        }
+    }
+    
+    bool check_char(const inst& in, size_t pos, size_t end) const {
+        if(pos >= end)
+            return false;
+        unsigned char ch = subj[pos];
+        
+        switch(in.op){
+            case CHAR:  return ch == in.arg;
+            case ANY:   return true;
+            case CLASS: return re.classes[in.x].test(ch);
+            default:    return false;
+        }
+    }
+    
+    //A positive lookaround keeps the groups captured inside it, as in PCRE.
+    //They are left in the found slots of the next level, see keep_captures
+    bool check_look(const lookaround& look, size_t pos, size_t level){
+        auto& stack = scratch_stack();
+        if(stack.size() <= level+1)
+            stack.resize(level+2);
+        std::vector<size_t>& caps = stack[level+1].found;
+        caps.assign(n_slots, NPOS);
+        size_t* caps_out = look.negate ? nullptr : caps.data();
+        
+        bool found = false;
+        
+        if(look.behind){
+            for(size_t len = look.min_len; !found && len <= look.max_len && len <= pos; ++len)
+                found = run(look.start, pos - len, pos, true, caps_out, level+1);
+        }
+        else
+            found = run(look.start, pos, subj.length(), false, caps_out, level+1);
+        
+        return found != look.negate;
+    }
+    
+    //Copies the captures of a lookaround that just succeeded into caps.
+    //Returns the slots that changed with their old values, for undoing it
+    std::vector< std::pair<size_t, size_t> > keep_captures(size_t* caps, size_t level) const {
+        const std::vector<size_t>& found = scratch_stack()[level+1].found;
+        
+        std::vector< std::pair<size_t, size_t> > old;
+        for(size_t slot = 0; slot < n_slots; ++slot){
+            if(found[slot] != NPOS){
+                old.push_back({slot, caps[slot]});
+                caps[slot] = found[slot];
+            }
+        }
+        return old;
+    }
+    
+    //Runs the program from pc at pos. Consuming instructions may not go past end,
+    //and if anchor_end is set, only matches ending exactly at end count.
+    bool run(uint32_t pc, size_t pos, size_t end, bool anchor_end, size_t* caps_out, size_t level){
+        if(level > max_nesting)
+            return false;
+        
+        if(re.backtrack){
+            std::vector<size_t> caps(n_slots, NPOS);
+            if(!backtrack(pc, pos, end, anchor_end, caps.data(), level))
+                return false;
+            if(caps_out)
+                std::copy(caps.begin(), caps.end(), caps_out);
+            return true;
+        }
+        return pike(pc, pos, end, anchor_end, caps_out, level);
+    }
+    
+    
+    //// Pike VM ////
+    
+    void add_thread(scratch& s, std::vector<uint32_t>& list_pc, std::vector<size_t>& list_caps,
+                    uint32_t pc, size_t pos, size_t level)
+    {
+        const inst& in = re.code[pc];
+        
+        //Loop-back jumps are not deduplicated themselves: if the loop head was already
+        //visited at this position, the iteration matched nothing and the loop is left
+        if(in.op == JMP && in.arg){
+            add_thread(s, list_pc, list_caps, s.marks[in.x] == s.generation ? in.y : in.x, pos, level);
+            return;
+        }
+        
+        if(s.marks[pc] == s.generation)
+            return;
+        s.marks[pc] = s.generation;
+        
+        switch(in.op){
+            case JMP:
+                add_thread(s, list_pc, list_caps, in.x, pos, level);
+                return;
+            
+            case SPLIT:
+                add_thread(s, list_pc, list_caps, in.x, pos, level);
+                add_thread(s, list_pc, list_caps, in.y, pos, level);
+                return;
+            
+            case SAVE:{
+                size_t old = s.work[in.x];
+                s.work[in.x] = pos;
+                add_thread(s, list_pc, list_caps, pc+1, pos, level);
+                s.work[in.x] = old;
+                return;
+            }
+            
+            case ASSERT:
+                if(check_assert(in.arg, pos))
+                    add_thread(s, list_pc, list_caps, pc+1, pos, level);
+                return;
+            
+            case LOOK:{
+                if(!check_look(re.lookarounds[in.x], pos, level))
+                    return;
+                auto old = keep_captures(s.work.data(), level);
+                add_thread(s, list_pc, list_caps, pc+1, pos, level);
+                for(auto [slot, val] : old)
+                    s.work[slot] = val;
+                return;
+            }
+            
+            default:
+                list_pc.push_back(pc);
+                list_caps.insert(list_caps.end(), s.work.begin(), s.work.end());
+                return;
+        }
+    }
+    
+    bool pike(uint32_t pc, size_t pos, size_t end, bool anchor_end, size_t* caps_out, size_t level){
+        auto& stack = scratch_stack();
+        if(stack.size() <= level)
+            stack.resize(level+1);
+        scratch& s = stack[level];
+        
+        if(s.marks.size() < re.code.size()){
+            s.marks.assign(re.code.size(), 0);
+            s.generation = 0;
+        }
+        s.work.assign(n_slots, NPOS);
+        s.curr_pc.clear();
+        s.curr_caps.clear();
+        
+        //Stale marks could survive a wrap-around of the generation counter
+        auto next_generation = [&s](){
+            if(++s.generation == 0){
+                std::fill(s.marks.begin(), s.marks.end(), 0);
+                s.generation = 1;
+            }
+        };
+        
+        next_generation();
+        add_thread(s, s.curr_pc, s.curr_caps, pc, pos, level);
+        
+        bool matched = false;
+        
+        for(; !s.curr_pc.empty(); ++pos){
+            next_generation();
+            s.next_pc.clear();
+            s.next_caps.clear();
+            
+            for(size_t t = 0; t < s.curr_pc.size(); ++t){
+                const inst& in = re.code[s.curr_pc[t]];
+                const size_t* caps = &s.curr_caps[t * n_slots];
+                
+                if(in.op == MATCH){
+                    if(anchor_end && pos != end)
+                        continue;
+                    
+                    matched = true;
+                    if(caps_out)
+                        std::copy(caps, caps + n_slots, caps_out);
+                    //Lower-priority threads are cut off
+                    break;
+                }
+                
+                if(check_char(in, pos, end)){
+                    std::copy(caps, caps + n_slots, s.work.begin());
+                    add_thread(s, s.next_pc, s.next_caps, s.curr_pc[t] + 1, pos+1, level);
+                }
+            }
+            
+            std::swap(s.curr_pc, s.next_pc);
+            std::swap(s.curr_caps, s.next_caps);
+        }
+        
+        return matched;
+    }
+    
+    
+    //// Backtracking, only for programs with backreferences ////
+    
+    bool backtrack(uint32_t pc, size_t pos, size_t end, bool anchor_end, size_t* caps, size_t level){
+        if(depth >= max_depth)
+            return false;
+        
+        ++depth;
+        bool result = backtrack_impl(pc, pos, end, anchor_end, caps, level);
+        --depth;
+        return result;
+    }
+    
+    bool backtrack_impl(uint32_t pc, size_t pos, size_t end, bool anchor_end, size_t* caps, size_t level){
+        for(;;){
+            if(++steps > max_backtrack)
+                return false;
+            
+            const inst& in = re.code[pc];
+            switch(in.op){
+                case CHAR:
+                case ANY:
+                case CLASS:
+                    if(!check_char(in, pos, end))
+                        return false;
+                    ++pos;
+                    ++pc;
+                    break;
+                
+                case JMP:
+                    pc = (in.arg && loop_pos[in.x] == pos) ? in.y : in.x;
+                    break;
+                
+                case SPLIT:
+                    if(in.arg){
+                        //Loop head: remember where this iteration started
+                        size_t old = loop_pos[pc];
+                        loop_pos[pc] = pos;
+                        bool result = backtrack(in.x, pos, end, anchor_end, caps, level)
+                                   || backtrack(in.y, pos, end, anchor_end, caps, level);
+                        loop_pos[pc] = old;
+                        return result;
+                    }
+                    if(backtrack(in.x, pos, end, anchor_end, caps, level))
+                        return true;
+                    pc = in.y;
+                    break;
+                
+                case SAVE:{
+                    size_t old = caps[in.x];
+                    caps[in.x] = pos;
+                    if(backtrack(pc+1, pos, end, anchor_end, caps, level))
+                        return true;
+                    caps[in.x] = old;
+                    return false;
+                }
+                
+                case ASSERT:
+                    if(!check_assert(in.arg, pos))
+                        return false;
+                    ++pc;
+                    break;
+                
+                case LOOK:{
+                    if(!check_look(re.lookarounds[in.x], pos, level))
+                        return false;
+                    auto old = keep_captures(caps, level);
+                    if(old.empty()){
+                        ++pc;
+                        break;
+                    }
+                    if(backtrack(pc+1, pos, end, anchor_end, caps, level))
+                        return true;
+                    for(auto [slot, val] : old)
+                        caps[slot] = val;
+                    return false;
+                }
+                
+                case BACKREF:{
+                    size_t b = caps[2*in.x], e = caps[2*in.x + 1];
+                    if(b == NPOS || e == NPOS || e < b){
+                        ++pc;   //Unset groups match the empty string
+                        break;
+                    }
+                    
+                    size_t len = e - b;
+                    if(pos + len > end)
+                        return false;
+                    for(size_t i = 0; i < len; ++i){
+                        unsigned char x = subj[b+i], y = subj[pos+i];
+                        if(in.arg ? std::tolower(x) != std::tolower(y) : x != y)
+                            return false;
+                    }
+                    pos += len;
+                    ++pc;
+                    break;
+                }
+                
+                case MATCH:
+                    return !anchor_end || pos == end;
+            }
+        }
+    }
+};
+
+
+//// Public interface ////
+
+regex::kate_regex(const std::string& pat, bool icase)
+: pattern(pat), code(), classes(), lookarounds(),
+  n_groups(0), backtrack(false), empty_loop_captures(false), first(), first_known(false)
+{
+    parser(*this, icase).compile();
+    compute_first();
+}
+
+bool regex::match_at(std::string_view subject, size_t pos, match_results& m) const {
+    if(code.empty())
+        return false;
+    
+    if(first_known && (pos >= subject.length() || !first.test(static_cast<unsigned char>(subject[pos]))))
+        return false;
+    
+    thread_local std::vector<size_t> caps;
+    caps.assign(2*n_groups, NPOS);
+    
+    executor exec(*this, subject, pos);
+    if(!exec.run(0, pos, subject.length(), false, caps.data(), 0))
+        return false;
+    
+    //The Pike VM finds the right match, but drops the captures of loop iterations
+    //that matched nothing: (a*)*b leaves "aaa" in group 1 on "aaab", where PCRE
+    //leaves "". The backtracker finds those, held to the same end. Should it give
+    //up, the captures of the Pike VM are kept
+    if(empty_loop_captures && !backtrack){
+        thread_local std::vector<size_t> exact;
+        exact.assign(2*n_groups, NPOS);
+        
+        executor redo(*this, subject, pos);
+        if(redo.backtrack(0, pos, caps[1], true, exact.data(), 0))
+            caps.swap(exact);
+    }
+    
+    m.slots.assign(caps.begin(), caps.end());
+    m.subject = subject;
+    return true;
+}
+
+bool regex::first_bytes(std::bitset<256>& set) const {
+    if(!first_known)
+        return false;
+    set = first;
+    return true;
+}
+
+//Follows non-consuming instructions from the start of the program, collecting
+//the bytes that the first consuming instruction can accept. If a match can be
+//reached without consuming anything, the set is unknown.
+void regex::compute_first(){
+    first.reset();
+    first_known = false;
+    
+    if(code.empty())
+        return;
+    
+    std::vector<bool> seen(code.size(), false);
+    std::vector<uint32_t> todo(1, 0);
+    
+    while(!todo.empty()){
+        uint32_t pc = todo.back();
+        todo.pop_back();
+        
+        if(pc >= code.size() || seen[pc])
+            continue;
+        seen[pc] = true;
+        
+        const inst& in = code[pc];
+        switch(in.op){
+            case CHAR:      first.set(in.arg);          break;
+            case CLASS:     first |= classes[in.x];     break;
+            case ANY:
+            case MATCH:
+            case BACKREF:   return;
+            case JMP:       todo.push_back(in.x);       break;
+            case SPLIT:     todo.push_back(in.x);
+                            todo.push_back(in.y);       break;
+            default:        todo.push_back(pc+1);       break;
+        }
+    }
+    
+    first_known = true;
+}
+
+};
@@ -1,9 +1,16 @@
 #include "language.hpp"
+#include "char_scan.hpp"
+
+#include <cstdio>
+#include <map>
+#include <set>
+
+#include <unistd.h>
 
 language::language(const dom_element& defn, 
                    const std::unordered_map<std::string, style>& deflt_styles,
                    const std::unordered_map<std::string, language>& languages,
-                   print_options opts
+                   bool all_contexts, print_options opts
                   )
 
  : case_sensitive(defn.unique_element("general")
@@ -11,7 +18,7 @@ language::language(const dom_element& defn,
                       .attribute("casesensitive").or_default("true").bool_val()),
     name(         defn.attribute("name").or_error("Unnamed language").val()),    
     empty_lines(  defn.element("general")
-                      .element("emptyLines"))
+                      .element("emptyLines"), *this)
     
 {                  
     if(PRINT_OPT(VERBOSE)){
@@ -30,10 +37,16 @@ language::language(const dom_element& defn,
     parse_styles(dat, deflt_styles, opts);
         
     const dom_element& con = hig.unique_element("contexts");
-    parse_contexts(con, languages, opts);
+    parse_contexts(con, languages, all_contexts, opts);
+    context::collect_groups(contexts);
     
-    if(PRINT_OPT(DEBUG))
+    prog.compile(*this);
+    
+    if(PRINT_OPT(DEBUG)){
+        std::cout << INDENT(2) << "Compiled to " << prog.state_count() << " states and " 
+                               << prog.code_size() << " instructions\n";
         std::cout << INDENT(1) << "...done.\n";
+    }
 }
 
 void language::parse_keywords(const dom_element& list, print_options opts){
@@ -53,13 +66,14 @@ void language::parse_keywords(const dom_element& list, print_options opts){
             if(PRINT_OPT(DEBUG))
                 std::cout << INDENT(3) << "Keyword: \"" << keyword << "\"\n";
             
-            auto[it, success] = keywords.insert(
+            //Case-insensitive keywords are stored in lowercase, see keyword_set::match
+            bool success = keywords.insert(
                 case_sensitive ? keyword : util::convert_lowercase(keyword)
             );
             
             // Apparently, duplicate keywords is not a problem -- it is featured in cpp.xml
 //             if(!success)
-//                 list.error("Keyword \"" + *it + "\" already defined in list \"" + name + "\"");
+//                 list.error("Keyword \"" + keyword + "\" already defined in list \"" + name + "\"");
         }
         
         if(PRINT_OPT(DEBUG))
@@ -124,91 +138,93 @@ void language::parse_styles(const dom_element& list,
             
             std::cout << "\n";
         }
-                               
+        
+        id.set_latex(name);
         styles[id.name] = id;
     }        
 }
 
+//Contexts are only indexed by name here, and parsed once a context switch or
+//IncludeRules refers to them: contexts that the default context never leads to
+//cost nothing but their index entry
 void language::parse_contexts(const dom_element& list,
                               const std::unordered_map<std::string, language>& languages,
-                              print_options opts)
+                              bool all_contexts, print_options opts)
 {
     
-    std::deque< std::pair<std::string, util::cref_ptr<dom_element>> > todo;
-    
-    bool first = true;
+    std::string first_name;
     
     for(const auto& def : list.all_elements("context")){
         std::string con_name = def.attribute("name").or_error("Unnamed context");
         
-        auto [it, success] = contexts.insert( std::make_pair(con_name, context()) );
+        auto [it, success] = context_defs.insert( std::make_pair(con_name, context_def{def, false, false}) );
         
         if(!success)
             def.error("Context with name \"" + it->first + "\" already exists");
         
-        todo.push_back( std::make_pair(con_name, util::cref_ptr<dom_element>(def)) );
-        
-        if(first){
-            first = false;
-            default_context = it->second;
-        }
+        if(first_name.empty())
+            first_name = con_name;
     }
     
-    //Marks the start of a circular dependence
-    std::string first_postponed;
-    std::unordered_set<std::string> done;
+    if(first_name.empty())
+        list.error("No contexts defined");
     
-    //Simple but inefficient dependency resolution:
-    //we loop around the todo list until everything is done        
-    while(!todo.empty()){
-        auto& [name, def] = todo.front();
-        
-        
-        bool no_deps = true;
-        for(const auto& incl : def->all_elements("IncludeRules")){
-            std::string spec = incl.attribute("context").or_error();
-            
-            //So far, forward references to other languages are not supported
-            if(spec.find("##") != std::string::npos)
-                continue;
-            if(done.find(spec) != done.end())
-                continue;
-            
-            if(PRINT_OPT(DEBUG))
-                std::cout << INDENT(3) << "Context \"" << name << "\" depends on \"" << spec << "\", postponing...\n";
-            if(spec == first_postponed)
-                def->error("Circular IncludeRules dependency detected");
-            no_deps = false;
-            break;
-        }
-        
-        if(no_deps){
-            first_postponed = "";
-            
-            //At this point, we are sure that the context only depends on
-            //contexts that are already done
-            
-            if(PRINT_OPT(DEBUG))
-                std::cout << INDENT(3) << "Parsing context \"" << name << "\"\n";
-            
-            contexts[name].parse(*def, *this, languages, opts);
-            
-            done.insert(name);
-        }
-        else{
-            //Postpone until dependencies are resolved
-            if(first_postponed.empty())
-                first_postponed = name;
-                    
-            todo.push_back( todo.front() );
-        }
+    default_context = refer_context(first_name);
+    
+    //Parsing a context refers to more, until none are left
+    while(!unparsed.empty()){
+        std::string con_name = unparsed.front();
+        unparsed.pop_front();
         
-        todo.pop_front();
+        parse_context(context_defs.at(con_name), con_name, languages, opts);
+    }
+    
+    //Contexts that only other languages include rules from
+    if(all_contexts){
+        for(auto& [con_name, def] : context_defs)
+            parse_context(def, con_name, languages, opts);
     }
+    
+    //The definitions belong to the caller
+    context_defs.clear();
+}
+
+//Parses the context now, for IncludeRules, unless it is already
+void language::parse_context(context_def& def, const std::string& con_name,
+                             const std::unordered_map<std::string, language>& languages,
+                             print_options opts)
+{
+    if(def.parsed)
+        return;
+    if(def.parsing)
+        def.defn->error("Circular IncludeRules dependency detected");
+    
+    if(PRINT_OPT(DEBUG))
+        std::cout << INDENT(3) << "Parsing context \"" << con_name << "\"\n";
+    
+    def.parsing = true;
+    
+    contexts.try_emplace(con_name, con_name).first->second.parse(*def.defn, *this, languages, opts);
+    
+    def.parsed = true;
+}
+
+//The context, to be parsed later if it is not yet, or null if it is not defined.
+//Contexts do not move once they are added, so they can be referred to before they are parsed
+util::cref_ptr<language::context> language::refer_context(const std::string& con_name){
+    auto it = contexts.find(con_name);
+    if(it != contexts.end())
+        return it->second;
+    
+    if(context_defs.find(con_name) == context_defs.end())
+        return nullptr;
+    
+    unparsed.push_back(con_name);
+    return contexts.emplace(con_name, context(con_name)).first->second;
 }
 
 language::context_switch 
-language::parse_context_switch(const std::string& def, const dom_element& src) const {
+language::parse_context_switch(const std::string& def, const dom_element& src){
          
     context_switch con_sw;
            
@@ -254,11 +270,9 @@ language::parse_context_switch(const std::string& def, const dom_element& src) c
     if(context.empty())
         con_sw.target = nullptr;
     else{
-        auto it = contexts.find(context);
-        if(it == contexts.end())
+        con_sw.target = refer_context(context);
+        if(!con_sw.target)
             src.error(err_prefix + "Undefined context: \"" + context + "\"");
-        
-        con_sw.target = it->second;
     }
     
     return con_sw;
@@ -277,51 +291,68 @@ language::get_style(const std::string& def, const dom_element& src) const {
 }
 
 void language::highlight(std::istream& in, std::ostream& out, print_options opts) const {
+    util::input_buffer input(in);
+    highlight(input.view(), out, opts);
+}
+
+void language::highlight(std::string_view text, std::ostream& out, print_options opts) const {
+    util::line_source src(text);
+    highlight(src, out, opts);
+}
+
+void language::highlight(util::line_source& in, std::ostream& out, print_options opts) const {
+    if(PRINT_OPT(REFERENCE))
+        interpret(in, out, opts);
+    else
+        prog.run(*this, in, out, opts);
+}
+
+void language::interpret(util::line_source& in, std::ostream& out, print_options opts) const {
       
-    std::string buf;
+    std::string_view buf;
     size_t pos = 0;
-    std::smatch new_match;
+    match_results new_match;
     
-    if(!std::getline(in, buf))
+    if(!in.next(buf))
         return;
     if(PRINT_OPT(ECHO_INPUT))
         std::cout << buf << std::endl;
     
     context_stack stack(default_context);
+    latex_writer writer(*this, out, opts);
     
     bool leading_space = true;
-    bool normal_output = false;
-    size_t rbraces;
+    const style* unmatched_style = nullptr;
     
     for(;;){
         
         //Handle empty lines
         if(pos == 0 && stack.curr_context().empty_line(buf, stack, empty_lines)){
-            out << std::endl;
-            if(!std::getline(in, buf))
+            writer.end_line();
+            if(!in.next(buf))
                 break;
-            if(PRINT_OPT(ECHO_INPUT))
+            if(PRINT_OPT(ECHO_INPUT)){
+                writer.flush();
                 std::cout << buf << std::endl;
+            }
             
             continue;
         }
         
         //Handle end-of-line
         if(pos >= buf.length()){
-            if(normal_output){
-                normal_output = false;
-                out << std::string(rbraces, '}');
-            }
-            
+            unmatched_style = nullptr;
             stack.curr_context().end_of_line(stack);
             
-            out << std::endl;
+            writer.end_line();
             pos = 0;
-            if(!std::getline(in, buf))
+            if(!in.next(buf))
                 //Terminate highlighting on EOF
                 break;
-            if(PRINT_OPT(ECHO_INPUT))
+            if(PRINT_OPT(ECHO_INPUT)){
+                writer.flush();
                 std::cout << buf << std::endl;
+            }
             
             leading_space = true;
             continue;
@@ -333,27 +364,20 @@ void language::highlight(std::istream& in, std::ostream& out, print_options opts
         //Rules exhausted without a match: print character normally
         if(match_len == std::string::npos){
 //             std::cout << "No rule matches\n";
-            if(!normal_output){
-                normal_output = true;
-                rbraces = latex_format(out, *stack.curr_context().get_attribute(), PRINT_OPT(USE_COMMANDS));
-            }
+            if(!unmatched_style)
+                unmatched_style = &*stack.curr_context().get_attribute();
             
-            leading_space = !latex_escape(out, buf[pos]) && leading_space;
+            leading_space = !writer.write(*unmatched_style, buf[pos]) && leading_space;
             ++pos;
         }
         //Non-empty (non-lookahead) match
         else if(match_len > 0){
-            if(normal_output){
-                normal_output = false;
-                out << std::string(rbraces, '}');
-            }
+            unmatched_style = nullptr;
             
 //             std::cout << "Rule matches\n";
-            rbraces = latex_format(out, attr ? *attr : *stack.curr_context().get_attribute(), PRINT_OPT(USE_COMMANDS));
-                    
-            leading_space = !latex_escape(out, buf, pos, match_len) && leading_space;
+            leading_space = !writer.write(attr ? *attr : *stack.curr_context().get_attribute(), buf, pos, match_len) 
+                         && leading_space;
             
-            out << std::string(rbraces, '}');
             pos += match_len;
         }
         else{
@@ -362,98 +386,160 @@ void language::highlight(std::istream& in, std::ostream& out, print_options opts
     }   
 }
 
-size_t language::latex_format(std::ostream& out, const language::style& st, bool use_commands) const {
+namespace {
+    //How each byte is written inside a listing: copied as is, replaced by an
+    //escape sequence, or dropped. Whitespace and dropped bytes are not visible.
+    struct escape_entry {
+        const char* str;
+        uint8_t len;
+        bool copy;
+        bool visible;
+    };
     
-    if(use_commands){
-        name_command(out, st.name);
-        out << "{";
-        return 1;
-    }
+    struct escape_table {
+        escape_entry entries[256];
+        
+        escape_table(){
+            for(size_t c = 0; c < 256; ++c)
+                entries[c] = {nullptr, 0, true, true};
+            
+            entries[static_cast<unsigned char>('\\')] = {"\\textbackslash{}", 16, false, true};
+            entries[static_cast<unsigned char>('{')]  = {"\\{", 2, false, true};
+            entries[static_cast<unsigned char>('}')]  = {"\\}", 2, false, true};
+            
+            for(char c : {'\0', '\f', '\v', '\r'})
+                entries[static_cast<unsigned char>(c)] = {"", 0, false, false};
+            for(char c : {'\t', '\n', ' '})
+                entries[static_cast<unsigned char>(c)] = {nullptr, 0, true, false};
+        }
+        
+        const escape_entry& operator[](char c) const { return entries[static_cast<unsigned char>(c)]; }
+    };
     
-    size_t braces = 0;
-    if(st.bg_colour != "FFFFFF"){
-        ++braces;
-        out << "\\colorbox[HTML]{" << st.bg_colour << "}{";
-    }
+    const escape_table escapes;
+};
+
+bool language::latex_escape(util::output_buffer& out, char ch){
+    const escape_entry& esc = escapes[ch];
+    if(esc.copy)
+        out.put(ch);
+    else
+        out.write(esc.str, esc.len);
     
-    ++braces;
-    out << "\\textcolor[HTML]{" << st.colour << "}{"; 
+    return esc.visible;
+}
+bool language::latex_escape(util::output_buffer& out, std::string_view str, size_t pos, size_t len){
+    bool visible = false;
+    const char* p = str.data() + pos;
+    const char* end = p + len;
     
-    if(st.bold){
-        ++braces;
-        out << "\\textbf{";
-    }
-    if(st.italic){
-        ++braces;
-        out << "\\textit{";
-    }
-    if(st.underline){
-        ++braces;
-        out << "\\underline{";
-    }
-    if(st.strikethrough){
-        ++braces;
-        out << "\\sout{";
+    while(p < end){
+        //Everything up to the next special byte is copied in one go.
+        //Of those bytes, only spaces are not visible
+        const char* special = util::find_latex_special(p, end);
+        for(const char* q = p; !visible && q < special; ++q)
+            visible = (*q != ' ');
+        out.write(p, special - p);
+        
+        if(special == end)
+            break;
+        
+        if(latex_escape(out, *special))
+            visible = true;
+        p = special + 1;
     }
     
-    return braces;    
+    return visible;
 }
 
-bool language::latex_escape(std::ostream& out, char ch){
-    switch(ch){
-        case '\\':  out << "\\textbackslash{}";  return true;
-        case '{':   out << "\\{";           return true;
-        case '}':   out << "\\}";           return true;
-        case 0:
-        case '\f':
-        case '\v':
-        case '\r':                          return false;
-        case '\t':
-        case '\n':
-        case ' ':   out << ch;              return false;
-        default:    out << ch;              return true;
+std::string language::commands_file(const std::string& out_dir, const std::string& lang_name){
+    std::ostringstream name_esc;
+    {
+        util::output_buffer obuf(name_esc);
+        name_escape(obuf, lang_name);
     }
-}
-bool language::latex_escape(std::ostream& out, const std::string& str, size_t pos, size_t len){
-    bool only_space = true;
-    for(size_t i = pos; i < pos+len; ++i)
-        only_space = !latex_escape(out, str[i]) && only_space;
     
-    return !only_space;
+    if(out_dir.empty() || out_dir.back() == '/')
+        return out_dir + name_esc.str() + ".lst.sty";
+    else
+        return out_dir + "/" + name_esc.str() + ".lst.sty";
 }
 
-void language::generate_commands(const dom_element& deps, const std::string& out_dir) const {
-    std::ostringstream name_esc;
-    name_escape(name_esc, name);
-    std::string filename = out_dir + name_esc.str() + ".lst.sty";
+void language::generate_commands(const dom_element& deps, const std::string& out_dir, const std::string& id) const {
+    std::string filename = commands_file(out_dir, name);
     std::cout << "Generating LaTeX commands to " << filename << "\n";
-    std::ofstream out(filename);
     
-    out << "% ID: " << get_ID() << "\n"
+    //Written to the side and renamed, so that a concurrent run never sees a partial file,
+    //or a complete ID line in front of the commands of another ID
+    std::string tmp_file = filename + "." + std::to_string(getpid()) + ".tmp";
+    std::ofstream file(tmp_file);
+    write_commands(file, deps, id);
+    file.close();
+    
+    if(!file.good() || std::rename(tmp_file.c_str(), filename.c_str()) != 0){
+        std::remove(tmp_file.c_str());
+        std::cerr << "ERROR: Unable to write to file \"" << filename << "\"\n";
+        exit(EXIT_FAILURE);
+    }
+}
+
+void language::write_commands(std::ostream& file, const dom_element& deps, const std::string& id) const {
+    util::output_buffer out(file);
+    
+    out << "% ID: " << id << "\n"
         << "\\NeedsTeXFormat{LaTeX2e}\n"
         << "\\ProvidesPackage{" << name << ".lst}\n"
+        << "\\RequirePackage{xcolor}\n"
         << "\n";
         
     for(const auto& dep : deps.all_elements("dependency"))
         out << "\\RequirePackage{" << dep.attribute("name").or_error().val() << ".lst}\n";
     out << "\n";
     
-    for(const auto& [sty_name, sty] : styles){
+    //Sorted, so that the output does not depend on how the language was loaded
+    std::map<std::string, util::cref_ptr<style>> sorted;
+    for(const auto& [sty_name, sty] : styles)
+        sorted.emplace(sty_name, sty);
+    
+    for(const auto& [sty_name, sty] : sorted){
         out << "\\newcommand{";
         name_command(out, sty_name);
-        out << "}[1]{\\texttt{";
-        size_t br = latex_format(out, sty, false);
-        out << "#1" << std::string(br, '}') << "}}\n";
+        out << "}[1]{\\texttt{" << sty->raw.open << "#1" << sty->raw.close << "}}\n";
+    }
+    
+    //The compact form (COMPACT): \klset<language> defines \klA, \klB, ... for the
+    //formats of all styles that the language uses, including those of other languages.
+    //Each listing starts by calling it, so the macros are local to the listing
+    const auto& formats = prog.get_formats();
+    
+    std::set<std::string> colours;
+    for(const auto& sty : formats){
+        colours.insert(sty->colour);
+        if(sty->bg_colour != "FFFFFF")
+            colours.insert(sty->bg_colour);
+    }
+    
+    out << "\n";
+    for(const std::string& col : colours)
+        out << "\\definecolor{kl" << col << "}{HTML}{" << col << "}\n";
+    
+    out << "\\newcommand{\\klset";
+    name_escape(out, name);
+    out << "}{%\n";
+    for(size_t i = 0; i < formats.size(); ++i){
+        out << "    \\def\\" << program::compact_name(i) << "##1{"
+            << formats[i]->named.open << "##1" << formats[i]->named.close << "}%\n";
     }
+    out << "}\n";
 }
 
-void language::name_command(std::ostream& out, const std::string& sty_name) const {
+void language::name_command(util::output_buffer& out, const std::string& sty_name) const {
     out << '\\';
     name_escape(out, name);
     name_escape(out, sty_name);
 }
 
-void language::name_escape(std::ostream& out, const std::string& name) {
+void language::name_escape(util::output_buffer& out, const std::string& name) {
     for(size_t i = 0; i < name.length(); ++i){
         if(std::isalpha(name[i]))
             out << name[i];
@@ -0,0 +1,504 @@
+#include "language.hpp"
+#include "rule_types.hpp"
+#include "build_id.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//The cache is a dump of the parsed language, tied to the build that wrote it
+//(see scripts/build_id.cmake) and to the version of its format.
+//References to styles, contexts, keyword lists and patterns are stored by
+//language and name (or index), so that they can point into other languages.
+
+#define CACHE_MAGIC   "katelistings language cache"
+//Bumped whenever the archived layout, the rule types or the kernel ids change
+#define CACHE_VERSION "3"
+
+using cache_error = std::runtime_error;
+
+//Describes a file, so that the cache is invalidated when it changes
+static std::string file_stamp(const std::string& path){
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0)
+        return path + ":missing";
+    
+    return path + ":" + std::to_string(st.st_size) + ":" + std::to_string(st.st_mtime);
+}
+
+std::string language::cache_key::stamp() const {
+    std::string stamp = std::string(CACHE_MAGIC) + "\n" + CACHE_VERSION + " " KATELISTINGS_BUILD_ID "\n" + file_stamp(theme) + "\n"
+                      + (all_contexts ? "all contexts\n" : "reachable contexts\n");
+    for(const std::string& file : files)
+        stamp += file_stamp(file) + "\n";
+    
+    return stamp;
+}
+
+template<typename T>
+struct is_cref_ptr : std::false_type {};
+template<typename T>
+struct is_cref_ptr< util::cref_ptr<T> > : std::true_type {};
+
+//Types that list their fields (with archive) may hold references
+template<typename T, typename = void>
+struct has_archive : std::false_type {};
+template<typename T>
+struct has_archive< T, std::void_t<decltype(&T::template archive<int>)> > : std::true_type {};
+
+//Trivially copyable data without pointers can be stored as raw bytes
+template<typename T>
+constexpr bool is_raw_v = std::is_trivially_copyable_v<T> && !is_cref_ptr<T>::value
+                       && !std::is_same_v<T, std::string_view> && !has_archive<T>::value;
+
+class language::cache_writer {
+    std::string data;
+    
+    //Owners of everything that can be referred to
+    std::unordered_map<const style*,    std::pair<std::string, std::string>> style_refs;
+    std::unordered_map<const context*,  std::pair<std::string, std::string>> context_refs;
+    std::unordered_map<const util::keyword_set*, std::pair<std::string, std::string>> keyword_refs;
+    std::unordered_map<const context::reg_expr::compiled*, std::pair<std::string, size_t>> regex_refs;
+    std::unordered_map<const context::rule_variant*, std::pair<std::string, size_t>> rule_refs;
+    
+    void write_raw(const void* ptr, size_t len){
+        data.append(static_cast<const char*>(ptr), len);
+    }
+
+public:
+    
+    explicit cache_writer(const std::unordered_map<std::string, language>& languages) : data() {
+        for(const auto& [lang_name, lang] : languages){
+            for(const auto& [name, st] : lang.styles)
+                style_refs[&st] = {lang_name, name};
+            for(const auto& [name, con] : lang.contexts)
+                context_refs[&con] = {lang_name, name};
+            for(const auto& [name, keywords] : lang.keyword_lists)
+                keyword_refs[&keywords] = {lang_name, name};
+            for(size_t i = 0; i < lang.regexes.size(); ++i)
+                regex_refs[&lang.regexes[i]] = {lang_name, i};
+            for(size_t i = 0; i < lang.rules.size(); ++i)
+                rule_refs[&lang.rules[i]] = {lang_name, i};
+        }
+    }
+    
+    const std::string& str() const { return data; }
+    
+    template<typename... T>
+    void operator() (const T&... vals){ (write(vals), ...); }
+    
+    template<typename T>
+    void write(const T& val){
+        if constexpr(is_raw_v<T>)
+            write_raw(&val, sizeof(T));
+        else
+            //archive only reads the fields when writing
+            const_cast<T&>(val).archive(*this);
+    }
+    
+    template<typename T>
+    void write(const std::vector<T>& vec){
+        write(vec.size());
+        if constexpr(is_raw_v<T>)
+            write_raw(vec.data(), vec.size() * sizeof(T));
+        else{
+            for(const T& val : vec)
+                write(val);
+        }
+    }
+    
+    void write(std::string_view str){
+        write(str.size());
+        write_raw(str.data(), str.size());
+    }
+    void write(const std::string& str){ write(std::string_view(str)); }
+    
+    template<typename T, typename U>
+    void write_ref(const util::cref_ptr<T>& ptr, const std::unordered_map<const T*, U>& refs){
+        write(static_cast<bool>(ptr));
+        if(!ptr)
+            return;
+        
+        auto it = refs.find(&*ptr);
+        if(it == refs.end())
+            throw cache_error("unresolved reference");
+        write(it->second.first);
+        write(it->second.second);
+    }
+    
+    void write(const util::cref_ptr<style>& ptr)                        { write_ref(ptr, style_refs); }
+    void write(const util::cref_ptr<context>& ptr)                      { write_ref(ptr, context_refs); }
+    void write(const util::cref_ptr<util::keyword_set>& ptr)            { write_ref(ptr, keyword_refs); }
+    void write(const util::cref_ptr<context::reg_expr::compiled>& ptr)  { write_ref(ptr, regex_refs); }
+    void write(const util::cref_ptr<context::rule_variant>& ptr)        { write_ref(ptr, rule_refs); }
+    
+    void write(const context_switch& con_sw){
+        write(con_sw.pops);
+        write(con_sw.target);
+    }
+    
+    void write(const context::rule_variant& var){
+        write(static_cast<uint8_t>(var.index()));
+        
+        //Rules are written field by field, although many are trivially copyable
+        std::visit([&](const auto& r){ 
+            using R = std::remove_const_t<std::remove_reference_t<decltype(r)>>;
+            const_cast<R&>(r).archive(*this); 
+        }, var);
+    }
+    
+    void write_context(const context& con){
+        (*this)(con.name, con.attribute, con.end_context, con.empty_context, con.fall_context,
+                con.fallthrough, con.groups, con.rules, con.dispatch_rules, con.dispatch_index);
+    }
+    
+    void write_program(const program& prog){
+        (*this)(prog.states, prog.code, prog.buckets, prog.rules, prog.styles, prog.start);
+    }
+};
+
+class language::cache_reader {
+    const char* pos;
+    const char* end;
+    
+    language& lang;
+    const std::unordered_map<std::string, style>& deflt_styles;
+    const std::unordered_map<std::string, language>& languages;
+    
+    void read_raw(void* ptr, size_t len){
+        if(static_cast<size_t>(end - pos) < len)
+            throw cache_error("truncated");
+        
+        std::memcpy(ptr, pos, len);
+        pos += len;
+    }
+    
+    //The language that owns a reference: the one being loaded, or one loaded earlier
+    const language& owner(const std::string& name){
+        if(name == lang.name)
+            return lang;
+        
+        auto it = languages.find(name);
+        if(it == languages.end())
+            throw cache_error("language \"" + name + "\" not loaded");
+        return it->second;
+    }
+    
+    template<typename M>
+    static const typename M::mapped_type& lookup(const M& map, const std::string& key){
+        auto it = map.find(key);
+        if(it == map.end())
+            throw cache_error("\"" + key + "\" not found");
+        return it->second;
+    }
+
+public:
+    
+    cache_reader(const char* data, size_t size, language& l,
+                 const std::unordered_map<std::string, style>& ds,
+                 const std::unordered_map<std::string, language>& langs)
+    : pos(data), end(data + size), lang(l), deflt_styles(ds), languages(langs) {}
+    
+    bool at_end() const { return pos == end; }
+    
+    template<typename... T>
+    void operator() (T&... vals){ (read(vals), ...); }
+    
+    template<typename T>
+    void read(T& val){
+        if constexpr(is_raw_v<T>)
+            read_raw(&val, sizeof(T));
+        else
+            val.archive(*this);
+    }
+    
+    template<typename T>
+    void read(std::vector<T>& vec){
+        size_t size;
+        read(size);
+        if(size > static_cast<size_t>(end - pos))
+            throw cache_error("truncated");
+        
+        vec.resize(size);
+        if constexpr(is_raw_v<T>)
+            read_raw(vec.data(), size * sizeof(T));
+        else{
+            for(T& val : vec)
+                read(val);
+        }
+    }
+    
+    void read(std::string& str){
+        size_t size;
+        read(size);
+        if(size > static_cast<size_t>(end - pos))
+            throw cache_error("truncated");
+        
+        str.assign(pos, size);
+        pos += size;
+    }
+    void read(std::string_view& str){
+        std::string tmp;
+        read(tmp);
+        str = lang.strings.intern(tmp);
+    }
+    
+    template<typename T>
+    bool read_ref(util::cref_ptr<T>& ptr, std::string& lang_name){
+        bool present;
+        read(present);
+        ptr = nullptr;
+        if(present)
+            read(lang_name);
+        return present;
+    }
+    
+    void read(util::cref_ptr<style>& ptr){
+        std::string lang_name, name;
+        if(read_ref(ptr, lang_name)){
+            read(name);
+            ptr = lookup(owner(lang_name).styles, name);
+        }
+    }
+    void read(util::cref_ptr<context>& ptr){
+        std::string lang_name, name;
+        if(read_ref(ptr, lang_name)){
+            read(name);
+            ptr = lookup(owner(lang_name).contexts, name);
+        }
+    }
+    void read(util::cref_ptr<util::keyword_set>& ptr){
+        std::string lang_name, name;
+        if(read_ref(ptr, lang_name)){
+            read(name);
+            ptr = lookup(owner(lang_name).keyword_lists, name);
+        }
+    }
+    void read(util::cref_ptr<context::reg_expr::compiled>& ptr){
+        std::string lang_name;
+        size_t idx;
+        if(read_ref(ptr, lang_name)){
+            read(idx);
+            const auto& regexes = owner(lang_name).regexes;
+            if(idx >= regexes.size())
+                throw cache_error("pattern index out of range");
+            ptr = regexes[idx];
+        }
+    }
+    void read(util::cref_ptr<context::rule_variant>& ptr){
+        std::string lang_name;
+        size_t idx;
+        if(read_ref(ptr, lang_name)){
+            read(idx);
+            const auto& rules = owner(lang_name).rules;
+            if(idx >= rules.size())
+                throw cache_error("rule index out of range");
+            ptr = rules[idx];
+        }
+    }
+    
+    void read(context_switch& con_sw){
+        read(con_sw.pops);
+        read(con_sw.target);
+    }
+
+#define RULE_CASE(NN)                                                   \
+        case rule_type::NN:                                             \
+        var.emplace<NN>().archive(*this);                               \
+        break;
+    
+    void read(context::rule_variant& var){
+        uint8_t type;
+        read(type);
+        
+        switch(type){
+            ALL_RULE_CASES
+            default: throw cache_error("unknown rule type");
+        }
+    }
+#undef RULE_CASE
+    
+    void read_style(style& st){
+        std::string deflt;
+        (*this)(st.name, deflt, st.colour, st.bg_colour, st.italic, st.bold, st.underline, st.strikethrough);
+        st.deflt_style = lookup(deflt_styles, deflt);
+    }
+    
+    //The name is read first, to find the context to read into
+    void read_context(context& con, const std::string& name){
+        con.name = name;
+        (*this)(con.attribute, con.end_context, con.empty_context, con.fall_context,
+                con.fallthrough, con.groups, con.rules, con.dispatch_rules, con.dispatch_index);
+    }
+    
+    void read_program(program& prog){
+        (*this)(prog.states, prog.code, prog.buckets, prog.rules, prog.styles, prog.start);
+    }
+};
+
+void language::save_cache(const std::string& cache_file, const cache_key& key,
+                          const std::unordered_map<std::string, language>& languages) const
+{
+    cache_writer ar(languages);
+    
+    try{
+        ar(key.stamp(), name, case_sensitive);
+        
+        ar(styles.size());
+        for(const auto& [sty_name, st] : styles)
+            ar(st.name, st.deflt_style->name, st.colour, st.bg_colour,
+               st.italic, st.bold, st.underline, st.strikethrough);
+        
+        ar(keyword_lists.size());
+        for(const auto& [list_name, keywords] : keyword_lists)
+            ar(list_name, keywords);
+        
+        ar(regexes.size());
+        for(const auto& comp : regexes)
+            ar(comp.valid, comp.regex);
+        
+        //Contexts refer to each other, so all names go first
+        ar(contexts.size());
+        for(const auto& [con_name, con] : contexts)
+            ar(con_name);
+        ar(default_context->get_name());
+        
+        //Contexts here and in languages that include from this one refer to the rules
+        ar(rules.size());
+        for(const auto& var : rules)
+            ar(var);
+        
+        for(const auto& [con_name, con] : contexts)
+            ar.write_context(con);
+        ar.write_context(empty_lines);
+        
+        ar.write_program(prog);
+    
+    } catch(const cache_error& err){
+        //Not worth failing over, the language is simply parsed again next time
+        return;
+    }
+    
+    //Written to the side and renamed, so that a concurrent reader never sees a partial file
+    std::string tmp_file = cache_file + "." + std::to_string(getpid()) + ".tmp";
+    {
+        std::ofstream out(tmp_file, std::ios::binary);
+        out.write(ar.str().data(), ar.str().size());
+        if(!out.good()){
+            std::remove(tmp_file.c_str());
+            return;
+        }
+    }
+    std::rename(tmp_file.c_str(), cache_file.c_str());
+}
+
+bool language::load_cache(const std::string& cache_file, const cache_key& key,
+                          const std::unordered_map<std::string, style>& deflt_styles,
+                          std::unordered_map<std::string, language>& languages,
+                          print_options opts)
+{
+    int fd = open(cache_file.c_str(), O_RDONLY);
+    if(fd < 0)
+        return false;
+    
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0){
+        close(fd);
+        return false;
+    }
+    
+    size_t size = st.st_size;
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+        return false;
+    
+    language lang;
+    cache_reader ar(static_cast<const char*>(data), size, lang, deflt_styles, languages);
+    bool success = false;
+    
+    try{
+        std::string stamp;
+        ar(stamp);
+        if(stamp != key.stamp())
+            throw cache_error("stale");
+        
+        ar(lang.name, lang.case_sensitive);
+        
+        size_t n;
+        ar(n);
+        for(size_t i = 0; i < n; ++i){
+            style sty;
+            ar.read_style(sty);
+            sty.set_latex(lang.name);
+            lang.styles.emplace(sty.name, sty);
+        }
+        
+        ar(n);
+        for(size_t i = 0; i < n; ++i){
+            std::string list_name;
+            ar(list_name);
+            ar(lang.keyword_lists[list_name]);
+        }
+        
+        ar(n);
+        for(size_t i = 0; i < n; ++i){
+            auto& comp = lang.regexes.emplace_back();
+            ar(comp.valid, comp.regex);
+        }
+        
+        ar(n);
+        for(size_t i = 0; i < n; ++i){
+            std::string con_name;
+            ar(con_name);
+            lang.contexts.emplace(con_name, context());
+        }
+        std::string default_name;
+        ar(default_name);
+        auto def_it = lang.contexts.find(default_name);
+        if(def_it == lang.contexts.end())
+            throw cache_error("no default context");
+        lang.default_context = def_it->second;
+        
+        size_t rule_count;
+        ar(rule_count);
+        for(size_t i = 0; i < rule_count; ++i)
+            ar(lang.rules.emplace_back());
+        
+        for(size_t i = 0; i < n; ++i){
+            std::string con_name;
+            ar(con_name);
+            ar.read_context(lang.contexts.at(con_name), con_name);
+        }
+        std::string empty_name;
+        ar(empty_name);
+        ar.read_context(lang.empty_lines, empty_name);
+        
+        ar.read_program(lang.prog);
+        lang.prog.index_formats();
+        
+        success = ar.at_end();
+    
+    } catch(const std::exception& err){
+        if(PRINT_OPT(DEBUG))
+            std::cout << INDENT(1) << "Ignoring cache \"" << cache_file << "\": " << err.what() << "\n";
+    }
+    
+    munmap(data, size);
+    
+    if(!success)
+        return false;
+    
+    if(PRINT_OPT(VERBOSE))
+        std::cout << INDENT(1) << "Loaded language \"" << lang.name << "\" from cache\n";
+    
+    std::string lang_name = lang.name;
+    languages.insert( std::make_pair(lang_name, std::move(lang)) );
+    return true;
+}
@@ -1,11 +1,15 @@
 #include "katelistings.hpp"
+#include "content_hash.hpp"
+#include "job_pool.hpp"
+#include "build_id.hpp"
+
+#include <algorithm>
+#include <sstream>
+
+#include <sys/stat.h>
 
 using fp = util::file_parser;
 
-std::string get_ID(){
-    //TODO: more portable version with no risk for collision
-    return std::to_string( getpid() );
-}
 
 
 using namespace util;
@@ -15,10 +19,9 @@ std::string latex_highlight::infer_language(const std::string& file,
     std::unordered_map< std::string, std::list<std::string> >& glob_extensions)
 {
     if(get_extension(file).empty()){
-        std::cerr << "ERROR: Cannot infer language from file without extension\n"
-                  << "       \"" << file << "\",\n"
-                  << "       explicit language choice (-l <language>) required\n";
-        exit(EXIT_FAILURE);
+        throw job_error("ERROR: Cannot infer language from file without extension\n"
+                        "       \"" + file + "\",\n"
+                        "       explicit language choice (-l <language>) required\n");
     }
     
     auto ext = get_extension(file);
@@ -32,20 +35,20 @@ std::string latex_highlight::infer_language(const std::string& file,
         }
     }
     if(ext_iter == glob_extensions.end()){
-        std::cerr << "ERROR: No language associated with file extension \"" << ext << "\",\n"
-                  << "       explicit language choice (-l <language>) required\n";
-        exit(EXIT_FAILURE);
+        throw job_error("ERROR: No language associated with file extension \"" + std::string(ext) + "\",\n"
+                        "       explicit language choice (-l <language>) required\n");
     }
     
     const auto& list = ext_iter->second;
     
     if(list.size() > 1){
-        std::cerr << "ERROR: Several languages are associated with this extension:\n";
+        std::ostringstream err;
+        err << "ERROR: Several languages are associated with this extension:\n";
         size_t i = 0;
         for(const auto& name : ext_iter->second)
-            std::cerr << "\t\t" << i++ << ": " << name << "\n";
-        std::cerr << "       Explicit language choice (-l <language>) required\n";
-        exit(EXIT_FAILURE);
+            err << "\t\t" << i++ << ": " << name << "\n";
+        err << "       Explicit language choice (-l <language>) required\n";
+        throw job_error(err.str());
     }
     
     return list.front();
@@ -56,7 +59,7 @@ void latex_highlight::do_job(const katelistings_job& job,
         std::unordered_map< std::string, cref_ptr<dom_element> >& lang_map,  
         std::unordered_map< std::string, std::list<std::string> >& extensions, 
         std::unordered_map< std::string, std::list<std::string> >& glob_extensions,
-        print_options opts)
+        print_options opts, std::ostream& log, size_t n_workers)
 {    
     std::istream* in;
     
@@ -66,19 +69,17 @@ void latex_highlight::do_job(const katelistings_job& job,
         in = &std::cin;
         
         if(!job.inlin && job.language.empty()){
-            std::cerr << "ERROR: Cannot infer language from stream input,\n"
-                      << "       explicit language choice (-l <language>) required\n";
-            exit(EXIT_FAILURE);
+            throw job_error("ERROR: Cannot infer language from stream input,\n"
+                            "       explicit language choice (-l <language>) required\n");
         }
+        lang_name = job.language;
         
         if(PRINT_OPT(NORMAL))
-            std::cout << "Highlighting standard input...\n";
+            log << "Highlighting standard input...\n";
     }
     else {
-        if(!file_exists( job.input_file )){
-            std::cerr << "ERROR: Input file \"" << job.input_file << "\" does not exist\n";
-            exit(EXIT_FAILURE);
-        }
+        if(!file_exists( job.input_file ))
+            throw job_error("ERROR: Input file \"" + job.input_file + "\" does not exist\n");
         
         if(!job.inlin){
             if(job.language.empty())
@@ -88,30 +89,45 @@ void latex_highlight::do_job(const katelistings_job& job,
         }
         
         if(PRINT_OPT(NORMAL))
-            std::cout << "Highlighting file \"" << job.input_file << "\"...\n";
-        in = new std::ifstream(job.input_file);
+            log << "Highlighting file \"" << job.input_file << "\"...\n";
+        
+        //Other files are mapped instead, see below
+        in = job.inlin ? new std::ifstream(job.input_file) : nullptr;
     }
     
     if(job.inlin){
-        do_inline_job(*in, job.input_file, job.output_file, lang_map, opts);
+        do_inline_job(*in, job.input_file, job.output_file, lang_map, opts, log, n_workers);
     }
     else{
         std::ofstream out(job.output_file);
+        std::string out_dir = util::get_dir(job.output_file);
         
-        //Find specified language if not already loaded
-        load_language(lang_name, util::get_dir(job.output_file), lang_map, opts);
+        //The input is highlighted in place, without copying its lines
+        std::unique_ptr<util::input_buffer> input = in ? std::make_unique<util::input_buffer>(*in)
+                                                       : std::make_unique<util::input_buffer>(job.input_file);
+        
+        //Find specified language if not already loaded, unless the output is cached
+        const language* lang = nullptr;
+        std::string key;
+        if(cache)
+            key = highlight_key(lang_name, input->view(), lang_map, opts);
+        else
+            lang = &get_language(lang_name, out_dir, lang_map, opts);
         
         if(PRINT_OPT(NORMAL))
-            std::cout << "    Using language \"" + lang_name + "\"\n";
+            log << "    Using language \"" + lang_name + "\"\n";
             
         out << "\\begin{alltt}\n";
         
-        languages.find(lang_name)->second.highlight(*in, out, opts);
+        if(cache)
+            highlight_cached(lang_name, out_dir, input->view(), key, out, lang_map, opts);
+        else
+            lang->highlight(input->view(), out, opts);
                 
         out << "\\end{alltt}\n";
         
         if(PRINT_OPT(NORMAL))
-            std::cout << "...done. Output written to \"" + job.output_file + "\".\n";
+            log << "...done. Output written to \"" + job.output_file + "\".\n";
         
         out.close();
         
@@ -123,81 +139,190 @@ void latex_highlight::do_job(const katelistings_job& job,
     
 }
 
+//Leaves the file untouched if it already has these contents, so that its modification
+//time only changes with them. Returns false if it could not be written
+static bool write_if_changed(const std::string& filename, const std::string& contents, bool& changed){
+    std::ifstream in(filename, std::ios::binary);
+    if(in.good()){
+        std::string old((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        if(old == contents){
+            changed = false;
+            return true;
+        }
+    }
+    in.close();
+    
+    changed = true;
+    std::ofstream out(filename, std::ios::binary);
+    out << contents;
+    return out.good();
+}
+
+//The manifest of an inline document holds the hash of each listing in the last run
+#define MANIFEST_HEADER "katelistings manifest 1"
+
+static std::unordered_map<size_t, std::string> read_manifest(const std::string& filename){
+    std::unordered_map<size_t, std::string> hashes;
+    
+    std::ifstream in(filename);
+    std::string header;
+    if(!std::getline(in, header) || header != MANIFEST_HEADER)
+        return hashes;
+    
+    size_t index;
+    std::string hash;
+    while(in >> index >> hash)
+        hashes[index] = hash;
+    
+    return hashes;
+}
+
 void latex_highlight::do_inline_job(std::istream& in, 
         const std::string& filename, const std::string& output_dir, 
         std::unordered_map< std::string, cref_ptr<dom_element> >& lang_map,
-        print_options opts){
+        print_options opts, std::ostream& log, size_t n_workers){
     
-    const std::string name_base = (output_dir.empty() ? "./" : output_dir + "/")
-                                + replace_extension(get_filename(filename), "") 
-                                + "_";
+    const std::string doc_base  = (output_dir.empty() ? "./" : output_dir + "/")
+                                + replace_extension(get_filename(filename), "");
+    const std::string name_base = doc_base + "_";
     
+    //Listings are only highlighted again if their hash has changed since the last run.
+    //It covers everything that the output depends on
+    const std::string manifest_file = doc_base + ".lst.manifest";
+    std::unordered_map<size_t, std::string> old_hashes = read_manifest(manifest_file);
+    
+    //Collect all listings first, loading their languages in order.
+    //Lines are counted as the parser passes them, for error messages
+    std::vector<inline_listing> listings;
     file_parser parser(in);
+    size_t line = 1;
+    
+    auto count_lines = [&](const std::string& str){
+        line += std::count(str.begin(), str.end(), '\n');
+    };
     
-    for(size_t lst_counter = 0;;){
+    for(;;){
         parser.set_mark();
         if(!parser.seek("\\begin{katelistings}", fp::consume))
             break;
+        count_lines(parser.substr());
         
         //Check for comment (is fooled by escaped comment char)
         if(parser.seek('%', fp::backwards | fp::single_line | fp::lookahead))
             continue;
         
+        inline_listing lst;
+        lst.index = listings.size();
+        lst.line = line;
+        
+        parser.set_mark();
         parser.seek('{', fp::consume, "Missing language argument");
-                
+        count_lines(parser.substr());
+        
         parser.set_mark();
         parser.seek('}', 0, "Language argument not closed, '}' expected");
         
-        std::string lang_name = parser.substr();
-        auto lang_iter = lang_map.find(lang_name);
+        lst.lang_name = parser.substr();
+        count_lines(lst.lang_name);
+        auto lang_iter = lang_map.find(lst.lang_name);
         if(lang_iter == lang_map.end())
-            parser.error("Language \"" + lang_name + "\" not recognised");
-        
-        load_language(lang_name, output_dir, lang_map, opts);            
+            parser.error("Language \"" + lst.lang_name + "\" not recognised");
         
-        std::string out_file = name_base + std::to_string(lst_counter) + ".lst";
-        
-        if(PRINT_OPT(VERBOSE))
-            std::cout << "Processing listing " << lst_counter 
-                      << " in language \"" << lang_name << "\"...\n";
-                
-        parser.advance_line();
+        if(parser.advance_line())
+            ++line;
         parser.set_mark();
         parser.seek_not_of(fp::whitespace, fp::single_line);
         
-        std::stringstream tmp;
+        line += process_inline_listing(parser, lst.body, parser.substr().length());
         
-        process_inline_listing(parser, tmp, parser.substr().length());
+        lst.hash = highlight_key(lst.lang_name, lst.body, lang_map, opts);
+        auto old_hash = old_hashes.find(lst.index);
+        lst.up_to_date = old_hash != old_hashes.end() && old_hash->second == lst.hash
+                      && file_exists(name_base + std::to_string(lst.index) + ".lst");
         
-        std::ofstream out(out_file);
+        //Unchanged and cached listings only need their language for its commands
+        bool needed = !lst.up_to_date && !(cache && cache->contains(lst.hash));
         
-        if(!out.good())
-            parser.error("Unable to write to file \"" + out_file + "\"");
-                
-        languages.find(lang_name)->second.highlight(tmp, out, opts);
+        lst.lang = nullptr;
+        if(needed || (PRINT_OPT(USE_COMMANDS) && need_new_commands(lst.lang_name, output_dir, lang_map)))
+            lst.lang = &get_language(lst.lang_name, output_dir, lang_map, opts);
         
-        if(PRINT_OPT(VERBOSE))
-            std::cout << "...done. Output written to \"" << out_file << "\".\n";
+        listings.push_back(std::move(lst));
+    }
+    
+    //Then highlight them, numbered as they appear in the file
+    auto highlight_listing = [&](const inline_listing& lst, std::ostream& log){
+        std::string out_file = name_base + std::to_string(lst.index) + ".lst";
         
-        out.close();
+        if(lst.up_to_date){
+            if(PRINT_OPT(VERBOSE))
+                log << "Listing " << lst.index << " is unchanged.\n";
+            return;
+        }
         
-        ++lst_counter;
+        if(PRINT_OPT(VERBOSE))
+            log << "Processing listing " << lst.index 
+                      << " in language \"" << lst.lang_name << "\"...\n";
+        
+        std::ostringstream out;
+        if(cache)
+            highlight_cached(lst.lang_name, output_dir, lst.body, lst.hash, out, lang_map, opts);
+        else
+            lst.lang->highlight(lst.body, out, opts);
+        
+        bool changed;
+        if(!write_if_changed(out_file, out.str(), changed)){
+            throw job_error("ERROR: Unable to write to file \"" + out_file + "\"\n"
+                            "       (listing on line " + std::to_string(lst.line) + " of \"" + filename + "\")\n");
+        }
+        
+        if(PRINT_OPT(VERBOSE)){
+            if(changed)
+                log << "...done. Output written to \"" << out_file << "\".\n";
+            else
+                log << "...done. Output unchanged in \"" << out_file << "\".\n";
+        }
+    };
+    
+    if(n_workers <= 1){
+        for(const inline_listing& lst : listings)
+            highlight_listing(lst, log);
     }
+    else{
+        job_pool pool(n_workers);
+        for(const inline_listing& lst : listings)
+            pool.add([&](std::ostream& log){ highlight_listing(lst, log); });
+        pool.run(log);
+    }
+    
+    //Only written once all listings are, so that an interrupted run is redone
+    std::string manifest = MANIFEST_HEADER "\n";
+    for(const inline_listing& lst : listings)
+        manifest += std::to_string(lst.index) + " " + lst.hash + "\n";
+    
+    bool changed;
+    if(!write_if_changed(manifest_file, manifest, changed))
+        throw job_error("ERROR: Unable to write to file \"" + manifest_file + "\"\n");
 }
 
-void latex_highlight::process_inline_listing(file_parser& parser, std::ostream& out, size_t leading_space){
-    for(;;){
+//Returns the number of lines read
+size_t latex_highlight::process_inline_listing(file_parser& parser, std::string& body, size_t leading_space){
+    for(size_t lines = 1;; ++lines){
         parser.set_mark();
         parser.seek('\n');
-        out << parser.substr() << '\n';
+        body += parser.substr();
+        body += '\n';
         
         if(!parser.advance_line())
             parser.error("File ended prematuely, \"\\end{katelistings}\" expected");
                     
         for(size_t i = 0; parser && i < leading_space; ++i){
             if(parser.match("\\end{katelistings}", fp::consume))
-                return;
-                
+                return lines;
+            
+            //Lines shorter than the indentation are run together
+            if(parser.match("\n"))
+                ++lines;
             ++parser;
         }
     }
@@ -222,9 +347,14 @@ bool latex_highlight::load_language(const std::string& lang_name, const std::str
     //Ignore already parsed languages
     auto existing = languages.find(lang_name);
     if(existing != languages.end()){
-        //...but still generate commands if needed
-        if(PRINT_OPT(USE_COMMANDS) && need_new_commands(lang_name, out_dir))
-            existing->second.generate_commands(*(lang_iter->second), out_dir);
+        //...but still generate commands if needed, for its dependencies too
+        if(PRINT_OPT(USE_COMMANDS) && loaded.insert(lang_name).second){
+            for(const auto& dep : lang_iter->second->all_elements("dependency"))
+                load_language(dep.attribute("name").or_error().val(), out_dir, lang_map, loaded, opts);
+            
+            if(need_new_commands(lang_name, out_dir, lang_map))
+                existing->second.generate_commands(*(lang_iter->second), out_dir, commands_id(lang_name, lang_map));
+        }
         
         return true;
     }
@@ -243,22 +373,258 @@ bool latex_highlight::load_language(const std::string& lang_name, const std::str
             lang_iter->second->error("Language dependency \"" + dep.attribute("name").val() + "\" not defined");
     }
     
-    //Parse it, knowing that all dependencies are already parsed
-    parse_language(lang_iter->second->attribute("path").or_error(), opts);
-    if(PRINT_OPT(USE_COMMANDS))
-        languages.find(lang_name)->second.generate_commands(*(lang_iter->second), out_dir);
+    //Parse it, knowing that all dependencies are already parsed,
+    //unless an up-to-date version is cached
+    language::cache_key key;
+    collect_syntax_files(lang_name, lang_map, key.files);
+    key.theme = theme_file;
+    key.all_contexts = is_dependency(lang_name, lang_map);
+    
+    if(!language::load_cache(cache_file(lang_name), key, default_styles, languages, opts)){
+        parse_language(lang_iter->second->attribute("path").or_error(), key.all_contexts, opts);
+        
+        auto parsed = languages.find(lang_name);
+        if(parsed != languages.end())
+            parsed->second.save_cache(cache_file(lang_name), key, languages);
+    }
+    
+    if(PRINT_OPT(USE_COMMANDS) && need_new_commands(lang_name, out_dir, lang_map))
+        languages.find(lang_name)->second.generate_commands(*(lang_iter->second), out_dir, commands_id(lang_name, lang_map));
     
     return true;
 }
 
-bool latex_highlight::need_new_commands(const std::string& lang_name, const std::string& out_dir){
-    std::ifstream in(out_dir + "/" + lang_name + ".lst.sty");
+const language& latex_highlight::get_language(const std::string& lang_name, const std::string& out_dir,
+        std::unordered_map< std::string, cref_ptr<dom_element> >& lang_map, print_options opts)
+{
+    std::lock_guard<std::mutex> guard(languages_lock);
+    
+    std::unordered_set< std::string > loaded;
+    if(!load_language(lang_name, out_dir, lang_map, loaded, opts))
+        throw job_error("ERROR: Language \"" + lang_name + "\" not recognised\n");
+    
+    return languages.at(lang_name);
+}
+
+//Identifies the output of highlighting input, and so the hashes in the inline manifest:
+//the build id covers the sources of katelistings, the stamp of the language cache key
+//the theme and all syntax files involved
+std::string latex_highlight::highlight_key(const std::string& lang_name, std::string_view input,
+        std::unordered_map< std::string, cref_ptr<dom_element> >& lang_map, print_options opts)
+{
+    std::string stamp;
+    {
+        std::lock_guard<std::mutex> guard(languages_lock);
+        
+        auto [it, added] = lang_stamps.try_emplace(lang_name);
+        if(added){
+            language::cache_key key;
+            collect_syntax_files(lang_name, lang_map, key.files);
+            key.theme = theme_file;
+            it->second = key.stamp();
+        }
+        stamp = it->second;
+    }
+    
+    return content_hash().add_field(KATELISTINGS_VERSION)
+                         .add_field(KATELISTINGS_BUILD_ID)
+                         .add_field(stamp)
+                         .add_field(lang_name)
+                         .add_field(PRINT_OPT(COMPACT) ? "compact" : PRINT_OPT(USE_COMMANDS) ? "commands" : PRINT_OPT(DECLARATIVE) ? "declarative" : "raw")
+                         .add_field(PRINT_OPT(BARE_NORMAL) ? "bare" : "formatted")
+                         .add_field(input)
+                         .hex();
+}
+
+//Highlights input, unless the cache has the output already.
+//The language is only loaded on a miss, or to generate its commands
+void latex_highlight::highlight_cached(const std::string& lang_name, const std::string& out_dir,
+        std::string_view input, const std::string& key, std::ostream& out,
+        std::unordered_map< std::string, cref_ptr<dom_element> >& lang_map, print_options opts)
+{
+    std::string text;
+    if(cache->get(key, text)){
+        if(PRINT_OPT(USE_COMMANDS) && need_new_commands(lang_name, out_dir, lang_map))
+            get_language(lang_name, out_dir, lang_map, opts);
+    }
+    else{
+        std::ostringstream hl;
+        get_language(lang_name, out_dir, lang_map, opts).highlight(input, hl, opts);
+        
+        text = hl.str();
+        cache->put(key, text);
+    }
+    
+    out << text;
+}
+
+void latex_highlight::use_cache(const std::string& dir){
+    cache = std::make_unique<highlight_cache>(dir);
+}
+
+void latex_highlight::prepare_job(const katelistings_job& job, 
+        std::unordered_map< std::string, cref_ptr<dom_element> >& lang_map,  
+        std::unordered_map< std::string, std::list<std::string> >& extensions, 
+        std::unordered_map< std::string, std::list<std::string> >& glob_extensions,
+        print_options opts)
+{
+    //Inline jobs name their languages inside the file,
+    //and do_job reports stream input without a language
+    if(job.inlin || (job.input_file.empty() && job.language.empty()))
+        return;
+    
+    //Errors are left to do_job, which reports them after the jobs before this one
+    try{
+        std::string lang_name = job.language.empty()
+                                 ? infer_language(job.input_file, extensions, glob_extensions)
+                                 : job.language;
+        
+        get_language(lang_name, util::get_dir(job.output_file), lang_map, opts);
+    } catch(const job_error&){}
+}
+
+void latex_highlight::run_jobs(const std::list<katelistings_job>& jobs, 
+        std::unordered_map< std::string, cref_ptr<dom_element> >& lang_map,  
+        std::unordered_map< std::string, std::list<std::string> >& extensions, 
+        std::unordered_map< std::string, std::list<std::string> >& glob_extensions,
+        print_options opts, size_t n_workers)
+{
+    //A failed job stops the run once the jobs before it are done and their messages printed.
+    //Jobs are never stopped by exiting from a worker thread, while others write files
+    try{
+        //A single job, typically an inline document, gets the workers to itself
+        if(n_workers <= 1 || jobs.size() == 1){
+            for(const auto& job : jobs)
+                do_job(job, lang_map, extensions, glob_extensions, opts, std::cout, n_workers);
+        }
+        else{
+            //Loading languages up front keeps their messages in order
+            for(const auto& job : jobs)
+                prepare_job(job, lang_map, extensions, glob_extensions, opts);
+            
+            job_pool pool(n_workers);
+            for(const auto& job : jobs){
+                pool.add([&](std::ostream& log){
+                    do_job(job, lang_map, extensions, glob_extensions, opts, log);
+                });
+            }
+            pool.run();
+        }
+    } catch(const job_error& err){
+        std::cout.flush();
+        std::cerr << err.what();
+        exit(EXIT_FAILURE);
+    }
+    
+    if(cache){
+        cache->trim();
+        
+        if(PRINT_OPT(NORMAL)){
+            std::cout << "Highlight cache \"" << cache->get_dir() << "\": " 
+                      << cache->hit_count() << " hits, " << cache->miss_count() << " misses\n";
+        }
+    }
+}
+
+void latex_highlight::preload_language(const std::string& lang_name,
+        std::unordered_map< std::string, cref_ptr<dom_element> >& lang_map, print_options opts)
+{
+    load_language(lang_name, "", lang_map, (print_options) (opts & ~print_options::USE_COMMANDS));
+}
+
+std::vector<std::string> latex_highlight::loaded_languages() const {
+    std::vector<std::string> names;
+    for(const auto& [name, lang] : languages)
+        names.push_back(name);
+    
+    return names;
+}
+
+//The syntax file of a language followed by those of all its dependencies
+void latex_highlight::collect_syntax_files(const std::string& lang_name, 
+        std::unordered_map< std::string, cref_ptr<dom_element> >& lang_map,
+        std::vector< std::string >& files)
+{
+    auto lang_iter = lang_map.find(lang_name);
+    if(lang_iter == lang_map.end())
+        return;
+    
+    std::string path = lang_iter->second->attribute("path").or_error();
+    if(std::find(files.begin(), files.end(), path) != files.end())
+        return;
+    
+    files.push_back(path);
+    for(const auto& dep : lang_iter->second->all_elements("dependency"))
+        collect_syntax_files(dep.attribute("name").or_error(), lang_map, files);
+}
+
+//Other languages may include rules from any context of a dependency, not only
+//from those that its own default context leads to
+bool latex_highlight::is_dependency(const std::string& lang_name,
+        std::unordered_map< std::string, cref_ptr<dom_element> >& lang_map)
+{
+    for(const auto& [name, defn] : lang_map){
+        for(const auto& dep : defn->all_elements("dependency")){
+            if(dep.attribute("name").or_error().val() == lang_name)
+                return true;
+        }
+    }
+    
+    return false;
+}
+
+std::string latex_highlight::cache_file(const std::string& lang_name){
+    mkdir(cache_dir, 0755);
+    
+    //Language names may contain characters like '+' and '/'
+    std::ostringstream name;
+    for(char c : lang_name){
+        if(std::isalnum(c))
+            name << c;
+        else
+            name << '_' << std::hex << static_cast<int>(static_cast<unsigned char>(c));
+    }
+    
+    return cache_dir + name.str() + ".cache";
+}
+
+//Identifies everything that the commands of a language depend on: its syntax file and
+//those of its dependencies, the theme and the version of katelistings. Unlike the
+//stamps used for caching, only the contents count, so touching a file or rebuilding
+//changes nothing. The version is bumped whenever the generated commands change
+std::string latex_highlight::commands_id(const std::string& lang_name,
+        std::unordered_map< std::string, cref_ptr<dom_element> >& lang_map)
+{
+    std::lock_guard<std::mutex> guard(command_ids_lock);
+    
+    auto [it, added] = command_ids.try_emplace(lang_name);
+    if(added){
+        std::vector<std::string> files;
+        collect_syntax_files(lang_name, lang_map, files);
+        files.push_back(theme_file);
+        
+        content_hash hash;
+        hash.add_field(KATELISTINGS_VERSION);
+        for(const std::string& file : files){
+            std::ifstream in(file, std::ios::binary);
+            hash.add_field(std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()));
+        }
+        it->second = hash.hex();
+    }
+    
+    return it->second;
+}
+
+bool latex_highlight::need_new_commands(const std::string& lang_name, const std::string& out_dir,
+        std::unordered_map< std::string, cref_ptr<dom_element> >& lang_map)
+{
+    std::ifstream in(language::commands_file(out_dir, lang_name));
     
     if(!in.good())
         return true;
     
     file_parser parser(in);
-    if(!parser.match("% ID: " + get_ID()))
+    if(!parser.match("% ID: " + commands_id(lang_name, lang_map) + "\n"))
         return true;
     
     return false;
@@ -267,6 +633,8 @@ bool latex_highlight::need_new_commands(const std::string& lang_name, const std:
     
 
 void latex_highlight::parse_default_styles(const std::string& filename, print_options opts){
+    theme_file = filename;
+    
     dom_element file;
     file.parse_json(filename);
     
@@ -295,13 +663,15 @@ void latex_highlight::parse_default_styles(const std::string& filename, print_op
         ds.underline     = GET_TYPE("underline",     "false").bool_val();
         ds.strikethrough = GET_TYPE("strikethrough", "false").bool_val();
         
+        ds.set_latex("");
+        
         default_styles[ds.name] = ds;
         
 #undef OBTAIN
     }
 }
 
-void latex_highlight::parse_language(const std::string& filename, print_options opts){
+void latex_highlight::parse_language(const std::string& filename, bool all_contexts, print_options opts){
     
     if(default_styles.empty()){
         std::cerr << "ERROR: missing style";
@@ -318,7 +688,7 @@ void latex_highlight::parse_language(const std::string& filename, print_options
     
     languages.insert( std::make_pair(
         defn.attribute("name").or_error().val(), 
-        language(defn, default_styles, languages, opts)
+        language(defn, default_styles, languages, all_contexts, opts)
     ));
 }
     
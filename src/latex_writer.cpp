@@ -0,0 +1,140 @@
+#include "language.hpp"
+
+#define LATEX_WRITER language::latex_writer
+
+LATEX_WRITER::latex_writer(const language& lang, std::ostream& o, print_options opts)
+: out(o), use_commands(PRINT_OPT(USE_COMMANDS)), declarative(PRINT_OPT(DECLARATIVE)),
+  state{"", false, false}, line_start{"", false, false},
+  compact(nullptr), normal(nullptr), open(nullptr), close(nullptr)
+{
+    //Defines the macros for this listing, see generate_commands
+    if(PRINT_OPT(COMPACT)){
+        compact = &lang.prog.get_compact();
+        out << "\\klset";
+        name_escape(out, lang.name);
+        out << "{}";
+    }
+    
+    if(!PRINT_OPT(BARE_NORMAL) && !declarative)
+        return;
+    
+    //Every style refers to its default style, which belongs to the theme
+    const style* ds_normal = nullptr;
+    for(const auto& [name, st] : lang.styles){
+        if(st.deflt_style && st.deflt_style->name == "dsNormal"){
+            ds_normal = &*st.deflt_style;
+            break;
+        }
+    }
+    
+    if(PRINT_OPT(BARE_NORMAL)){
+        normal = ds_normal;
+        
+        //Bare text has the colour of the surrounding document, so it is
+        //saved to be declared again
+        if(declarative)
+            out << "\\colorlet{klambient}{.}";
+    }
+    else if(ds_normal)
+        line_start = {ds_normal->colour, ds_normal->bold, ds_normal->italic};
+}
+
+//Styles that the program does not know of (which should not happen) fall back on their commands
+const language::style::latex_sequence& LATEX_WRITER::latex(const style& st) const {
+    if(compact){
+        auto it = compact->find(&st);
+        if(it != compact->end())
+            return it->second;
+    }
+    return st.latex(use_commands);
+}
+
+//Styles with the same formatting have the same raw open sequence, and the same compact macro.
+//Each style has its own command, so with commands only the same style continues a run
+bool LATEX_WRITER::continues_run(const style& st) const {
+    if(!open)
+        return false;
+    if(open == &st)
+        return true;
+    
+    return latex(*open).open == latex(st).open;
+}
+
+//The colour comes last, since a control word before text needs something to end it
+void LATEX_WRITER::declare(const declaration& decl){
+    bool delimit = false;
+    if(decl.bold != state.bold){
+        out << (decl.bold ? "\\bfseries" : "\\mdseries");
+        delimit = true;
+    }
+    if(decl.italic != state.italic){
+        out << (decl.italic ? "\\itshape" : "\\upshape");
+        delimit = true;
+    }
+    
+    if(decl.colour != state.colour){
+        if(decl.colour.empty())
+            out << "\\color{klambient}";
+        else
+            out << "\\color[HTML]{" << decl.colour << '}';
+    }
+    else if(delimit)
+        out << "{}";
+    
+    state = decl;
+}
+
+//Spaces look the same in any colour, series and shape, so they need not be
+//declared for, unless they are in a group (underlined, for instance)
+bool LATEX_WRITER::keeps_run(const style& st, std::string_view text) const {
+    if(!declarative || !st.wrapped.open.empty() || (close && !close->empty()))
+        return false;
+    
+    return text.find_first_not_of(' ') == std::string_view::npos;
+}
+
+void LATEX_WRITER::open_run(const style& st){
+    if(continues_run(st))
+        return;
+    
+    close_run();
+    open = &st;
+    if(normal && st.raw.open == normal->raw.open){
+        if(declarative)
+            declare({"", false, false});
+        return;
+    }
+    
+    if(declarative)
+        declare({st.colour, st.bold, st.italic});
+    
+    const style::latex_sequence& seq = declarative ? st.wrapped : latex(st);
+    out << seq.open;
+    close = &seq.close;
+}
+
+void LATEX_WRITER::close_run(){
+    if(close)
+        out << *close;
+    close = nullptr;
+    open = nullptr;
+}
+
+bool LATEX_WRITER::write(const style& st, char ch){
+    if(!keeps_run(st, std::string_view(&ch, 1)))
+        open_run(st);
+    return latex_escape(out, ch);
+}
+
+bool LATEX_WRITER::write(const style& st, std::string_view str, size_t pos, size_t len){
+    if(!keeps_run(st, str.substr(pos, len)))
+        open_run(st);
+    return latex_escape(out, str, pos, len);
+}
+
+void LATEX_WRITER::end_line(){
+    close_run();
+    if(declarative)
+        declare(line_start);
+    out.put('\n');
+}
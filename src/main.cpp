@@ -1,6 +1,13 @@
 #include "katelistings.hpp"
+#include "server.hpp"
 
+#include <algorithm>
+
+#include <dirent.h>
 #include <getopt.h>
+#include <sys/stat.h>
+
+#include "job_pool.hpp"
 
 using namespace DOM;
 
@@ -42,7 +49,15 @@ void print_help() {
     "\n"
     " -i [--input]                  Process the following file.  All extra argu-\n"
     "                                   ments are treated as input files just as\n"
-    "                                   if they were the argument of -i.\n"
+    "                                   if they were the argument of -i. A dir-\n"
+    "                                   ectory is searched recursively for files\n"
+    "                                   with  known extensions  (or all files if\n"
+    "                                   -l is in effect),  and their outputs are\n"
+    "                                   placed in the same  tree structure under\n"
+    "                                   the current directory,  or the directory\n"
+    "                                   given with -o,  as <filename>.lst (with\n"
+    "                                   the extension kept, so that foo.c writes\n"
+    "                                   foo.c.lst).\n"
     " -s [--std-input]              Read  standard input  like an  -i file,  and\n"
     "                                   print the results to standard ouptut un-\n"
     "                                   less overridden with -o.\n"
@@ -56,6 +71,9 @@ void print_help() {
     "                                   the listings are modified. The processed\n"
     "                                   files  are placed in  the \"katelistings\"\n" 
     "                                   unless overridden by -o.\n"
+    "                                   Listings  that have not changed  since the\n"
+    "                                   last run are left untouched,  as recorded\n"
+    "                                   in \"<name>.lst.manifest\".\n"
     " -S [--std-inline]             Read standard input like an -I file.\n"
     " -o [--output]                 Specifies a path  for the highlighted output\n"
     "                                   from  the  latest  input file  specified\n"
@@ -95,6 +113,26 @@ void print_help() {
     "                                   able, and allows for manual highlighting\n"
     "                                   of small code snippets  for which a full\n"
     "                                   listing won't work.\n"
+    " -k [--compact]                Like -c, but write each distinct format as a\n"
+    "                                   short macro (\\klA, \\klB, ...) that the\n"
+    "                                   listing defines  for itself,  using  the\n"
+    "                                   definitions in \"<language>.lst.sty\".\n"
+    "                                   This gives  the smallest .lst files, and\n"
+    "                                   the least work for LaTeX.\n"
+    " -b [--bare-normal]            Write text in the normal style (dsNormal)\n"
+    "                                   without any formatting,  so that it has\n"
+    "                                   the colour of the surrounding document.\n"
+    "                                   This makes  .lst files  smaller and fas-\n"
+    "                                   ter to typeset,  except with -x:  other\n"
+    "                                   styles  with the normal colour  of the\n"
+    "                                   theme (often keywords) must then declare\n"
+    "                                   it, and the document colour after them.\n"
+    " -x [--declarative]            Write the colour, boldness and italics of\n"
+    "                                   text as declarations (\\color, \\bfseries,\n"
+    "                                   ...)  where they change,  instead of as\n"
+    "                                   a group around every token.  This makes\n"
+    "                                   .lst files faster to typeset.  Can not\n"
+    "                                   be combined with -c or -k.\n"
     "\n"
     " -p [--ignore-priority]        Ignore the priority of language associations\n"
     "                                   to extensions. Instead, report ambiguity\n"
@@ -111,6 +149,34 @@ void print_help() {
     "                                   ard output. Implies -v and -e.  Intended\n"
     "                                   for  debugging  custom syntax files,  or\n" 
     "                                   katelistings itself.\n"
+    " -r [--reference]              Highlight  with the  reference  interpreter,\n"
+    "                                   which  walks the parsed  language direc-\n"
+    "                                   tly instead of running its compiled form.\n"
+    "                                   Slower, but useful for testing katelist-\n"
+    "                                   ings itself.\n"
+    "\n"
+    " -D [--server]                 Keep running in the foreground, with themes\n"
+    "                                   and languages loaded, and serve the jobs\n"
+    "                                   of later invocations  through the socket\n"
+    "                                   \"katelistings.sock\".  Those are sent to\n"
+    "                                   a running server of the same build auto-\n"
+    "                                   matically.  Stop it with Ctrl-C. A server\n"
+    "                                   notices when  syntax files or themes\n"
+    "                                   change.  Run it with \"&\" or in a sepa-\n"
+    "                                   rate terminal, it logs to standard out-\n"
+    "                                   put.\n"
+    " -N [--no-server]              Run the jobs locally  even if  a  server  is\n"
+    "                                   running.\n"
+    " -j [--jobs]                   Process  up to  the given  number  of  files\n"
+    "                                   in parallel,  or as many as there are CPU\n"
+    "                                   cores if it is 0.  Messages are  printed\n"
+    "                                   in the same order as without -j.\n"
+    " -C [--cache]                  Reuse highlighted  output  from the  cache in\n"
+    "                                   the directory given as  -C<dir>  or  --\n"
+    "                                   cache=<dir>,  by default  $XDG_CACHE_HOME\n"
+    "                                   /katelistings.  The cache is  shared with\n"
+    "                                   other  documents  and  runs,  and  keeps\n"
+    "                                   the most recently used 64 MB.\n"
     ;
    
     std::cout << std::endl;
@@ -177,6 +243,97 @@ void load_language_map(const dom_element& file, bool ignore_priority,
     }
 }
 
+static bool is_directory(const std::string& path){
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static bool has_language(const std::string& file,
+    const std::unordered_map< std::string, std::list<std::string> >& extensions, 
+    const std::unordered_map< std::string, std::list<std::string> >& glob_extensions)
+{
+    std::string ext = util::get_extension(file);
+    if(ext.empty())
+        return false;
+    
+    if(extensions.count(ext))
+        return true;
+    
+    //As in latex_highlight::infer_language
+    for(const auto& [glob, langs] : glob_extensions){
+        if(glob.compare(0, ext.length(), ext) == 0)
+            return true;
+    }
+    return false;
+}
+
+//Adds a job for every file under dir that has a language, in sorted order.
+//Outputs are placed under out_dir following the structure of dir
+static void expand_directory(const std::string& dir, const std::string& out_dir, const std::string& lang_name,
+    const std::unordered_map< std::string, std::list<std::string> >& extensions, 
+    const std::unordered_map< std::string, std::list<std::string> >& glob_extensions,
+    std::list< katelistings_job >& jobs)
+{
+    DIR* dp = opendir(dir.c_str());
+    if(!dp){
+        std::cerr << "ERROR: Unable to read directory \"" << dir << "\"\n";
+        exit(EXIT_FAILURE);
+    }
+    
+    std::vector<std::string> entries;
+    while(dirent* ent = readdir(dp)){
+        if(ent->d_name[0] != '.')
+            entries.push_back(ent->d_name);
+    }
+    closedir(dp);
+    
+    std::sort(entries.begin(), entries.end());
+    
+    for(const std::string& name : entries){
+        std::string path = dir + "/" + name;
+        
+        if(is_directory(path)){
+            expand_directory(path, out_dir + name + "/", lang_name, extensions, glob_extensions, jobs);
+        }
+        else if(!lang_name.empty() || has_language(name, extensions, glob_extensions)){
+            //Also creates any missing parents, which may only contain directories
+            for(size_t i = out_dir.find('/', 1); i != std::string::npos; i = out_dir.find('/', i+1))
+                mkdir(out_dir.substr(0, i).c_str(), 0777);
+            
+            //The extension is kept, since foo.c and foo.h often sit side by side
+            jobs.push_back( katelistings_job(path, lang_name, false) );
+            jobs.back().output_file = out_dir + name + ".lst";
+        }
+    }
+}
+
+void expand_directories(std::list< katelistings_job >& jobs,
+    const std::unordered_map< std::string, std::list<std::string> >& extensions, 
+    const std::unordered_map< std::string, std::list<std::string> >& glob_extensions)
+{
+    for(auto it = jobs.begin(); it != jobs.end();){
+        if(it->inlin || !is_directory(it->input_file)){
+            ++it;
+            continue;
+        }
+        
+        std::list< katelistings_job > expanded;
+        expand_directory(it->input_file, it->output_file, it->language, extensions, glob_extensions, expanded);
+        
+        jobs.splice(it, expanded);
+        it = jobs.erase(it);
+    }
+    
+    //Jobs that write the same file would overwrite each other, or interleave with -j
+    std::unordered_set<std::string> outputs;
+    for(const auto& job : jobs){
+        if(!job.inlin && !outputs.insert(job.output_file).second){
+            std::cerr << "ERROR: More than one input is written to \"" << job.output_file << "\"\n";
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
 void overwrite_defaults(const std::string& theme_file, print_options opts){
     
     std::ofstream ost("defaults.xml");
@@ -202,13 +359,17 @@ int main(int argc, char** argv){
     
     bool overwrite_deflts = false;
     bool ignore_priority = false;
+    bool run_server = false;
+    bool use_server = true;
+    size_t n_workers = 1;
+    std::string cache_dir = "";
     
     print_options opts = NORMAL;
     
     //I opted for good ol' C-theme getopt here 
     //rather than doing something fancy.
     opterr = 1;
-    const char* short_opts = "hgmi:sI:So:t:T:l:Lpqvedc";
+    const char* short_opts = "hgmi:sI:So:t:T:l:LpqvedckbxrDNj:C::";
     struct option long_opts[] = {
         {"help",                no_argument,        0, 'h'},
         {"get-data",            no_argument,        0, 'g'},
@@ -228,6 +389,14 @@ int main(int argc, char** argv){
         {"verbose",             no_argument,        0, 'v'},
         {"debug",               no_argument,        0, 'd'},
         {"commmands",           no_argument,        0, 'c'},
+        {"compact",             no_argument,        0, 'k'},
+        {"bare-normal",         no_argument,        0, 'b'},
+        {"declarative",         no_argument,        0, 'x'},
+        {"reference",           no_argument,        0, 'r'},
+        {"server",              no_argument,        0, 'D'},
+        {"no-server",           no_argument,        0, 'N'},
+        {"jobs",                required_argument,  0, 'j'},
+        {"cache",               optional_argument,  0, 'C'},
         {0,0,0,0}
     };
     
@@ -318,24 +487,94 @@ int main(int argc, char** argv){
             case 'c':
                 opts = (print_options) (opts | print_options::USE_COMMANDS);
                 break;
+            
+            case 'k':
+                opts = (print_options) (opts | print_options::COMPACT);
+                break;
+            
+            case 'b':
+                opts = (print_options) (opts | print_options::BARE_NORMAL);
+                break;
+            
+            case 'x':
+                opts = (print_options) (opts | print_options::DECLARATIVE);
+                break;
+                
+            case 'r':
+                opts = (print_options) (opts | print_options::REFERENCE);
+                break;
+            
+            case 'D':
+                run_server = true;
+                break;
+            
+            case 'N':
+                use_server = false;
+                break;
+                
+            case 'j':{
+                char* end;
+                n_workers = std::strtoul(optarg, &end, 10);
+                if(end == optarg || *end != '\0' || optarg[0] == '-'){
+                    std::cerr << "ERROR: -j expects a number of jobs, not \"" << optarg << "\"\n";
+                    exit(EXIT_FAILURE);
+                }
+                if(n_workers == 0)
+                    n_workers = job_pool::default_workers();
+                break;
+            }
+                
+            case 'C':
+                cache_dir = optarg ? optarg : highlight_cache::default_dir();
+                break;
         }
     }
     
+    if(PRINT_OPT(DECLARATIVE) && PRINT_OPT(USE_COMMANDS)){
+        std::cerr << "ERROR: -x can not be combined with -c or -k\n";
+        exit(EXIT_FAILURE);
+    }
+    
     for(; optind < argc; ++optind)
         job_list.push_back( katelistings_job(argv[optind], lang_name, false) );
     
+    //The output of a directory is a directory, as for inline jobs, 
+    //and it is only expanded once the language map is loaded
+    for(auto& job : job_list){
+        if(job.inlin || !is_directory(job.input_file))
+            continue;
+        
+        if(job.output_file == katelistings_job(job.input_file, job.language, false).output_file)
+            job.output_file = "./";
+        else
+            job.output_file += "/";
+    }
+    
       
     if(PRINT_OPT(NORMAL)){
-        std::cout << "This is katelistings, version 0.3.1\n"
+        std::cout << "This is katelistings, version " KATELISTINGS_VERSION "\n"
                   << "Written by Mattias Sjö 2021-01-26\n" 
                   << std::endl;
     }
     
+    if(run_server)
+        return katelistings_server::serve(opts);
+    
     theme_file = get_theme(theme_file);
-    highlight.parse_default_styles( theme_file, opts );
     if(overwrite_deflts)
         overwrite_defaults(theme_file, opts);
     
+    //Let a running server do the work, if there is one
+    if(use_server && !job_list.empty()){
+        int status;
+        if(katelistings_server::request({job_list, theme_file, ignore_priority, opts, n_workers, cache_dir}, status))
+            return status;
+    }
+    
+    highlight.parse_default_styles( theme_file, opts );
+    if(!cache_dir.empty())
+        highlight.use_cache(cache_dir);
+    
     std::unordered_map< std::string, util::cref_ptr<dom_element> > languages;
     std::unordered_map< std::string, std::list<std::string> > extensions;
     std::unordered_map< std::string, std::list<std::string> > glob_extensions;
@@ -344,8 +583,8 @@ int main(int argc, char** argv){
     lang_map.parse_xml("language_map.xml");
     
     load_language_map(lang_map, ignore_priority, languages, extensions, glob_extensions, opts);
-        
-    for(auto& job : job_list)
-        highlight.do_job(job, languages, extensions, glob_extensions, opts);    
+    
+    expand_directories(job_list, extensions, glob_extensions);
+    highlight.run_jobs(job_list, languages, extensions, glob_extensions, opts, n_workers);
     
 }
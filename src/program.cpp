@@ -0,0 +1,283 @@
+#include "language.hpp"
+
+#include <algorithm>
+#include <map>
+
+#define NPOS std::string::npos
+#define PROGRAM language::program
+
+struct PROGRAM::compiler {
+    program& prog;
+    
+    std::unordered_map<const context*, uint32_t> state_ids;
+    std::unordered_map<const style*, uint32_t> style_ids;
+    std::unordered_map<const context::rule_variant*, uint32_t> rule_ids;
+    std::deque<const context*> todo;
+    
+    explicit compiler(program& p) : prog(p), state_ids(), style_ids(), rule_ids(), todo() {}
+    
+    //Contexts are numbered as they are first reached, and compiled later
+    uint32_t state_id(const util::cref_ptr<context>& con){
+        if(!con)
+            return none;
+        
+        auto [it, added] = state_ids.emplace(&*con, prog.states.size());
+        if(added){
+            prog.states.emplace_back();
+            todo.push_back(&*con);
+        }
+        return it->second;
+    }
+    
+    uint32_t style_id(const util::cref_ptr<style>& st){
+        if(!st)
+            return none;
+        
+        auto [it, added] = style_ids.emplace(&*st, prog.styles.size());
+        if(added)
+            prog.styles.push_back(st);
+        return it->second;
+    }
+    
+    //Rules that several contexts include are stored once
+    uint32_t rule_id(const util::cref_ptr<context::rule_variant>& var){
+        auto [it, added] = rule_ids.emplace(&*var, prog.rules.size());
+        if(added)
+            prog.rules.push_back(*var);
+        return it->second;
+    }
+    
+    jump get_jump(const context_switch& con_sw){
+        return { static_cast<uint32_t>(con_sw.pops), state_id(con_sw.target) };
+    }
+    
+    void compile_state(const context& con, uint32_t id);
+};
+
+void PROGRAM::compiler::compile_state(const context& con, uint32_t id){
+    state st;
+    
+    st.style       = style_id(con.attribute);
+    st.end         = get_jump(con.end_context);
+    st.empty       = get_jump(con.empty_context);
+    st.fall        = get_jump(con.fall_context);
+    st.fallthrough = con.fallthrough;
+    st.groups      = con.get_groups();
+    
+    //Most bytes only see the rules that can start anywhere,
+    //so buckets with the same rules share their code
+    std::map< std::vector<uint32_t>, bucket > emitted;
+    
+    st.first_bucket = prog.buckets.size();
+    for(size_t c = 0; c < 256; ++c){
+        std::vector<uint32_t> rule_ids;
+        for(size_t i = con.dispatch_index[c]; i < con.dispatch_index[c+1]; ++i)
+            rule_ids.push_back(con.dispatch_rules[i].rule);
+        
+        auto [it, added] = emitted.emplace(rule_ids, bucket());
+        if(added){
+            it->second.begin = prog.code.size();
+            
+            for(size_t i = con.dispatch_index[c]; i < con.dispatch_index[c+1]; ++i){
+                const context::dispatch_entry& entry = con.dispatch_rules[i];
+                const auto& ref = con.rules[entry.rule];
+                
+                prog.code.push_back({ entry.kernel, rule_id(ref.rule),
+                                      style_id(ref.attribute), get_jump(context::get_rule(*ref.rule).context) });
+            }
+            
+            it->second.end = prog.code.size();
+        }
+        
+        prog.buckets.push_back(it->second);
+    }
+    
+    prog.states[id] = st;
+}
+
+void PROGRAM::compile(const language& lang){
+    states.clear();
+    code.clear();
+    buckets.clear();
+    rules.clear();
+    styles.clear();
+    
+    compiler comp(*this);
+    start = comp.state_id(lang.default_context);
+    
+    //States may be added while compiling others, so indices are used throughout
+    while(!comp.todo.empty()){
+        const context* con = comp.todo.front();
+        comp.todo.pop_front();
+        
+        comp.compile_state(*con, comp.state_ids.at(con));
+    }
+    
+    index_formats();
+}
+
+//Formats are ordered by their raw form, so that the macros do not depend on
+//the order in which the states were compiled
+void PROGRAM::index_formats(){
+    std::map<std::string, util::cref_ptr<style>> sorted;
+    for(const auto& st : styles)
+        sorted.emplace(st->raw.open, st);
+    
+    formats.clear();
+    std::unordered_map<std::string, std::string> macros;
+    for(const auto& [open, st] : sorted){
+        macros[open] = "\\" + compact_name(formats.size()) + "{";
+        formats.push_back(st);
+    }
+    
+    compact.clear();
+    for(const auto& st : styles)
+        compact[&*st] = { macros.at(st->raw.open), "}" };
+}
+
+std::string PROGRAM::compact_name(size_t idx){
+    std::string letters;
+    for(++idx; idx > 0; idx = (idx - 1) / 26)
+        letters.insert(letters.begin(), 'A' + (idx - 1) % 26);
+    
+    return "kl" + letters;
+}
+
+void PROGRAM::run(const language& lang, util::line_source& in, std::ostream& out, print_options opts) const {
+    
+    std::string_view buf;
+    size_t pos = 0;
+    
+    if(!in.next(buf))
+        return;
+    if(PRINT_OPT(ECHO_INPUT))
+        std::cout << buf << std::endl;
+    
+    //The context stack, with the groups of the match that pushed each state that
+    //its rules use. Popped frames are kept so that their buffers are reused
+    struct frame {
+        uint32_t state;
+        util::capture_set captures;
+    };
+    util::small_stack<frame, 16> stack;
+    stack.push().state = start;
+    
+    //As context_stack::switch_context, the bottom state is never popped, and
+    //switches without a match hand on the captures of the state that switches
+    auto switch_state = [&](const jump& jmp, const match_results* match){
+        size_t from = stack.size() - 1;
+        stack.pop(std::min<size_t>(jmp.pops, from));
+        
+        if(jmp.target != none){
+            frame& f = stack.push();
+            f.state = jmp.target;
+            if(match)
+                f.captures.assign(*match, states[jmp.target].groups);
+            else
+                f.captures.assign(stack[from].captures, states[jmp.target].groups);
+        }
+    };
+    
+    match_results new_match;
+    util::capture_set fall_captures;
+    
+    latex_writer writer(lang, out, opts);
+    
+    bool leading_space = true;
+    
+    //Unmatched text keeps the style it started in until the next match
+    const style* unmatched_style = nullptr;
+    
+    for(;;){
+        
+        //Handle empty lines. Like context::empty_line, only lines without any characters count
+        if(pos == 0 && buf.empty()){
+            switch_state(states[stack.top().state].empty, nullptr);
+            
+            writer.end_line();
+            if(!in.next(buf))
+                break;
+            if(PRINT_OPT(ECHO_INPUT)){
+                writer.flush();
+                std::cout << buf << std::endl;
+            }
+            
+            continue;
+        }
+        
+        //Handle end-of-line
+        if(pos >= buf.length()){
+            unmatched_style = nullptr;
+            switch_state(states[stack.top().state].end, nullptr);
+            
+            writer.end_line();
+            pos = 0;
+            if(!in.next(buf))
+                //Terminate highlighting on EOF
+                break;
+            if(PRINT_OPT(ECHO_INPUT)){
+                writer.flush();
+                std::cout << buf << std::endl;
+            }
+            
+            leading_space = true;
+            continue;
+        }
+        
+        //Run the instructions for this byte, following fallthrough switches.
+        //The rules see the captures of the state that the search started in
+        unsigned char c = buf[pos];
+        const util::capture_set* old_captures = &stack.top().captures;
+        const inst* matched = nullptr;
+        size_t match_len = NPOS;
+        
+        for(;;){
+            const state& st = states[stack.top().state];
+            const bucket& bkt = buckets[st.first_bucket + c];
+            
+            for(uint32_t pc = bkt.begin; pc < bkt.end; ++pc){
+                const inst& ins = code[pc];
+                match_len = context::match_rule(ins.op, rules[ins.rule], buf, pos,
+                                                *old_captures, new_match, leading_space);
+                if(match_len != NPOS){
+                    matched = &ins;
+                    break;
+                }
+            }
+            
+            if(matched || !st.fallthrough)
+                break;
+            
+            //Popped frames are overwritten by the next push
+            if(st.fall.pops > 0 && old_captures != &fall_captures){
+                fall_captures = *old_captures;
+                old_captures = &fall_captures;
+            }
+            switch_state(st.fall, nullptr);
+        }
+        
+        //Rules exhausted without a match: print character normally
+        if(!matched){
+            if(!unmatched_style)
+                unmatched_style = &*styles[states[stack.top().state].style];
+            
+            leading_space = !writer.write(*unmatched_style, buf[pos]) && leading_space;
+            ++pos;
+            continue;
+        }
+        
+        switch_state(matched->next, &new_match);
+        new_match.clear();
+        
+        //Non-empty (non-lookahead) match
+        if(match_len > 0){
+            unmatched_style = nullptr;
+            
+            uint32_t st = (matched->style != none) ? matched->style : states[stack.top().state].style;
+            leading_space = !writer.write(*styles[st], buf, pos, match_len) && leading_space;
+            
+            pos += match_len;
+        }
+        //Empty match: do nothing; the switch is already made
+    }
+}
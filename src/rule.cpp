@@ -1,13 +1,14 @@
 #include "language.hpp"
 
 #include "katelistings_util.hpp"
+#include "rule_types.hpp"
 
 #define NPOS std::string::npos
 #define CONTEXT language::context
 #define RULE CONTEXT::rule
 
 //Parse attributes common to all rules
-void RULE::parse_common(const dom_element& defn, const language& lang, bool allow_dynamic)
+void RULE::parse_common(const dom_element& defn, language& lang, bool allow_dynamic)
 {
     std::string attr = defn.attribute("attribute").nonempty().or_default("");
     attribute = attr.empty() ? nullptr : lang.get_style(attr, defn);
@@ -21,28 +22,23 @@ void RULE::parse_common(const dom_element& defn, const language& lang, bool allo
     
     if(!allow_dynamic && dynamic)
         defn.error("Parsing rule \"" + defn.get_name() + "\" can not be dynamic");
+    
+    kernel_flags = 0;
+    if(first_non_space || column != NPOS || lookahead)
+        kernel_flags |= KERNEL_CONSTRAINED;
+    if(dynamic)
+        kernel_flags |= KERNEL_DYNAMIC;
 }
 
-void RULE::clone_common(RULE* clone) const {
-    clone->attribute = attribute;
-    clone->context   = context;
-    clone->dynamic   = dynamic;
-    clone->lookahead = lookahead;
-    clone->first_non_space = first_non_space;
-    clone->column    = column;
-}
-
-//Attempt to match rule, delegating actual matching to match_impl for each rule type
-//Returns length of match, or NPOS if no match
-size_t RULE::match(RULE_MATCH_ARGS, bool leading_space) const {
+//Check the position constraints of a rule before delegating actual matching to match_impl 
+//for each rule type (see CTOR_AND_IMPL in rules.hpp)
+bool RULE::check_position(std::string_view buf, size_t pos, bool leading_space) const {
     if(first_non_space && (!leading_space || std::isspace(buf[pos])))
-        return NPOS;
+        return false;
     if(column != NPOS && column != pos)
-        return NPOS;
-    
-    size_t match_len = match_impl(RULE_MATCH_VALS);
+        return false;
     
-    return (!lookahead || match_len == NPOS) ? match_len : 0;
+    return true;
 }
 
 //Check if definition contains dynamic insertions, and raises error if they are malformed
@@ -61,8 +57,22 @@ bool RULE::check_dynamic(const std::string& defn, const dom_element& src){
     return is_dynamic;
 }
 
+//Finds the groups that get_dynamic would insert, which are all that the captures need to keep
+uint16_t RULE::dynamic_groups(std::string_view str){
+    uint16_t groups = 0;
+    for(size_t i = 0; i + 1 < str.length(); ++i){
+        if(str[i] == '%'){
+            ++i;
+            if(std::isdigit(str[i]))
+                groups |= 1u << (str[i] - '0');
+        }
+    }
+    
+    return groups;
+}
+
 //Do all dynamic insertions into a string
-std::string RULE::get_dynamic(const std::string& str, const std::smatch& match) {
+std::string RULE::get_dynamic(std::string_view str, const util::capture_set& captures) {
     
     std::ostringstream ost;
     
@@ -71,11 +81,8 @@ std::string RULE::get_dynamic(const std::string& str, const std::smatch& match)
             ++i;
             if(str[i] == '%')
                 ost << '%';
-            else{
-                size_t n = str[i] - '0';
-                if(n < match.size())
-                    ost << match[n];
-            }
+            else
+                ost << captures[str[i] - '0'];
         }
         else
             ost << str[i];
@@ -83,31 +90,52 @@ std::string RULE::get_dynamic(const std::string& str, const std::smatch& match)
     
     return ost.str();
 }
-        
-std::unique_ptr<RULE> CONTEXT::detect_char::init(RULE_CTOR_ARGS) {
-    parse_common(RULE_CTOR_VALS, true);
+
+//Compares str to the input at pos, optionally case-insensitively
+template<bool INS>
+static bool compare_string(std::string_view buf, size_t pos, std::string_view str){
+    if(buf.length() - pos < str.length())
+        return false;
     
-    chr = defn.attribute("char").or_error();
+    if constexpr(!INS)
+        return buf.compare(pos, str.length(), str) == 0;
     
-    if(chr.length() != 1 && !(dynamic && check_dynamic(chr, defn))){
-        defn.error("Single character expected, got \"" + chr + "\"");
+    for(size_t i = 0; i < str.length(); ++i){
+        if(std::tolower(buf[pos+i]) != std::tolower(str[i]))
+            return false;
     }
+    return true;
+}
 
-    return std::unique_ptr<RULE>(this);
+//Adds a possible first byte of a match, in both cases if the match is case-insensitive
+static void add_first_byte(std::bitset<256>& set, char c, bool ins){
+    set.set(static_cast<unsigned char>(c));
+    if(ins){
+        set.set(static_cast<unsigned char>(std::tolower(c)));
+        set.set(static_cast<unsigned char>(std::toupper(c)));
+    }
 }
-std::unique_ptr<RULE> CONTEXT::detect_char::clone() const {
-    detect_char *clone = new detect_char;
-    clone_common(clone);
+        
+void CONTEXT::detect_char::init(RULE_CTOR_ARGS) {
+    parse_common(RULE_CTOR_VALS, true);
     
-    clone->chr = chr;
+    std::string c = defn.attribute("char").or_error();
     
-    return std::unique_ptr<RULE>(clone);
+    if(c.length() != 1 && !(dynamic && check_dynamic(c, defn))){
+        defn.error("Single character expected, got \"" + c + "\"");
+    }
+    chr = lang.strings.intern(c);
 }
 size_t CONTEXT::detect_char::match_impl(RULE_MATCH_ARGS) const {
+    return dynamic ? match_flags<true,  false>(RULE_MATCH_VALS) 
+                   : match_flags<false, false>(RULE_MATCH_VALS);
+}
+template<bool DYN, bool INS>
+size_t CONTEXT::detect_char::match_flags(RULE_MATCH_ARGS) const {
     char c;
     
-    if(dynamic){
-        std::string s = get_dynamic(chr, regex_match);
+    if constexpr(DYN){
+        std::string s = get_dynamic(chr, captures);
         if(s.empty())
             c = 0;
         else
@@ -121,23 +149,19 @@ size_t CONTEXT::detect_char::match_impl(RULE_MATCH_ARGS) const {
     else
         return NPOS;
 }
+bool CONTEXT::detect_char::first_bytes(std::bitset<256>& set) const {
+    if(dynamic)
+        return false;
+    
+    set.set(static_cast<unsigned char>(chr[0]));
+    return true;
+}
 
-std::unique_ptr<RULE> CONTEXT::detect_2_chars::init(RULE_CTOR_ARGS) {
+void CONTEXT::detect_2_chars::init(RULE_CTOR_ARGS) {
     parse_common(RULE_CTOR_VALS, false);
     
     chr0 = defn.attribute("char").or_error().char_val();
     chr1 = defn.attribute("char1").or_error().char_val();
-
-    return std::unique_ptr<RULE>(this);
-}
-std::unique_ptr<RULE> CONTEXT::detect_2_chars::clone() const {
-    detect_2_chars *clone = new detect_2_chars;
-    clone_common(clone);
-    
-    clone->chr0 = chr0;
-    clone->chr1 = chr1;
-
-    return std::unique_ptr<RULE>(clone);
 }
 size_t CONTEXT::detect_2_chars::match_impl(RULE_MATCH_ARGS) const {
     if(pos+1 < buf.length() && buf[pos] == chr0 && buf[pos+1] == chr1)
@@ -145,21 +169,15 @@ size_t CONTEXT::detect_2_chars::match_impl(RULE_MATCH_ARGS) const {
     else
         return NPOS;
 }
+bool CONTEXT::detect_2_chars::first_bytes(std::bitset<256>& set) const {
+    set.set(static_cast<unsigned char>(chr0));
+    return true;
+}
 
-std::unique_ptr<RULE> CONTEXT::any_char::init(RULE_CTOR_ARGS) {
+void CONTEXT::any_char::init(RULE_CTOR_ARGS) {
     parse_common(RULE_CTOR_VALS, false);
     
-    str = defn.attribute("String").or_error();
-
-    return std::unique_ptr<RULE>(this);
-}
-std::unique_ptr<RULE> CONTEXT::any_char::clone() const {
-    any_char *clone = new any_char;
-    clone_common(clone);
-    
-    clone->str = str;
-
-    return std::unique_ptr<RULE>(clone);
+    str = lang.strings.intern(defn.attribute("String").or_error());
 }
 size_t CONTEXT::any_char::match_impl(RULE_MATCH_ARGS) const {
     if( str.find(buf[pos]) != NPOS)
@@ -167,66 +185,67 @@ size_t CONTEXT::any_char::match_impl(RULE_MATCH_ARGS) const {
     else
         return NPOS;
 }
+bool CONTEXT::any_char::first_bytes(std::bitset<256>& set) const {
+    for(char c : str)
+        set.set(static_cast<unsigned char>(c));
+    return true;
+}
 
-std::unique_ptr<RULE> CONTEXT::string_detect::init(RULE_CTOR_ARGS) {
+void CONTEXT::string_detect::init(RULE_CTOR_ARGS) {
     parse_common(RULE_CTOR_VALS, true);
     
-    str = defn.attribute("String").or_error();
+    std::string s = defn.attribute("String").or_error();
     ins = defn.attribute("insensitive").or_default("false").bool_val();
     
-    check_dynamic(str, defn);
-
-    return std::unique_ptr<RULE>(this);
-}
-std::unique_ptr<RULE> CONTEXT::string_detect::clone() const {
-    string_detect *clone = new string_detect;
-    clone_common(clone);
+    check_dynamic(s, defn);
+    str = lang.strings.intern(s);
     
-    clone->str = str;
-    clone->ins = ins;
-
-    return std::unique_ptr<RULE>(clone);
+    if(ins)
+        kernel_flags |= KERNEL_INSENSITIVE;
 }
 size_t CONTEXT::string_detect::match_impl(RULE_MATCH_ARGS) const {
-    
-//     std::cout << "\t\tMatching string \"" + str + "\"\n";
-    
-    std::string string;
     if(dynamic)
-        string = get_dynamic(str, regex_match);
+        return ins ? match_flags<true,  true>(RULE_MATCH_VALS) : match_flags<true,  false>(RULE_MATCH_VALS);
     else
-        string = str;
+        return ins ? match_flags<false, true>(RULE_MATCH_VALS) : match_flags<false, false>(RULE_MATCH_VALS);
+}
+template<bool DYN, bool INS>
+size_t CONTEXT::string_detect::match_flags(RULE_MATCH_ARGS) const {
     
-    if(ins){
-        if(util::lowercase(buf.substr(pos, string.length())) == util::lowercase(string))
-            return string.length();
-    }
-    else{
-        if(buf.compare(pos, string.length(), string) == 0)
-            return string.length();
+//     std::cout << "\t\tMatching string \"" + str + "\"\n";
+    
+    std::string dyn_string;
+    std::string_view string = str;
+    if constexpr(DYN){
+        dyn_string = get_dynamic(str, captures);
+        string = dyn_string;
     }
     
-    return NPOS;
+    return compare_string<INS>(buf, pos, string) ? string.length() : NPOS;
+}
+bool CONTEXT::string_detect::first_bytes(std::bitset<256>& set) const {
+    if(dynamic || str.empty())
+        return false;
+    
+    add_first_byte(set, str[0], ins);
+    return true;
 }
 
-std::unique_ptr<RULE> CONTEXT::word_detect::init(RULE_CTOR_ARGS) {
+void CONTEXT::word_detect::init(RULE_CTOR_ARGS) {
     parse_common(RULE_CTOR_VALS, false);
     
-    str = defn.attribute("String").or_error();
+    str = lang.strings.intern(defn.attribute("String").or_error());
     ins = defn.attribute("insensitive").or_default("false").bool_val();
-
-    return std::unique_ptr<RULE>(this);
-}
-std::unique_ptr<RULE> CONTEXT::word_detect::clone() const {
-    word_detect *clone = new word_detect;
-    clone_common(clone);
     
-    clone->str = str;
-    clone->ins = ins;
-
-    return std::unique_ptr<RULE>(clone);
+    if(ins)
+        kernel_flags |= KERNEL_INSENSITIVE;
 }
 size_t CONTEXT::word_detect::match_impl(RULE_MATCH_ARGS) const {
+    return ins ? match_flags<false, true> (RULE_MATCH_VALS) 
+               : match_flags<false, false>(RULE_MATCH_VALS);
+}
+template<bool DYN, bool INS>
+size_t CONTEXT::word_detect::match_flags(RULE_MATCH_ARGS) const {
     //Check for word boundary
     if( util::word_char(buf, pos-1) )
         return NPOS;
@@ -234,62 +253,123 @@ size_t CONTEXT::word_detect::match_impl(RULE_MATCH_ARGS) const {
         return NPOS;
     
     //Check for match, like string_detect
-    if(ins){
-        if(util::lowercase(buf.substr(pos, str.length())) == util::lowercase(str))
-            return str.length();
-    }
-    else{
-        if(buf.compare(pos, str.length(), str) == 0)
-            return str.length();
-    }
+    return compare_string<INS>(buf, pos, str) ? str.length() : NPOS;
+}
+bool CONTEXT::word_detect::first_bytes(std::bitset<256>& set) const {
+    if(str.empty())
+        return false;
     
-    return NPOS;
+    add_first_byte(set, str[0], ins);
+    return true;
 }
 
-std::unique_ptr<RULE> CONTEXT::reg_expr::init(RULE_CTOR_ARGS) {
+void CONTEXT::reg_expr::init(RULE_CTOR_ARGS) {
     parse_common(RULE_CTOR_VALS, true);
     
-    str = defn.attribute("String").or_error();
+    std::string s = defn.attribute("String").or_error();
     ins = defn.attribute("insensitive").or_default("false").bool_val();
     
+    str = lang.strings.intern(s);
+    
+    //Dynamic patterns are compiled on first use, see get_dynamic_regex
+    lang.regexes.emplace_back();
+    compiled& comp = lang.regexes.back();
     if(dynamic)
-        check_dynamic(str, defn);
-
-    return std::unique_ptr<RULE>(this);
+        check_dynamic(s, defn);
+    else
+        comp.valid = compile(s, ins, comp.regex);
+    
+    pattern = comp;
 }
-std::unique_ptr<RULE> CONTEXT::reg_expr::clone() const {
-    reg_expr *clone = new reg_expr;
-    clone_common(clone);
+CONTEXT::reg_expr::reg_expr(const std::string& regexp, language& lang)
+: RULE(), str(lang.strings.intern(regexp)), ins(false), pattern(nullptr)
+{
+    lang.regexes.emplace_back();
+    compiled& comp = lang.regexes.back();
+    comp.valid = compile(regexp, ins, comp.regex);
     
-    clone->str = str;
-    clone->ins = ins;
-
-    return std::unique_ptr<RULE>(clone);
+    pattern = comp;
 }
 size_t CONTEXT::reg_expr::match_impl(RULE_MATCH_ARGS) const {
+    return dynamic ? match_flags<true,  false>(RULE_MATCH_VALS) 
+                   : match_flags<false, false>(RULE_MATCH_VALS);
+}
+//Case-insensitivity is compiled into the pattern, so INS is not used
+template<bool DYN, bool INS>
+size_t CONTEXT::reg_expr::match_flags(RULE_MATCH_ARGS) const {
 //     std::cout << "\t\ttrying to match \"" << str << "\" against \"" << buf.substr(pos) << "\"\n";
     
+    std::shared_ptr<const util::kate_regex> dynamic_regex;
+    const util::kate_regex* re;
+    if constexpr(DYN){
+        dynamic_regex = get_dynamic_regex(get_dynamic(str, captures));
+        re = dynamic_regex.get();
+    }
+    else
+        re = pattern->valid ? &pattern->regex : nullptr;
+    if(!re)
+        return NPOS;
+    
+    //Only try matching at pos, but let \b and lookbehinds see the preceding characters
+    if(re->match_at(buf, pos, new_match))
+        return new_match.length();
+    else
+        return NPOS;
+}
+bool CONTEXT::reg_expr::first_bytes(std::bitset<256>& set) const {
+    if(dynamic)
+        return false;
+    
+    //A malformed pattern never matches
+    if(!pattern->valid)
+        return true;
+    
+    std::bitset<256> first;
+    if(!pattern->regex.first_bytes(first))
+        return false;
+    
+    set |= first;
+    return true;
+}
+
+//Compiles a pattern, reporting malformed ones. Returns true on success
+bool CONTEXT::reg_expr::compile(const std::string& pattern, bool ins, util::kate_regex& regex){
     try{
-        std::regex regex = std::regex(dynamic ? get_dynamic(str, regex_match) : str, 
-                                    ins ? (std::regex::ECMAScript | std::regex::icase) : std::regex::ECMAScript
-                                );
-        //TODO: force regex to match starting at pos
-        std::string match_str = buf.substr(pos);
-        if(regex_search(match_str, new_match, regex) && new_match.position() == 0)
-            return new_match.length();
-        else
-            return NPOS;
+        regex = util::kate_regex(pattern, ins);
+        return true;
         
-    } catch(const std::regex_error&){
-        std::cout << "Malformed regex: \"" << str << "\"\n";
-        return NPOS;
+    } catch(const util::kate_regex::error& err){
+        std::cout << "Malformed regex: \"" << pattern << "\" (" << err.what() << ")\n";
+        return false;
     }
 }
 
-std::unique_ptr<RULE> CONTEXT::keyword::init(RULE_CTOR_ARGS) {
+//Looks up a substituted dynamic pattern, compiling it if it has not been seen before.
+//The cache is simply flushed when full, since dynamic rules rarely see many distinct patterns
+std::shared_ptr<const util::kate_regex> CONTEXT::reg_expr::get_dynamic_regex(const std::string& pat) const {
+    auto& cache = pattern->dynamic_cache;
+    std::lock_guard<std::mutex> guard(pattern->dynamic_lock);
+    
+    auto it = cache.find(pat);
+    if(it != cache.end())
+        return it->second;
+    
+    if(cache.size() >= max_dynamic_cache)
+        cache.clear();
+    
+    std::shared_ptr<util::kate_regex> re = std::make_shared<util::kate_regex>();
+    if(!compile(pat, ins, *re))
+        re = nullptr;
+    
+    return cache.emplace(pat, std::move(re)).first->second;
+}
+
+void CONTEXT::keyword::init(RULE_CTOR_ARGS) {
     parse_common(RULE_CTOR_VALS, false);
     
     ins = !lang.case_sensitive;
+    if(ins)
+        kernel_flags |= KERNEL_INSENSITIVE;
     
     std::string key = defn.attribute("String").or_error();
     list_name = key;
@@ -299,32 +379,22 @@ std::unique_ptr<RULE> CONTEXT::keyword::init(RULE_CTOR_ARGS) {
         defn.error("Undefined keyword list \"" + key + "\"");
     
     keywords = &(it->second);
-
-    return std::unique_ptr<RULE>(this);
-}
-std::unique_ptr<RULE> CONTEXT::keyword::clone() const {
-    keyword *clone = new keyword;
-    clone_common(clone);
-    
-    clone->list_name = list_name;
-    clone->keywords = keywords;
-
-    return std::unique_ptr<RULE>(clone);
 }
 size_t CONTEXT::keyword::match_impl(RULE_MATCH_ARGS) const {
-    return keywords->match(buf, pos);
+    return ins ? match_flags<false, true> (RULE_MATCH_VALS) 
+               : match_flags<false, false>(RULE_MATCH_VALS);
+}
+template<bool DYN, bool INS>
+size_t CONTEXT::keyword::match_flags(RULE_MATCH_ARGS) const {
+    return keywords->match(buf, pos, INS);
+}
+bool CONTEXT::keyword::first_bytes(std::bitset<256>& set) const {
+    keywords->first_bytes(set, ins);
+    return true;
 }
 
-std::unique_ptr<RULE> CONTEXT::rint::init(RULE_CTOR_ARGS) {
+void CONTEXT::rint::init(RULE_CTOR_ARGS) {
     parse_common(RULE_CTOR_VALS, false);
-
-    return std::unique_ptr<RULE>(this);
-}
-std::unique_ptr<RULE> CONTEXT::rint::clone() const {
-    rint *clone = new rint;
-    clone_common(clone);
-    
-    return std::unique_ptr<RULE>(clone);
 }
 size_t CONTEXT::rint::match_impl(RULE_MATCH_ARGS) const {
     //Hand-coded regex \b[0-9]+
@@ -338,17 +408,14 @@ size_t CONTEXT::rint::match_impl(RULE_MATCH_ARGS) const {
     
     return len;
 }
+bool CONTEXT::rint::first_bytes(std::bitset<256>& set) const {
+    for(char c = '0'; c <= '9'; ++c)
+        set.set(c);
+    return true;
+}
 
-std::unique_ptr<RULE> CONTEXT::rfloat::init(RULE_CTOR_ARGS) {
+void CONTEXT::rfloat::init(RULE_CTOR_ARGS) {
     parse_common(RULE_CTOR_VALS, false);
-
-    return std::unique_ptr<RULE>(this);
-}
-std::unique_ptr<RULE> CONTEXT::rfloat::clone() const {
-    rfloat *clone = new rfloat;
-    clone_common(clone);
-    
-    return std::unique_ptr<RULE>(clone);
 }
 size_t CONTEXT::rfloat::match_impl(RULE_MATCH_ARGS) const {
     //Hand-coded regex (\b[0-9]+\.[0-9]*|\.[0-9]+)([eE][-+]?[0-9]+)?
@@ -372,7 +439,7 @@ size_t CONTEXT::rfloat::match_impl(RULE_MATCH_ARGS) const {
         while( pos+len < buf.length() && std::isalnum(buf[pos+len])  )
             ++len;
         
-        if(buf[pos+len] != '.')
+        if(pos+len >= buf.length() || buf[pos+len] != '.')
             return NPOS;
         
         ++len;
@@ -395,17 +462,15 @@ size_t CONTEXT::rfloat::match_impl(RULE_MATCH_ARGS) const {
     
     return len;
 }
+bool CONTEXT::rfloat::first_bytes(std::bitset<256>& set) const {
+    for(char c = '0'; c <= '9'; ++c)
+        set.set(c);
+    set.set('.');
+    return true;
+}
 
-std::unique_ptr<RULE> CONTEXT::hlc_oct::init(RULE_CTOR_ARGS) {
+void CONTEXT::hlc_oct::init(RULE_CTOR_ARGS) {
     parse_common(RULE_CTOR_VALS, false);
-
-    return std::unique_ptr<RULE>(this);
-}
-std::unique_ptr<RULE> CONTEXT::hlc_oct::clone() const {
-    hlc_oct *clone = new hlc_oct;
-    clone_common(clone);
-    
-    return std::unique_ptr<RULE>(clone);
 }
 size_t CONTEXT::hlc_oct::match_impl(RULE_MATCH_ARGS) const {
     //Hand-coded regex \b0[0-7]+
@@ -420,17 +485,13 @@ size_t CONTEXT::hlc_oct::match_impl(RULE_MATCH_ARGS) const {
     
     return len;
 }
+bool CONTEXT::hlc_oct::first_bytes(std::bitset<256>& set) const {
+    set.set('0');
+    return true;
+}
 
-std::unique_ptr<RULE> CONTEXT::hlc_hex::init(RULE_CTOR_ARGS) {
+void CONTEXT::hlc_hex::init(RULE_CTOR_ARGS) {
     parse_common(RULE_CTOR_VALS, false);
-
-    return std::unique_ptr<RULE>(this);
-}
-std::unique_ptr<RULE> CONTEXT::hlc_hex::clone() const {
-    hlc_hex *clone = new hlc_hex;
-    clone_common(clone);
-    
-    return std::unique_ptr<RULE>(clone);
 }
 size_t CONTEXT::hlc_hex::match_impl(RULE_MATCH_ARGS) const {
     //Hand-coded regex \b0[0-7]+
@@ -445,9 +506,13 @@ size_t CONTEXT::hlc_hex::match_impl(RULE_MATCH_ARGS) const {
     
     return len;
 }
+bool CONTEXT::hlc_hex::first_bytes(std::bitset<256>& set) const {
+    set.set('0');
+    return true;
+}
 
 //Auxiliary function to hlc_char and hlc_string_char
-size_t hlc_char_match(const std::string& buf, size_t pos){
+size_t hlc_char_match(std::string_view buf, size_t pos){
     //Matches all C character escape sequences (including \e)
     
     if(pos+2 >= buf.length() || buf[pos] != '\\')
@@ -483,6 +548,8 @@ size_t hlc_char_match(const std::string& buf, size_t pos){
             if(false){  //Yay, evil case fallthrough hacking!
         case 'U': len = 8;
             }
+            if(pos+2+len > buf.length())
+                return NPOS;
             for(size_t i = 0; i < len; i++){
                 if(!std::isxdigit(buf[pos+2+i]))
                     return NPOS;
@@ -490,7 +557,7 @@ size_t hlc_char_match(const std::string& buf, size_t pos){
             return len + 2;
             
         default:
-            for(len = 0; len <= 3; ++len){
+            for(len = 0; len <= 3 && pos+1+len < buf.length(); ++len){
                 if(buf[pos+1+len] < '0' || buf[pos+1+len] > '8')
                     break;
             }
@@ -502,31 +569,19 @@ size_t hlc_char_match(const std::string& buf, size_t pos){
     }
 }
 
-std::unique_ptr<RULE> CONTEXT::hlc_string_char::init(RULE_CTOR_ARGS) {
+void CONTEXT::hlc_string_char::init(RULE_CTOR_ARGS) {
     parse_common(RULE_CTOR_VALS, false);
-
-    return std::unique_ptr<RULE>(this);
-}
-std::unique_ptr<RULE> CONTEXT::hlc_string_char::clone() const {
-    hlc_string_char *clone = new hlc_string_char;
-    clone_common(clone);
-    
-    return std::unique_ptr<RULE>(clone);
 }
 size_t CONTEXT::hlc_string_char::match_impl(RULE_MATCH_ARGS) const {
     return hlc_char_match(buf, pos);
 }
+bool CONTEXT::hlc_string_char::first_bytes(std::bitset<256>& set) const {
+    set.set('\\');
+    return true;
+}
 
-std::unique_ptr<RULE> CONTEXT::hlc_char::init(RULE_CTOR_ARGS) {
+void CONTEXT::hlc_char::init(RULE_CTOR_ARGS) {
     parse_common(RULE_CTOR_VALS, false);
-
-    return std::unique_ptr<RULE>(this);
-}
-std::unique_ptr<RULE> CONTEXT::hlc_char::clone() const {
-    hlc_char *clone = new hlc_char;
-    clone_common(clone);
-    
-    return std::unique_ptr<RULE>(clone);
 }
 size_t CONTEXT::hlc_char::match_impl(RULE_MATCH_ARGS) const {
     if(pos+2 >= buf.length() || buf[pos] != '\'')
@@ -543,23 +598,16 @@ size_t CONTEXT::hlc_char::match_impl(RULE_MATCH_ARGS) const {
             return len+2;
     }
 }
+bool CONTEXT::hlc_char::first_bytes(std::bitset<256>& set) const {
+    set.set('\'');
+    return true;
+}
 
-std::unique_ptr<RULE> CONTEXT::range_detect::init(RULE_CTOR_ARGS) {
+void CONTEXT::range_detect::init(RULE_CTOR_ARGS) {
     parse_common(RULE_CTOR_VALS, false);
     
     chr0 = defn.attribute("char").or_error().char_val();
     chr1 = defn.attribute("char1").or_error().char_val();
-
-    return std::unique_ptr<RULE>(this);
-}
-std::unique_ptr<RULE> CONTEXT::range_detect::clone() const {
-    range_detect *clone = new range_detect;
-    clone_common(clone);
-    
-    clone->chr0 = chr0;
-    clone->chr1 = chr1;
-    
-    return std::unique_ptr<RULE>(clone);
 }
 size_t CONTEXT::range_detect::match_impl(RULE_MATCH_ARGS) const {
     if(buf[pos] != chr0)
@@ -571,73 +619,161 @@ size_t CONTEXT::range_detect::match_impl(RULE_MATCH_ARGS) const {
     }
     return NPOS;
 }
+bool CONTEXT::range_detect::first_bytes(std::bitset<256>& set) const {
+    set.set(static_cast<unsigned char>(chr0));
+    return true;
+}
 
-std::unique_ptr<RULE> CONTEXT::line_continue::init(RULE_CTOR_ARGS) {
+void CONTEXT::line_continue::init(RULE_CTOR_ARGS) {
     parse_common(RULE_CTOR_VALS, false);
     
     chr = defn.attribute("char").or_default("\\").char_val();
-
-    return std::unique_ptr<RULE>(this);
 }
-std::unique_ptr<RULE> CONTEXT::line_continue::clone() const {
-    line_continue *clone = new line_continue;
-    clone_common(clone);
-    
-    clone->chr = chr;
-    
-    return std::unique_ptr<RULE>(clone);
-} 
 size_t CONTEXT::line_continue::match_impl(RULE_MATCH_ARGS) const {
     if(pos == buf.length() - 1 && buf[pos] == chr)
         return 1;
     else
         return NPOS;
 }
+bool CONTEXT::line_continue::first_bytes(std::bitset<256>& set) const {
+    set.set(static_cast<unsigned char>(chr));
+    return true;
+}
 
-std::unique_ptr<RULE> CONTEXT::detect_spaces::init(RULE_CTOR_ARGS) {
+void CONTEXT::detect_spaces::init(RULE_CTOR_ARGS) {
     parse_common(RULE_CTOR_VALS, false);
-
-    return std::unique_ptr<RULE>(this);
-}
-std::unique_ptr<RULE> CONTEXT::detect_spaces::clone() const {
-    detect_spaces *clone = new detect_spaces;
-    clone_common(clone);
-   
-    return std::unique_ptr<RULE>(clone);
 }
 size_t CONTEXT::detect_spaces::match_impl(RULE_MATCH_ARGS) const {
     //Hand-coded regex \s+
     
-    if(!std::isspace(buf[pos]))
+    if(!std::isspace(static_cast<unsigned char>(buf[pos])))
         return NPOS;
     
     size_t len = 1;
-    while(pos+len < buf.length() && std::isspace(buf[pos+len]))
+    while(pos+len < buf.length() && std::isspace(static_cast<unsigned char>(buf[pos+len])))
         ++len;
     return len;
 }
+bool CONTEXT::detect_spaces::first_bytes(std::bitset<256>& set) const {
+    for(int c = 0; c < 256; ++c){
+        if(std::isspace(c))
+            set.set(c);
+    }
+    return true;
+}
 
-std::unique_ptr<RULE> CONTEXT::detect_identifier::init(RULE_CTOR_ARGS) {
+void CONTEXT::detect_identifier::init(RULE_CTOR_ARGS) {
     parse_common(RULE_CTOR_VALS, false);
-
-    return std::unique_ptr<RULE>(this);
-}
-std::unique_ptr<RULE> CONTEXT::detect_identifier::clone() const {
-    detect_identifier *clone = new detect_identifier;
-    clone_common(clone);
-    
-    return std::unique_ptr<RULE>(clone);
 }
 size_t CONTEXT::detect_identifier::match_impl(RULE_MATCH_ARGS) const {
     //Hand-coded regex [a-zA-Z_][a-zA-Z0-9_]*
    
-    if(!std::isalpha(buf[pos]) && buf[pos] != '_')
+    if(!std::isalpha(static_cast<unsigned char>(buf[pos])) && buf[pos] != '_')
         return NPOS;
     
     size_t len = 1;
-    while(pos+len < buf.length() && (std::isalnum(buf[pos+len]) || buf[pos+len] == '_'))
+    while(pos+len < buf.length() && (std::isalnum(static_cast<unsigned char>(buf[pos+len])) || buf[pos+len] == '_'))
         ++len;
     return len;
 }
+bool CONTEXT::detect_identifier::first_bytes(std::bitset<256>& set) const {
+    for(int c = 0; c < 256; ++c){
+        if(std::isalpha(c) || c == '_')
+            set.set(c);
+    }
+    return true;
+}
+
+//A matcher for one rule type and combination of flags. The common case
+//(static, case-sensitive and unconstrained) has no flag tests at all.
+template<typename R, bool CONSTRAINED, bool DYN, bool INS>
+size_t CONTEXT::match_kernel(const rule_variant& var, RULE_MATCH_ARGS, bool leading_space){
+    const R& r = *std::get_if<R>(&var);
+    
+    if constexpr(CONSTRAINED){
+        if(!r.check_position(buf, pos, leading_space))
+            return NPOS;
+    }
+    
+    size_t match_len;
+    if constexpr(R::has_match_flags)
+        match_len = r.template match_flags<DYN, INS>(RULE_MATCH_VALS);
+    else
+        match_len = r.match_impl(RULE_MATCH_VALS);
+    
+    if constexpr(CONSTRAINED)
+        return r.check_lookahead(match_len);
+    else
+        return match_len;
+}
+
+#define KERNEL_CASE(NN, C, D, I)                                                \
+        case kernel_id(rule_type::NN, (C ? rule::KERNEL_CONSTRAINED : 0)        \
+                                    | (D ? rule::KERNEL_DYNAMIC     : 0)        \
+                                    | (I ? rule::KERNEL_INSENSITIVE : 0)):      \
+        return match_kernel<NN, C, D, I>(var, RULE_MATCH_VALS, leading_space);
+
+//The flag combinations that each rule type can have
+#define PLAIN_KERNELS(NN)                                                       \
+        KERNEL_CASE(NN, false, false, false)                                    \
+        KERNEL_CASE(NN, true,  false, false)
+#define DYNAMIC_KERNELS(NN)                                                     \
+        PLAIN_KERNELS(NN)                                                       \
+        KERNEL_CASE(NN, false, true,  false)                                    \
+        KERNEL_CASE(NN, true,  true,  false)
+#define INS_KERNELS(NN)                                                         \
+        PLAIN_KERNELS(NN)                                                       \
+        KERNEL_CASE(NN, false, false, true)                                     \
+        KERNEL_CASE(NN, true,  false, true)
+#define DYNAMIC_INS_KERNELS(NN)                                                 \
+        DYNAMIC_KERNELS(NN)                                                     \
+        KERNEL_CASE(NN, false, false, true)                                     \
+        KERNEL_CASE(NN, true,  false, true)                                     \
+        KERNEL_CASE(NN, false, true,  true)                                     \
+        KERNEL_CASE(NN, true,  true,  true)
+
+//Attempt to match rule with the kernel selected when the context was parsed (see build_dispatch)
+//Returns length of match, or NPOS if no match
+size_t CONTEXT::match_rule(uint32_t kernel, const rule_variant& var, RULE_MATCH_ARGS, bool leading_space){
+    switch(kernel){
+        PLAIN_KERNELS(any_char)
+        DYNAMIC_KERNELS(detect_char)
+        PLAIN_KERNELS(detect_2_chars)
+        PLAIN_KERNELS(detect_spaces)
+        PLAIN_KERNELS(detect_identifier)
+        PLAIN_KERNELS(rfloat)
+        PLAIN_KERNELS(rint)
+        PLAIN_KERNELS(hlc_oct)
+        PLAIN_KERNELS(hlc_hex)
+        PLAIN_KERNELS(hlc_string_char)
+        PLAIN_KERNELS(hlc_char)
+        DYNAMIC_INS_KERNELS(string_detect)
+        INS_KERNELS(word_detect)
+        PLAIN_KERNELS(range_detect)
+        INS_KERNELS(keyword)
+        DYNAMIC_KERNELS(reg_expr)
+        PLAIN_KERNELS(line_continue)
+        
+        default: return match_rule(var, RULE_MATCH_VALS, leading_space);
+    }
+}
+
+#undef KERNEL_CASE
+#undef PLAIN_KERNELS
+#undef DYNAMIC_KERNELS
+#undef INS_KERNELS
+#undef DYNAMIC_INS_KERNELS
 
+#define RULE_CASE(NN)                                                   \
+        case rule_type::NN:                                             \
+        return std::get_if<NN>(&var)->match(RULE_MATCH_VALS, leading_space);
 
+//Attempt to match rule, testing its flags at runtime
+//Returns length of match, or NPOS if no match
+size_t CONTEXT::match_rule(const rule_variant& var, RULE_MATCH_ARGS, bool leading_space){
+    switch(var.index()){
+        ALL_RULE_CASES
+        default: return NPOS;
+    }
+}
+#undef RULE_CASE
@@ -0,0 +1,598 @@
+#include "server.hpp"
+#include "build_id.hpp"
+
+#include <chrono>
+#include <csignal>
+#include <cstring>
+
+#include <climits>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace katelistings_server {
+
+using server_clock = std::chrono::steady_clock;
+
+//Bumped whenever the request format changes. Requests also carry the build id,
+//as a server of another build would not produce the same output
+static constexpr uint32_t protocol_version = 5;
+
+/* ---------------------------------------------------------------------- */
+/*  Request encoding                                                      */
+/* ---------------------------------------------------------------------- */
+
+static void put(std::string& buf, uint32_t val){
+    buf.append(reinterpret_cast<const char*>(&val), sizeof(val));
+}
+static void put(std::string& buf, const std::string& str){
+    put(buf, static_cast<uint32_t>(str.size()));
+    buf += str;
+}
+
+struct request_reader {
+    const std::string& buf;
+    size_t pos;
+    bool ok;
+    
+    explicit request_reader(const std::string& b) : buf(b), pos(0), ok(true) {}
+    
+    uint32_t get_int(){
+        uint32_t val = 0;
+        if(buf.size() - pos < sizeof(val)){
+            ok = false;
+            return 0;
+        }
+        std::memcpy(&val, buf.data() + pos, sizeof(val));
+        pos += sizeof(val);
+        return val;
+    }
+    std::string get_string(){
+        uint32_t len = get_int();
+        if(buf.size() - pos < len){
+            ok = false;
+            return "";
+        }
+        pos += len;
+        return buf.substr(pos - len, len);
+    }
+};
+
+//Paths are sent as given, together with the directory of the client that they are
+//relative to. The worker runs there, so that its messages are those of a local run
+static std::string encode(const katelistings_request& req, const std::string& cwd){
+    std::string buf;
+    put(buf, protocol_version);
+    put(buf, std::string(KATELISTINGS_BUILD_ID));
+    put(buf, cwd);
+    put(buf, req.theme_file);
+    put(buf, req.ignore_priority ? 1 : 0);
+    put(buf, static_cast<uint32_t>(req.opts));
+    put(buf, static_cast<uint32_t>(req.n_workers));
+    put(buf, req.cache_dir);
+    
+    put(buf, static_cast<uint32_t>(req.jobs.size()));
+    for(const katelistings_job& job : req.jobs){
+        put(buf, job.input_file);
+        put(buf, job.output_file);
+        put(buf, job.language);
+        put(buf, job.inlin ? 1 : 0);
+    }
+    
+    return buf;
+}
+
+static bool decode(const std::string& buf, katelistings_request& req, std::string& cwd){
+    request_reader in(buf);
+    
+    if(in.get_int() != protocol_version || in.get_string() != KATELISTINGS_BUILD_ID)
+        return false;
+    
+    cwd                 = in.get_string();
+    req.theme_file      = in.get_string();
+    req.ignore_priority = in.get_int();
+    req.opts            = static_cast<print_options>(in.get_int());
+    req.n_workers       = in.get_int();
+    req.cache_dir       = in.get_string();
+    
+    size_t n_jobs = in.get_int();
+    for(size_t i = 0; in.ok && i < n_jobs; ++i){
+        katelistings_job job;
+        job.input_file  = in.get_string();
+        job.output_file = in.get_string();
+        job.language    = in.get_string();
+        job.inlin       = in.get_int();
+        req.jobs.push_back(job);
+    }
+    
+    return in.ok && in.pos == buf.size();
+}
+
+/* ---------------------------------------------------------------------- */
+/*  Socket helpers                                                        */
+/* ---------------------------------------------------------------------- */
+
+static sockaddr_un address(){
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    return addr;
+}
+
+static int connect_server(){
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(sock < 0)
+        return -1;
+    
+    sockaddr_un addr = address();
+    if(connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0){
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static bool write_all(int fd, const void* data, size_t len){
+    const char* ptr = static_cast<const char*>(data);
+    while(len > 0){
+        ssize_t n = write(fd, ptr, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        
+        ptr += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void* data, size_t len){
+    char* ptr = static_cast<char*>(data);
+    while(len > 0){
+        ssize_t n = read(fd, ptr, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        
+        ptr += n;
+        len -= n;
+    }
+    return true;
+}
+
+//The length of the request is sent together with the standard streams of the client
+static bool send_request(int sock, const std::string& body, const int (&fds)[3]){
+    uint32_t len = body.size();
+    iovec iov = { &len, sizeof(len) };
+    
+    char control[CMSG_SPACE(sizeof(fds))];
+    std::memset(control, 0, sizeof(control));
+    
+    msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    
+    if(sendmsg(sock, &msg, 0) != sizeof(len))
+        return false;
+    
+    return write_all(sock, body.data(), body.size());
+}
+
+static bool receive_request(int sock, std::string& body, int (&fds)[3]){
+    uint32_t len;
+    iovec iov = { &len, sizeof(len) };
+    
+    char control[CMSG_SPACE(sizeof(fds))];
+    msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    
+    if(recvmsg(sock, &msg, 0) != sizeof(len))
+        return false;
+    
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if(!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+        return false;
+    std::memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    
+    body.resize(len);
+    if(read_all(sock, body.data(), len))
+        return true;
+    
+    for(int fd : fds)
+        close(fd);
+    return false;
+}
+
+/* ---------------------------------------------------------------------- */
+/*  Server                                                                */
+/* ---------------------------------------------------------------------- */
+
+//Everything that is kept resident between requests
+struct server_state {
+    print_options opts;
+    
+    dom_element lang_map_file;
+    std::unordered_map< std::string, util::cref_ptr<dom_element> > lang_map;
+    std::unordered_map< std::string, std::list<std::string> > extensions;
+    std::unordered_map< std::string, std::list<std::string> > glob_extensions;
+    
+    //One instance per theme, since styles are resolved when languages are loaded
+    std::unordered_map< std::string, latex_highlight > highlights;
+    
+    //Modification times of the files that the resident data was loaded from
+    std::unordered_map< std::string, time_t > watched;
+    
+    explicit server_state(print_options o) : opts(o) { load_map(); }
+    
+    static time_t mtime(const std::string& path){
+        struct stat st;
+        return (stat(path.c_str(), &st) == 0) ? st.st_mtime : 0;
+    }
+    
+    void watch(const std::string& path){
+        watched.emplace(path, mtime(path));
+    }
+    
+    void load_map(){
+        lang_map.clear();
+        extensions.clear();
+        glob_extensions.clear();
+        
+        lang_map_file = dom_element();
+        lang_map_file.parse_xml("language_map.xml");
+        load_language_map(lang_map_file, false, lang_map, extensions, glob_extensions, QUIET);
+        watch("language_map.xml");
+    }
+    
+    //Drops everything if a syntax file, theme or the language map has changed
+    void refresh(){
+        for(const auto& [path, time] : watched){
+            if(mtime(path) == time)
+                continue;
+            
+            if(PRINT_OPT(NORMAL))
+                std::cout << "\"" << path << "\" has changed, reloading\n";
+            
+            highlights.clear();
+            watched.clear();
+            load_map();
+            return;
+        }
+    }
+    
+    latex_highlight& get_highlight(const std::string& theme_file){
+        auto [it, added] = highlights.try_emplace(theme_file);
+        if(added){
+            it->second.parse_default_styles(theme_file, QUIET);
+            watch(theme_file);
+        }
+        return it->second;
+    }
+    
+    //Loads the languages that a worker has used, which are known to parse
+    void adopt(const std::string& theme_file, const std::string& names){
+        latex_highlight& highlight = get_highlight(theme_file);
+        
+        size_t start = 0;
+        for(size_t end; (end = names.find('\n', start)) != std::string::npos; start = end+1){
+            std::string name = names.substr(start, end - start);
+            
+            highlight.preload_language(name, lang_map, QUIET);
+            
+            auto it = lang_map.find(name);
+            if(it != lang_map.end())
+                watch(it->second->attribute("path").or_error());
+        }
+    }
+};
+
+//Runs in the forked worker, with the standard streams and directory of the client
+static int run_worker(server_state& state, katelistings_request& req, const std::string& cwd, int report_fd){
+    if(chdir(cwd.c_str()) != 0){
+        std::cerr << "ERROR: Unable to enter \"" << cwd << "\": " << std::strerror(errno) << "\n";
+        return EXIT_FAILURE;
+    }
+    
+    latex_highlight& highlight = state.get_highlight(req.theme_file);
+    
+    if(req.ignore_priority){
+        state.extensions.clear();
+        state.glob_extensions.clear();
+        load_language_map(state.lang_map_file, true, state.lang_map,
+                          state.extensions, state.glob_extensions, req.opts);
+    }
+    
+    if(!req.cache_dir.empty())
+        highlight.use_cache(req.cache_dir);
+    
+    expand_directories(req.jobs, state.extensions, state.glob_extensions);
+    highlight.run_jobs(req.jobs, state.lang_map, state.extensions, state.glob_extensions,
+                       req.opts, req.n_workers);
+    
+    //Tell the server what was loaded, so that the next request does not have to
+    std::string names;
+    for(const std::string& name : highlight.loaded_languages())
+        names += name + "\n";
+    write_all(report_fd, names.data(), names.size());
+    
+    return EXIT_SUCCESS;
+}
+
+//A request that a forked worker is running. The client waits for its exit status
+struct worker {
+    size_t number;
+    pid_t pid;
+    int conn;
+    int report;                 //Read end of the pipe that the worker reports on
+    std::string names;          //What it has reported so far, see server_state::adopt
+    std::string theme_file;
+    size_t n_jobs;
+    server_clock::time_point start;
+};
+
+static pid_t server_pid = 0;
+
+//Written to by the signal handlers, so that the server wakes up and stops
+static int stop_pipe[2] = { -1, -1 };
+
+//Workers reset the handlers when forked, but could be signalled before that.
+//Only the server itself may stop serving
+static void shutdown(int){
+    if(getpid() != server_pid)
+        _exit(EXIT_FAILURE);
+    
+    char byte = 0;
+    ssize_t n = write(stop_pipe[1], &byte, 1);
+    (void) n;
+}
+
+//Only the owner of the server may have it write files on their behalf
+static bool same_user(int conn){
+    ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+}
+
+//Accepts a request and forks a worker for it. Returns false if there was none
+static bool start_worker(server_state& state, int listener, std::list<worker>& workers, size_t number){
+    print_options opts = state.opts;
+    
+    int conn = accept(listener, nullptr, nullptr);
+    if(conn < 0)
+        return false;
+    
+    std::string body, cwd;
+    int fds[3];
+    katelistings_request req;
+    
+    if(!same_user(conn) || !receive_request(conn, body, fds)){
+        close(conn);
+        return false;
+    }
+    //The client runs the jobs itself when the connection is closed
+    if(!decode(body, req, cwd)){
+        if(PRINT_OPT(NORMAL))
+            std::cout << "Ignoring a malformed request, or one of another build" << std::endl;
+        for(int fd : fds)
+            close(fd);
+        close(conn);
+        return false;
+    }
+    
+    state.refresh();
+    
+    int report[2];
+    if(pipe(report) != 0){
+        for(int fd : fds)
+            close(fd);
+        close(conn);
+        return false;
+    }
+    
+    //Anything buffered would otherwise be written by the worker as well
+    std::cout.flush();
+    pid_t pid = fork();
+    if(pid == 0){
+        //A worker is stopped by signals like a local run, and reported as failed
+        std::signal(SIGPIPE, SIG_DFL);
+        std::signal(SIGINT,  SIG_DFL);
+        std::signal(SIGTERM, SIG_DFL);
+        
+        close(listener);
+        close(stop_pipe[0]);
+        close(stop_pipe[1]);
+        for(const worker& other : workers){
+            close(other.conn);
+            close(other.report);
+        }
+        close(conn);
+        close(report[0]);
+        
+        for(int i = 0; i < 3; ++i){
+            dup2(fds[i], i);
+            close(fds[i]);
+        }
+        
+        int status = run_worker(state, req, cwd, report[1]);
+        std::cout.flush();
+        std::exit(status);
+    }
+    
+    for(int fd : fds)
+        close(fd);
+    close(report[1]);
+    
+    if(pid < 0){
+        close(report[0]);
+        close(conn);
+        return false;
+    }
+    
+    workers.push_back({number, pid, conn, report[0], "", req.theme_file, req.jobs.size(), server_clock::now()});
+    return true;
+}
+
+//Reads what the worker has reported. Returns false once it has closed the pipe,
+//which it does by exiting
+static bool read_report(worker& w){
+    char buf[256];
+    for(;;){
+        ssize_t n = read(w.report, buf, sizeof(buf));
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        
+        w.names.append(buf, n);
+        return true;
+    }
+}
+
+//Reaps a worker that has exited, and passes its exit status on to the client
+static int32_t finish_worker(worker& w, print_options opts){
+    close(w.report);
+    
+    int wstatus = 0;
+    int32_t status = EXIT_FAILURE;
+    bool reaped = waitpid(w.pid, &wstatus, 0) == w.pid;
+    if(reaped && WIFEXITED(wstatus))
+        status = WEXITSTATUS(wstatus);
+    
+    write_all(w.conn, &status, sizeof(status));
+    close(w.conn);
+    
+    double ms = std::chrono::duration<double, std::milli>(server_clock::now() - w.start).count();
+    if(PRINT_OPT(NORMAL)){
+        std::cout << "Request " << w.number << ": " << w.n_jobs << " job(s), ";
+        if(reaped && WIFSIGNALED(wstatus))
+            std::cout << "killed by signal " << WTERMSIG(wstatus);
+        else
+            std::cout << "exit status " << status;
+        std::cout << ", " << ms << " ms" << std::endl;
+    }
+    
+    return status;
+}
+
+int serve(print_options opts){
+    int probe = connect_server();
+    if(probe >= 0){
+        close(probe);
+        std::cerr << "ERROR: A server is already running on \"" << socket_path << "\"\n";
+        return EXIT_FAILURE;
+    }
+    
+    //Left behind by a server that did not shut down cleanly
+    unlink(socket_path);
+    
+    //The socket is created accessible to its owner only, see same_user
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr = address();
+    mode_t old_mask = umask(0177);
+    bool bound = listener >= 0 && bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+    umask(old_mask);
+    
+    if(!bound || listen(listener, 16) != 0 || pipe(stop_pipe) != 0){
+        std::cerr << "ERROR: Unable to listen on \"" << socket_path << "\": " << std::strerror(errno) << "\n";
+        return EXIT_FAILURE;
+    }
+    
+    server_pid = getpid();
+    std::signal(SIGPIPE, SIG_IGN);
+    std::signal(SIGINT,  shutdown);
+    std::signal(SIGTERM, shutdown);
+    
+    server_state state(opts);
+    std::list<worker> workers;
+    
+    if(PRINT_OPT(NORMAL))
+        std::cout << "Serving on \"" << socket_path << "\"" << std::endl;
+    
+    //Requests are served concurrently: the server keeps accepting while workers run,
+    //and reaps each one when its report pipe closes
+    for(size_t n_requests = 1;;){
+        std::vector<pollfd> polled = { { stop_pipe[0], POLLIN, 0 }, { listener, POLLIN, 0 } };
+        for(const worker& w : workers)
+            polled.push_back({ w.report, POLLIN, 0 });
+        
+        if(poll(polled.data(), polled.size(), -1) < 0)
+            continue;
+        if(polled[0].revents)
+            break;
+        
+        size_t i = 2;
+        for(auto it = workers.begin(); it != workers.end(); ++i){
+            if(!polled[i].revents || read_report(*it)){
+                ++it;
+                continue;
+            }
+            
+            if(finish_worker(*it, opts) == EXIT_SUCCESS)
+                state.adopt(it->theme_file, it->names);
+            it = workers.erase(it);
+        }
+        
+        if(polled[1].revents && start_worker(state, listener, workers, n_requests))
+            ++n_requests;
+    }
+    
+    //Requests that are still running fail, like an interrupted local run
+    unlink(socket_path);
+    for(worker& w : workers){
+        kill(w.pid, SIGTERM);
+        while(read_report(w));
+        finish_worker(w, opts);
+    }
+    
+    return EXIT_SUCCESS;
+}
+
+/* ---------------------------------------------------------------------- */
+/*  Client                                                                */
+/* ---------------------------------------------------------------------- */
+
+bool request(const katelistings_request& req, int& status){
+    char cwd[PATH_MAX];
+    if(!getcwd(cwd, sizeof(cwd)))
+        return false;
+    
+    int sock = connect_server();
+    if(sock < 0)
+        return false;
+    
+    //The worker writes to the same streams, so anything buffered goes first
+    std::cout.flush();
+    std::cerr.flush();
+    
+    const int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    int32_t result;
+    
+    bool success = send_request(sock, encode(req, cwd), fds)
+                && read_all(sock, &result, sizeof(result));
+    close(sock);
+    
+    if(success)
+        status = result;
+    return success;
+}
+
+};
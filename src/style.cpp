@@ -1,5 +1,7 @@
 #include "katelistings.hpp"
 
+#include <sstream>
+
 std::string language::style::format_colour(const std::string& col, const dom_element& src){
     std::string err = "Invalid colour \"" + col + "\"\n\t(Colours must be specified as \"#rgb\" or \"#rrggbb\" where r,g,b are hexadecimal digits)";
     
@@ -32,3 +34,63 @@ std::string language::style::format_colour(const std::string& col, const dom_ele
     
     return result;
 }
+
+void language::style::set_latex(const std::string& lang_name){
+    raw.open.clear();
+    named.open.clear();
+    wrapped.open.clear();
+    size_t groups = 1, wraps = 0;
+    
+    if(bg_colour != "FFFFFF"){
+        ++groups;
+        ++wraps;
+        raw.open     += "\\colorbox[HTML]{" + bg_colour + "}{";
+        named.open   += "\\colorbox{kl" + bg_colour + "}{";
+        wrapped.open += "\\colorbox[HTML]{" + bg_colour + "}{";
+    }
+    
+    raw.open   += "\\textcolor[HTML]{" + colour + "}{";
+    named.open += "\\textcolor{kl" + colour + "}{";
+    
+    std::string flags;
+    if(bold){
+        ++groups;
+        flags += "\\textbf{";
+    }
+    if(italic){
+        ++groups;
+        flags += "\\textit{";
+    }
+    raw.open   += flags;
+    named.open += flags;
+    
+    flags.clear();
+    if(underline){
+        ++groups;
+        ++wraps;
+        flags += "\\underline{";
+    }
+    if(strikethrough){
+        ++groups;
+        ++wraps;
+        flags += "\\sout{";
+    }
+    raw.open     += flags;
+    named.open   += flags;
+    wrapped.open += flags;
+    
+    raw.close.assign(groups, '}');
+    named.close = raw.close;
+    wrapped.close.assign(wraps, '}');
+    
+    std::ostringstream cmd;
+    {
+        util::output_buffer obuf(cmd);
+        obuf << '\\';
+        name_escape(obuf, lang_name);
+        name_escape(obuf, name);
+        obuf << '{';
+    }
+    command.open = cmd.str();
+    command.close = "}";
+}